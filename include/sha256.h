@@ -0,0 +1,42 @@
+/* Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef __CROS_EC_SHA256_H
+#define __CROS_EC_SHA256_H
+/* SHA-256 (FIPS 180-4), to check EC_CMD_VBOOT_HASH results on the host */
+
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+
+struct sha256_ctx {
+	uint32_t h[8];
+	uint64_t total_len;
+	uint32_t block_len;
+	uint8_t block[SHA256_BLOCK_SIZE];
+	uint8_t buf[SHA256_DIGEST_SIZE];
+};
+
+void SHA256_init(struct sha256_ctx *ctx);
+
+/**
+ * Add data to the hash.
+ *
+ * @param ctx   SHA-256 context.
+ * @param data  Data to hash.
+ * @param len   Size of <data> in bytes.
+ */
+void SHA256_update(struct sha256_ctx *ctx, const uint8_t *data, uint32_t len);
+
+/**
+ * Finish the hash.
+ *
+ * @param ctx   SHA-256 context.
+ * @return Pointer to the SHA256_DIGEST_SIZE byte digest, inside <ctx>.
+ */
+uint8_t *SHA256_final(struct sha256_ctx *ctx);
+
+#endif /* __CROS_EC_SHA256_H */
@@ -0,0 +1,185 @@
+/* Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Client side of the ectool daemon: each host command becomes one request
+ * frame on the daemon's Unix domain socket.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "comm-daemon.h"
+#include "comm-host.h"
+#include "ec_commands.h"
+#include "misc_util.h"
+
+static int daemon_fd = -1;
+static char daemon_transport[sizeof(((struct ec_daemon_info *)0)->transport) +
+			     8];
+
+static int daemon_read_all(void *buf, int size)
+{
+	uint8_t *p = (uint8_t *)buf;
+	int n;
+
+	while (size) {
+		n = read(daemon_fd, p, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static int daemon_write_all(struct iovec *iov, int iovcnt)
+{
+	int n;
+
+	while (iovcnt) {
+		n = writev(daemon_fd, iov, iovcnt);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		while (iovcnt && n >= (int)iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (uint8_t *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Send one request and wait for its response.  Returns the daemon's result,
+ * or -EC_RES_ERROR if the connection failed.
+ */
+static int daemon_transact(int op, int command, int version,
+			   const void *outdata, int outsize, void *indata,
+			   int insize)
+{
+	struct ec_daemon_request req;
+	struct ec_daemon_response resp;
+	struct iovec iov[2];
+	uint8_t discard[64];
+	int len, n;
+
+	if (outsize < 0 || outsize > 0xffff || insize < 0 || insize > 0xffff)
+		return -EC_RES_INVALID_PARAM;
+
+	memset(&req, 0, sizeof(req));
+	req.struct_version = EC_DAEMON_VERSION;
+	req.op = op;
+	req.command = command;
+	req.command_version = version;
+	req.data_len = outsize;
+	req.insize = insize;
+
+	iov[0].iov_base = &req;
+	iov[0].iov_len = sizeof(req);
+	iov[1].iov_base = (void *)outdata;
+	iov[1].iov_len = outsize;
+	if (daemon_write_all(iov, outsize ? 2 : 1) ||
+	    daemon_read_all(&resp, sizeof(resp))) {
+		fprintf(stderr, "Lost connection to ectool daemon\n");
+		return -EC_RES_ERROR;
+	}
+	if (resp.struct_version != EC_DAEMON_VERSION) {
+		fprintf(stderr, "Bad ectool daemon response version %d\n",
+			resp.struct_version);
+		return -EC_RES_ERROR;
+	}
+
+	/* Never overrun the caller's buffer; drop anything beyond it */
+	len = MIN(resp.data_len, insize);
+	if (daemon_read_all(indata, len))
+		return -EC_RES_ERROR;
+	for (len = resp.data_len - len; len > 0; len -= n) {
+		n = MIN(len, (int)sizeof(discard));
+		if (daemon_read_all(discard, n))
+			return -EC_RES_ERROR;
+	}
+
+	return resp.result;
+}
+
+static int ec_command_daemon(int command, int version, const void *outdata,
+			     int outsize, void *indata, int insize)
+{
+	return daemon_transact(EC_DAEMON_OP_COMMAND, command, version, outdata,
+			       outsize, indata, insize);
+}
+
+static int ec_readmem_daemon(int offset, int bytes, void *dest)
+{
+	return daemon_transact(EC_DAEMON_OP_READMEM, offset, bytes ? 0 : 1,
+			       NULL, 0, dest, bytes ? bytes : EC_MEMMAP_TEXT_MAX);
+}
+
+int comm_init_daemon(const char *path)
+{
+	struct sockaddr_un addr;
+	struct ec_daemon_info info;
+	int rv;
+
+	if (!path)
+		path = EC_DAEMON_SOCKET;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return 1;
+	}
+
+	daemon_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (daemon_fd < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (connect(daemon_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Unable to connect to %s: %s\n", path,
+			strerror(errno));
+		close(daemon_fd);
+		daemon_fd = -1;
+		return 1;
+	}
+
+	memset(&info, 0, sizeof(info));
+	rv = daemon_transact(EC_DAEMON_OP_INFO, 0, 0, NULL, 0, &info,
+			     sizeof(info));
+	if (rv != sizeof(info)) {
+		fprintf(stderr, "Unable to query ectool daemon\n");
+		close(daemon_fd);
+		daemon_fd = -1;
+		return 1;
+	}
+
+	snprintf(daemon_transport, sizeof(daemon_transport), "daemon:%.*s",
+		 (int)sizeof(info.transport), info.transport);
+
+	ec_command_proto = ec_command_daemon;
+	ec_readmem = ec_readmem_daemon;
+	ec_transport_name = daemon_transport;
+
+	/* The daemon has already negotiated the sizes with the EC */
+	ec_max_outsize = info.max_outsize;
+	ec_max_insize = info.max_insize;
+
+	return 0;
+}
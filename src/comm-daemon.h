@@ -0,0 +1,88 @@
+/* Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * ectool daemon: one process owns the EC transport and serves host commands
+ * to local clients over a Unix domain socket.
+ */
+
+#ifndef __UTIL_COMM_DAEMON_H
+#define __UTIL_COMM_DAEMON_H
+
+#include "common.h"
+#include "ec_commands.h"
+
+/* Default socket path, used when no --name is given */
+#define EC_DAEMON_SOCKET "/run/ectoold.sock"
+
+#define EC_DAEMON_VERSION 1
+
+enum ec_daemon_op {
+	/* Send host command 'command', version 'command_version' */
+	EC_DAEMON_OP_COMMAND = 0,
+	/*
+	 * Read 'insize' bytes of the memory map at offset 'command', or a
+	 * string of at most EC_MEMMAP_TEXT_MAX bytes if 'command_version'
+	 * is 1.
+	 */
+	EC_DAEMON_OP_READMEM = 1,
+	/* Return struct ec_daemon_info */
+	EC_DAEMON_OP_INFO = 2,
+};
+
+/*
+ * Request frame header, followed by data_len bytes of request data.  Laid
+ * out like struct ec_host_request; the checksum byte is replaced by the
+ * operation, since the socket is reliable, and the maximum response size
+ * follows.
+ */
+struct ec_daemon_request {
+	uint8_t struct_version;
+	uint8_t op;
+	uint16_t command;
+	uint8_t command_version;
+	uint8_t reserved;
+	uint16_t data_len;
+	uint16_t insize;
+	uint16_t reserved2;
+} __ec_align4;
+
+/*
+ * Response frame header, followed by data_len bytes of response data.
+ * 'result' is the return value of ec_command() or ec_readmem() in the
+ * daemon.
+ */
+struct ec_daemon_response {
+	uint8_t struct_version;
+	uint8_t reserved;
+	uint16_t data_len;
+	int32_t result;
+} __ec_align4;
+
+struct ec_daemon_info {
+	uint16_t max_outsize;
+	uint16_t max_insize;
+	char transport[12];
+} __ec_align4;
+
+/**
+ * Initialize the daemon transport.
+ *
+ * @param path	Socket path, or NULL to use EC_DAEMON_SOCKET.
+ * @return 0 if success, non-zero otherwise.
+ */
+int comm_init_daemon(const char *path);
+
+/**
+ * Serve host commands on a Unix domain socket until SIGINT or SIGTERM.
+ *
+ * The transport must already be initialized.  Clients are served round
+ * robin, one request each per round, and identical read-only requests
+ * pending in the same round are sent to the EC only once.
+ *
+ * @param path	Socket path, or NULL to use EC_DAEMON_SOCKET.
+ * @return 0 if success, non-zero otherwise.
+ */
+int ec_daemon_run(const char *path);
+
+#endif /* __UTIL_COMM_DAEMON_H */
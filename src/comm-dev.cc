@@ -125,6 +125,51 @@ static int ec_readmem_dev(int offset, int bytes, void *dest)
 
 /* New ioctl format, used by Chrome OS 4.4 and later as well as upstream 4.0+ */
 
+/*
+ * Command buffer for the v2 ioctl, kept across commands.  It only grows, to
+ * at least the current maximum request/response size, so it is reallocated
+ * only when those limits change.  Its data area is what ec_command_buffer()
+ * returns, so callers can build requests and receive responses in place.
+ */
+static struct cros_ec_command_v2 *dev_cmd;
+static int dev_cmd_size; /* Size of dev_cmd->data */
+
+#define DEV_CMD_ALIGN 64
+
+static int dev_cmd_reserve(int size)
+{
+	void *buf;
+
+	if (size <= dev_cmd_size)
+		return 0;
+
+	size = MAX(size, MAX(ec_max_outsize, ec_max_insize));
+	if (posix_memalign(&buf, DEV_CMD_ALIGN,
+			   sizeof(struct cros_ec_command_v2) + size))
+		return -1;
+
+	free(dev_cmd);
+	dev_cmd = (struct cros_ec_command_v2 *)buf;
+	dev_cmd_size = size;
+	return 0;
+}
+
+static void *ec_command_buffer_dev_v2(int size)
+{
+	if (dev_cmd_reserve(size))
+		return NULL;
+	return dev_cmd->data;
+}
+
+/* Whether 'p' points into the buffer from ec_command_buffer_dev_v2() */
+static bool in_dev_cmd(const void *p)
+{
+	const uint8_t *b = (const uint8_t *)p;
+
+	return dev_cmd && b >= dev_cmd->data &&
+	       b < dev_cmd->data + dev_cmd_size;
+}
+
 static int ec_command_dev_v2(int command, int version, const void *outdata,
 			     int outsize, void *indata, int insize)
 {
@@ -134,17 +179,23 @@ static int ec_command_dev_v2(int command, int version, const void *outdata,
 	assert(outsize == 0 || outdata != NULL);
 	assert(insize == 0 || indata != NULL);
 
-	s_cmd = (struct cros_ec_command_v2 *)(malloc(
-		sizeof(struct cros_ec_command_v2) + MAX(outsize, insize)));
-	if (s_cmd == NULL)
-		return -EC_RES_ERROR;
+	if (MAX(outsize, insize) > dev_cmd_size) {
+		/* Can't move the buffer from under the caller */
+		if (in_dev_cmd(outdata) || in_dev_cmd(indata))
+			return -EC_RES_INVALID_PARAM;
+		if (dev_cmd_reserve(MAX(outsize, insize)))
+			return -EC_RES_ERROR;
+	}
+	s_cmd = dev_cmd;
 
 	s_cmd->command = command;
 	s_cmd->version = version;
 	s_cmd->result = 0xff;
 	s_cmd->outsize = outsize;
 	s_cmd->insize = insize;
-	memcpy(s_cmd->data, outdata, outsize);
+	/* Either may point elsewhere into the buffer, so may overlap */
+	if (outsize && outdata != s_cmd->data)
+		memmove(s_cmd->data, outdata, outsize);
 
 	r = ioctl(fd, CROS_EC_DEV_IOCXCMD_V2, s_cmd);
 	if (r < 0) {
@@ -164,14 +215,14 @@ static int ec_command_dev_v2(int command, int version, const void *outdata,
 		}
 	}
 	if (r >= 0) {
-		memcpy(indata, s_cmd->data, MIN(r, insize));
+		if (indata != s_cmd->data)
+			memmove(indata, s_cmd->data, MIN(r, insize));
 		if (s_cmd->result != EC_RES_SUCCESS) {
 			fprintf(stderr, "EC result %d (%s)\n", s_cmd->result,
 				strresult(s_cmd->result));
 			r = -EECRESULT - s_cmd->result;
 		}
 	}
-	free(s_cmd);
 
 	return r;
 }
@@ -190,7 +241,8 @@ static int ec_readmem_dev_v2(int offset, int bytes, void *dest)
 		if (r < 0 && errno == ENOTTY) {
 			fake_it = 1;
 		} else {
-			memcpy(dest, s_mem.buffer, bytes);
+			if (r >= 0)
+				memcpy(dest, s_mem.buffer, bytes);
 			return r;
 		}
 	}
@@ -273,6 +325,7 @@ int comm_init_dev(const char *device_name)
 
 	if (ec_dev_is_v2()) {
 		ec_command_proto = ec_command_dev_v2;
+		ec_command_buffer_proto = ec_command_buffer_dev_v2;
 		ec_cmd_readmem = ec_readmem_dev_v2;
 	} else {
 		ec_command_proto = ec_command_dev;
@@ -283,6 +336,7 @@ int comm_init_dev(const char *device_name)
 	    version[0] == 'E' && version[1] == 'C')
 		ec_readmem = ec_cmd_readmem;
 	ec_pollevent = ec_pollevent_dev;
+	ec_transport_name = "dev";
 
 	/*
 	 * Set temporary size, will be updated later.
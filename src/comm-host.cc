@@ -10,8 +10,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <chrono>
+
 #include "comm-host.h"
 #include "ec_commands.h"
+#include "ec_memmap.h"
+#include "ec_stats.h"
 #include "misc_util.h"
 
 #ifndef _WIN32
@@ -21,12 +25,18 @@
 int (*ec_command_proto)(int command, int version, const void *outdata,
 			int outsize, void *indata, int insize);
 
+void *(*ec_command_buffer_proto)(int size);
+
+int (*ec_command_batch_proto)(struct ec_command_batch_entry *cmds, int count);
+
 int (*ec_readmem)(int offset, int bytes, void *dest);
 
 int (*ec_pollevent)(unsigned long mask, void *buffer, size_t buf_size,
 		    int timeout);
 
 int ec_max_outsize, ec_max_insize;
+const char *ec_transport_name;
+char ec_device_id[48];
 void *ec_outbuf;
 void *ec_inbuf;
 static int command_offset;
@@ -74,12 +84,92 @@ void set_command_offset(int offset)
 	command_offset = offset;
 }
 
+void *ec_command_buffer(int size)
+{
+	static void *buf;
+	static int buf_size;
+	void *p;
+
+	/* The transport's own buffer if it has one, else a plain one */
+	if (ec_command_buffer_proto) {
+		p = ec_command_buffer_proto(size);
+		if (p)
+			return p;
+	}
+
+	if (size > buf_size) {
+		free(buf);
+		buf = malloc(size);
+		buf_size = buf ? size : 0;
+	}
+	return buf;
+}
+
 int ec_command(int command, int version, const void *outdata, int outsize,
 	       void *indata, int insize)
 {
+	std::chrono::steady_clock::time_point start;
+	int rv;
+
+	/* Any command but a memory map read may change the memory map */
+	if (command != EC_CMD_READ_MEMMAP)
+		ec_memmap_invalidate();
+
 	/* Offset command code to support sub-devices */
-	return ec_command_proto(command_offset + command, version, outdata,
-				outsize, indata, insize);
+	if (!ec_stats_enabled)
+		return ec_command_proto(command_offset + command, version,
+					outdata, outsize, indata, insize);
+
+	start = std::chrono::steady_clock::now();
+	rv = ec_command_proto(command_offset + command, version, outdata,
+			      outsize, indata, insize);
+	ec_stats_record(command_offset + command, version, outsize, rv,
+			std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - start)
+				.count());
+	return rv;
+}
+
+int ec_command_batch(struct ec_command_batch_entry *cmds, int count)
+{
+	std::chrono::steady_clock::time_point start;
+	uint64_t nsec;
+	int i, n;
+
+	if (!ec_command_batch_proto) {
+		for (i = 0; i < count; i++) {
+			cmds[i].result = ec_command(
+				cmds[i].command, cmds[i].version,
+				cmds[i].outdata, cmds[i].outsize,
+				cmds[i].indata, cmds[i].insize);
+			if (cmds[i].result < 0)
+				return i;
+		}
+		return count;
+	}
+
+	ec_memmap_invalidate();
+
+	start = std::chrono::steady_clock::now();
+	for (i = 0; i < count; i++)
+		cmds[i].command += command_offset;
+	n = ec_command_batch_proto(cmds, count);
+	for (i = 0; i < count; i++)
+		cmds[i].command -= command_offset;
+
+	if (ec_stats_enabled) {
+		/* Share the time out among the commands which completed */
+		nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			       std::chrono::steady_clock::now() - start)
+			       .count();
+		nsec /= MIN(n + 1, count) ? MIN(n + 1, count) : 1;
+		for (i = 0; i < MIN(n + 1, count); i++)
+			ec_stats_record(command_offset + cmds[i].command,
+					cmds[i].version, cmds[i].outsize,
+					cmds[i].result, nsec);
+	}
+
+	return n;
 }
 
 int comm_init_alt(int interfaces, const char *device_name, int i2c_bus)
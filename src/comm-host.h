@@ -18,6 +18,15 @@
 /* Maximum output and input sizes for EC command, in bytes */
 extern int ec_max_outsize, ec_max_insize;
 
+/* Name of the transport in use (e.g. "dev", "lpc"), set by comm_init_*() */
+extern const char *ec_transport_name;
+
+/*
+ * Device in use, as "<device name>/<sub-device>", to tell apart ECs on one
+ * transport in saved state.  Set by main().
+ */
+extern char ec_device_id[48];
+
 /*
  * Maximum-size output and input buffers, for use by callers.  This saves each
  * caller needing to allocate/free its own buffers.
@@ -32,6 +41,8 @@ enum comm_interface {
 	COMM_I2C = BIT(2),
 	COMM_SERVO = BIT(3),
 	COMM_USB = BIT(4),
+	COMM_SIM = BIT(5),
+	COMM_DAEMON = BIT(6),
 	COMM_ALL = -1
 };
 
@@ -70,6 +81,42 @@ int ec_command(int command, int version, const void *outdata,
 			     */
 	       void *indata, int insize); /* from the EC */
 
+/* One command of a batch, see ec_command_batch() */
+struct ec_command_batch_entry {
+	int command;
+	int version;
+	const void *outdata;
+	int outsize;
+	void *indata;
+	int insize;
+	/* Set to what ec_command() would have returned, once sent */
+	int result;
+};
+
+/**
+ * Send a sequence of independent commands, in order.  Transports which can
+ * keep several commands in flight do so; the others send them one by one.
+ * No command is sent after one fails, though with several in flight the
+ * following ones may already have been.  Each entry needs its own request
+ * and response buffers.
+ *
+ * @return the number of leading commands which succeeded; 'count' if all
+ *	   did, otherwise cmds[return value].result holds the error.
+ */
+int ec_command_batch(struct ec_command_batch_entry *cmds, int count);
+
+/**
+ * Return a buffer of at least 'size' bytes in which to build the request of
+ * the next ec_command() and receive its response; outdata and indata may
+ * both point into it.  Transports which hand this buffer to the kernel
+ * directly then copy neither the request nor the response.  The contents
+ * are only valid until the next command, and the buffer itself until the
+ * next call.
+ *
+ * @return the buffer, or NULL if it can't be allocated.
+ */
+void *ec_command_buffer(int size);
+
 /**
  * Set the offset to be applied to the command number when ec_command() calls
  * ec_command_proto().
@@ -86,6 +133,20 @@ extern int (*ec_command_proto)(int command, int version, const void *outdata,
 			       int outsize, /* to EC */
 			       void *indata, int insize); /* from EC */
 
+/**
+ * Send a batch for ec_command_batch(), with the command offset already
+ * applied.  Optional; set by protocol-specific drivers which can keep
+ * several commands in flight.
+ */
+extern int (*ec_command_batch_proto)(struct ec_command_batch_entry *cmds,
+				     int count);
+
+/**
+ * Return a buffer for ec_command_buffer(), or NULL to use the default one.
+ * Optional; set by protocol-specific drivers which can avoid copies.
+ */
+extern void *(*ec_command_buffer_proto)(int size);
+
 /**
  * Return the content of the EC information area mapped as "memory".
  * The offsets are defined by the EC_MEMMAP_ constants. Returns the number
@@ -22,6 +22,7 @@
 
 #include "comm-host.h"
 #include "i2c.h"
+#include "misc_util.h"
 
 #define EC_I2C_ADDR 0x1e
 
@@ -58,6 +59,237 @@ static void dump_buffer(const uint8_t *data, int length)
 	fprintf(stderr, "\n");
 }
 
+/*
+ * Write to read turnaround.  Some chips (such as the MAX32660) cannot handle
+ * the response being read right after the request was written, so by
+ * default the two are sent separately, with a delay between them if
+ * needed.  The shortest gap which works is found once per adapter and
+ * remembered in I2C_STATE_FILE.  If the EC later keeps dropping transfers
+ * the gap is lengthened, and after a run of clean commands it is brought
+ * back towards the calibrated one.  Remove the file to calibrate again.
+ */
+#define I2C_STATE_FILE "/run/ectool-i2c.state"
+#define I2C_ADAPTER_NAME_NODE "/sys/class/i2c-adapter/i2c-%d/name"
+
+/* Write and read in one I2C_RDWR, with a repeated start between them */
+#define I2C_TURNAROUND_COMBINED -1
+/* Otherwise the delay between the two transfers, in us */
+#define I2C_TURNAROUND_FIRST_STEP 50
+#define I2C_TURNAROUND_MAX 10000
+
+/* Commands needed back to back to accept a turnaround */
+#define I2C_CALIBRATE_PASSES 8
+/*
+ * Retries of a failed transfer, and the wait before the first one.  The
+ * first retry keeps the turnaround, later ones lengthen it.
+ */
+#define I2C_CMD_RETRIES 3
+#define I2C_BACKOFF_US 1000
+/* Clean commands before trying a lengthened turnaround one step shorter */
+#define I2C_DECAY_COMMANDS 256
+
+static int i2c_bus_num = -1;
+static char i2c_adapter[64];
+static int i2c_turnaround;
+static int i2c_turnaround_saved;
+/* Shortest turnaround found by calibration */
+static int i2c_turnaround_floor;
+static int i2c_clean_commands;
+static int i2c_calibrating;
+
+static int turnaround_next(int t)
+{
+	if (t < 0)
+		return 0;
+	if (t == 0)
+		return I2C_TURNAROUND_FIRST_STEP;
+	return MIN(t * 2, I2C_TURNAROUND_MAX);
+}
+
+static int turnaround_prev(int t)
+{
+	if (t <= 0)
+		return I2C_TURNAROUND_COMBINED;
+	if (t <= I2C_TURNAROUND_FIRST_STEP)
+		return 0;
+	return t / 2;
+}
+
+static int turnaround_valid(int t)
+{
+	return t >= I2C_TURNAROUND_COMBINED && t <= I2C_TURNAROUND_MAX;
+}
+
+/*
+ * The state file has one line per bus: bus number, current and calibrated
+ * turnaround, and adapter name.  Returns 0 if it had a line for the current
+ * bus and adapter, and loads it.
+ */
+static int i2c_state_load(void)
+{
+	char name[sizeof(i2c_adapter)];
+	int bus, t, floor;
+	int ret = -1;
+	FILE *f;
+
+	f = fopen(I2C_STATE_FILE, "r");
+	if (!f)
+		return ret;
+	while (fscanf(f, "%d %d %d %63[^\n]", &bus, &t, &floor, name) == 4) {
+		if (bus == i2c_bus_num && !strcmp(name, i2c_adapter) &&
+		    turnaround_valid(t) && turnaround_valid(floor)) {
+			i2c_turnaround = t;
+			i2c_turnaround_saved = t;
+			i2c_turnaround_floor = floor;
+			ret = 0;
+		}
+	}
+	fclose(f);
+	return ret;
+}
+
+static void i2c_state_save(void)
+{
+	static bool reported;
+	char key[16], line[128];
+
+	snprintf(key, sizeof(key), "%d", i2c_bus_num);
+	snprintf(line, sizeof(line), "%d %d %d %s\n", i2c_bus_num,
+		 i2c_turnaround, i2c_turnaround_floor, i2c_adapter);
+	if (!state_file_update(I2C_STATE_FILE, key, line)) {
+		i2c_turnaround_saved = i2c_turnaround;
+	} else if (!reported) {
+		/* Not fatal; we will just calibrate again next time */
+		fprintf(stderr,
+			"Warning: cannot save I2C turnaround to %s: %s\n",
+			I2C_STATE_FILE, strerror(errno));
+		reported = true;
+	}
+}
+
+/*
+ * Write the request and read the response, separated by the current
+ * turnaround.  Returns 0 if success, -1 if the write failed or -2 if the
+ * read failed, with errno set.
+ */
+static int i2c_xfer(uint8_t *req_buf, int req_len, uint8_t *resp_buf,
+		    int resp_len)
+{
+	struct i2c_msg i2c_msg[2];
+	struct i2c_rdwr_ioctl_data data;
+
+	i2c_msg[0].addr = EC_I2C_ADDR;
+	i2c_msg[0].flags = 0;
+	i2c_msg[0].len = req_len;
+	i2c_msg[0].buf = req_buf;
+
+	i2c_msg[1].addr = EC_I2C_ADDR;
+	i2c_msg[1].flags = I2C_M_RD;
+	i2c_msg[1].len = resp_len;
+	i2c_msg[1].buf = resp_buf;
+
+	data.msgs = i2c_msg;
+	if (i2c_turnaround == I2C_TURNAROUND_COMBINED) {
+		data.nmsgs = 2;
+		return ioctl(i2c_fd, I2C_RDWR, &data) < 0 ? -1 : 0;
+	}
+
+	data.nmsgs = 1;
+	if (ioctl(i2c_fd, I2C_RDWR, &data) < 0)
+		return -1;
+	if (i2c_turnaround)
+		usleep(i2c_turnaround);
+	data.msgs = &i2c_msg[1];
+	return ioctl(i2c_fd, I2C_RDWR, &data) < 0 ? -2 : 0;
+}
+
+/*
+ * Run one transfer and check the response.  Returns the response length, or
+ * a negative EC_RES_* value on error.  On error, *resend is set if the EC
+ * cannot have accepted the request, so it is safe to send it again, and
+ * *late if the response was missed or garbled, which suggests the EC needs
+ * a longer turnaround.  The EC may have run the command in the second case,
+ * so it must not be resent.  Errors are only reported if not resending, or
+ * if 'last'.
+ */
+static int i2c_transact(int command, uint8_t *req_buf, int req_len,
+			uint8_t *resp_buf, int resp_len, int insize, int last,
+			int *resend, int *late)
+{
+	struct ec_host_response *resp;
+	uint8_t command_return_code;
+	int report;
+	int error;
+
+	*resend = 0;
+	*late = 0;
+	report = last && !i2c_calibrating;
+	memset(resp_buf, 0, resp_len);
+
+	if (IS_ENABLED(DEBUG)) {
+		fprintf(stderr, "Sending: 0x");
+		dump_buffer(req_buf, req_len);
+	}
+
+	error = i2c_xfer(req_buf, req_len, resp_buf, resp_len);
+	if (error) {
+		/*
+		 * The EC NAKs while it is not ready for us.  Only a NAK of
+		 * a write on its own shows the request was not taken; in a
+		 * combined transfer it may have been the read.
+		 */
+		*late = errno == ENXIO || errno == EREMOTEIO || errno == EIO ||
+			errno == ETIMEDOUT || errno == EAGAIN;
+		*resend = *late && error == -1 &&
+			  i2c_turnaround != I2C_TURNAROUND_COMBINED;
+		if (report || (!*resend && !i2c_calibrating))
+			fprintf(stderr, "I2C %s failed: %d (err: %d, %s)\n",
+				error == -1 ? "write" : "read", error, errno,
+				strerror(errno));
+		return -EC_RES_ERROR;
+	}
+
+	if (IS_ENABLED(DEBUG)) {
+		fprintf(stderr, "Received: 0x");
+		dump_buffer(resp_buf, resp_len);
+	}
+
+	command_return_code = resp_buf[0];
+	if (command_return_code != EC_RES_SUCCESS) {
+		debug("command 0x%02x returned an error %d\n", command,
+		      command_return_code);
+		/* The EC rejected the request without running it */
+		*resend = command_return_code == EC_RES_INVALID_CHECKSUM ||
+			  command_return_code == EC_RES_REQUEST_TRUNCATED ||
+			  command_return_code == EC_RES_INVALID_HEADER;
+		/* Not an EC result, so not the EC's answer */
+		*late = command_return_code > EC_RES_DUP_UNAVAILABLE;
+		return -EECRESULT - command_return_code;
+	}
+
+	if (resp_buf[1] > sizeof(struct ec_host_response) + insize) {
+		debug("EC returned too much data.\n");
+		*late = 1;
+		return -EC_RES_RESPONSE_TOO_BIG;
+	}
+
+	resp = (struct ec_host_response *)(&resp_buf[2]);
+	if (resp->struct_version != EC_HOST_RESPONSE_VERSION) {
+		debug("EC response version mismatch.\n");
+		*late = 1;
+		return -EC_RES_INVALID_RESPONSE;
+	}
+
+	if ((uint8_t)sum_bytes(&resp_buf[I2C_RESPONSE_HEADER_SIZE],
+			       resp_buf[1]) != 0) {
+		debug("Bad checksum on EC response.\n");
+		*late = 1;
+		return -EC_RES_INVALID_CHECKSUM;
+	}
+
+	return resp->data_len;
+}
+
 /*
  * Sends a command to the EC (protocol v3). Returns the command status code
  * (>= 0), or a negative EC_RES_* value on error.
@@ -66,15 +298,11 @@ static int ec_command_i2c_3(int command, int version, const void *outdata,
 			    int outsize, void *indata, int insize)
 {
 	int ret = -EC_RES_ERROR;
-	int error;
 	int req_len, resp_len;
 	uint8_t *req_buf = NULL;
 	uint8_t *resp_buf = NULL;
 	struct ec_host_request *req;
-	struct ec_host_response *resp;
-	uint8_t command_return_code;
-	struct i2c_msg i2c_msg;
-	struct i2c_rdwr_ioctl_data data;
+	int tries, resend, late;
 
 	if (outsize > ec_max_outsize) {
 		fprintf(stderr, "Request is too large (%d > %d).\n", outsize,
@@ -109,86 +337,63 @@ static int ec_command_i2c_3(int command, int version, const void *outdata,
 		(uint8_t)(-sum_bytes(&req_buf[I2C_REQUEST_HEADER_SIZE],
 				     req_len - I2C_REQUEST_HEADER_SIZE));
 
-	i2c_msg.addr = EC_I2C_ADDR;
-	i2c_msg.flags = 0;
-	i2c_msg.len = req_len;
-	i2c_msg.buf = req_buf;
-
 	resp_len = I2C_RESPONSE_HEADER_SIZE + sizeof(struct ec_host_response) +
 		   insize;
 	resp_buf = (uint8_t *)(calloc(1, resp_len));
 	if (!resp_buf)
 		goto done;
-	memset(resp_buf, 0, resp_len);
 
-	if (IS_ENABLED(DEBUG)) {
-		fprintf(stderr, "Sending: 0x");
-		dump_buffer(req_buf, req_len);
-	}
-
-	/*
-	 * Combining these two ioctls makes the write-read interval too short
-	 * for some chips (such as the MAX32660) to handle.
-	 */
-	data.msgs = &i2c_msg;
-	data.nmsgs = 1;
-	error = ioctl(i2c_fd, I2C_RDWR, &data);
-	if (error < 0) {
-		fprintf(stderr, "I2C write failed: %d (err: %d, %s)\n", error,
-			errno, strerror(errno));
-		goto done;
-	}
-
-	i2c_msg.addr = EC_I2C_ADDR;
-	i2c_msg.flags = I2C_M_RD;
-	i2c_msg.len = resp_len;
-	i2c_msg.buf = resp_buf;
-	error = ioctl(i2c_fd, I2C_RDWR, &data);
-	if (error < 0) {
-		fprintf(stderr, "I2C read failed: %d (err: %d, %s)\n", error,
-			errno, strerror(errno));
-		goto done;
-	}
-
-	if (IS_ENABLED(DEBUG)) {
-		fprintf(stderr, "Received: 0x");
-		dump_buffer(resp_buf, resp_len);
-	}
-
-	command_return_code = resp_buf[0];
-	if (command_return_code != EC_RES_SUCCESS) {
-		debug("command 0x%02x returned an error %d\n", command,
-		      command_return_code);
-		ret = -EECRESULT - command_return_code;
-		goto done;
+	for (tries = 0;; tries++) {
+		ret = i2c_transact(command, req_buf, req_len, resp_buf,
+				   resp_len, insize, tries == I2C_CMD_RETRIES,
+				   &resend, &late);
+		/* Calibration wants to see failures, not hide them */
+		if (i2c_calibrating)
+			break;
+		if (late && !resend) {
+			/*
+			 * The EC may have run the command, so give up on it,
+			 * but leave the EC more time from now on.
+			 */
+			i2c_clean_commands = 0;
+			i2c_turnaround = turnaround_next(i2c_turnaround);
+			debug("missed response, turnaround now %d us\n",
+			      i2c_turnaround);
+		}
+		if (!resend || tries == I2C_CMD_RETRIES)
+			break;
+
+		/*
+		 * Back off.  A single failure may just be noise; if it
+		 * happens again, leave the EC more time from now on.
+		 */
+		usleep(I2C_BACKOFF_US << tries);
+		i2c_clean_commands = 0;
+		if (tries) {
+			i2c_turnaround = turnaround_next(i2c_turnaround);
+			debug("retrying, turnaround now %d us\n",
+			      i2c_turnaround);
+		}
 	}
-
-	if (resp_buf[1] > sizeof(struct ec_host_response) + insize) {
-		debug("EC returned too much data.\n");
-		ret = -EC_RES_RESPONSE_TOO_BIG;
+	if (ret < 0)
 		goto done;
-	}
 
-	resp = (struct ec_host_response *)(&resp_buf[2]);
-	if (resp->struct_version != EC_HOST_RESPONSE_VERSION) {
-		debug("EC response version mismatch.\n");
-		ret = -EC_RES_INVALID_RESPONSE;
-		goto done;
+	if (!tries && i2c_turnaround > i2c_turnaround_floor &&
+	    ++i2c_clean_commands >= I2C_DECAY_COMMANDS) {
+		i2c_turnaround = MAX(turnaround_prev(i2c_turnaround),
+				     i2c_turnaround_floor);
+		i2c_clean_commands = 0;
+		debug("turnaround back to %d us\n", i2c_turnaround);
 	}
 
-	if ((uint8_t)sum_bytes(&resp_buf[I2C_RESPONSE_HEADER_SIZE],
-			       resp_buf[1]) != 0) {
-		debug("Bad checksum on EC response.\n");
-		ret = -EC_RES_INVALID_CHECKSUM;
-		goto done;
-	}
+	/* Remember a turnaround which had to be changed */
+	if (i2c_turnaround != i2c_turnaround_saved && !i2c_calibrating)
+		i2c_state_save();
 
 	memcpy(indata,
 	       &resp_buf[I2C_RESPONSE_HEADER_SIZE +
 			 sizeof(struct ec_host_response)],
 	       insize);
-
-	ret = resp->data_len;
 done:
 	if (req_buf)
 		free(req_buf);
@@ -198,6 +403,59 @@ done:
 	return ret;
 }
 
+/* Whether the EC answers a run of hellos with turnaround 't' */
+static bool i2c_calibrate_pass(int t)
+{
+	struct ec_params_hello p;
+	struct ec_response_hello r;
+	int i;
+
+	i2c_turnaround = t;
+	for (i = 0; i < I2C_CALIBRATE_PASSES; i++) {
+		p.in_data = 0xa0b0c0d0 + i;
+		if (ec_command_i2c_3(EC_CMD_HELLO, 0, &p, sizeof(p), &r,
+				     sizeof(r)) != sizeof(r) ||
+		    r.out_data != p.in_data + 0x01020304)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Find the shortest turnaround at which the EC answers a run of hellos.
+ * Start from separate transfers with no delay, which every EC handles, and
+ * lengthen the delay until they pass; only if no delay was needed try a
+ * combined transfer, which some chips cannot take.
+ */
+static void i2c_calibrate(void)
+{
+	bool ok;
+	int t;
+
+	i2c_calibrating = 1;
+	for (t = 0;; t = turnaround_next(t)) {
+		ok = i2c_calibrate_pass(t);
+		if (ok || t == I2C_TURNAROUND_MAX)
+			break;
+	}
+	if (ok && !t && !i2c_calibrate_pass(I2C_TURNAROUND_COMBINED))
+		i2c_turnaround = 0;
+	i2c_calibrating = 0;
+
+	if (!ok) {
+		/* No EC answering, or a broken one; don't record anything */
+		debug("I2C calibration failed\n");
+		i2c_turnaround = 0;
+		i2c_turnaround_saved = 0;
+		i2c_turnaround_floor = 0;
+		return;
+	}
+
+	debug("I2C turnaround %d us\n", i2c_turnaround);
+	i2c_turnaround_floor = i2c_turnaround;
+	i2c_state_save();
+}
+
 int comm_init_i2c(int i2c_bus)
 {
 	char *file_path;
@@ -249,10 +507,32 @@ int comm_init_i2c(int i2c_bus)
 	free(file_path);
 
 	ec_command_proto = ec_command_i2c_3;
+	ec_transport_name = "i2c";
 	ec_max_outsize = I2C_MAX_HOST_PACKET_SIZE - I2C_REQUEST_HEADER_SIZE -
 			 sizeof(struct ec_host_request);
 	ec_max_insize = I2C_MAX_HOST_PACKET_SIZE - I2C_RESPONSE_HEADER_SIZE -
 			sizeof(struct ec_host_response);
 
+	if (i2c_fd < 0)
+		return 0;
+
+	/* Use the turnaround found for this adapter before, if any */
+	i2c_bus_num = i;
+	strcpy(i2c_adapter, "unknown");
+	if (asprintf(&file_path, I2C_ADAPTER_NAME_NODE, i) >= 0) {
+		FILE *f = fopen(file_path, "r");
+
+		if (f) {
+			if (fgets(buffer, sizeof(buffer), f))
+				snprintf(i2c_adapter, sizeof(i2c_adapter), "%.*s",
+					 (int)strcspn(buffer, "\n"), buffer);
+			fclose(f);
+		}
+		free(file_path);
+	}
+
+	if (i2c_state_load())
+		i2c_calibrate();
+
 	return 0;
 }
@@ -0,0 +1,36 @@
+/* Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Direct LPC (x86 port I/O) transport.
+ */
+
+#ifndef __UTIL_COMM_LPC_H
+#define __UTIL_COMM_LPC_H
+
+/**
+ * Initialize the LPC transport.
+ *
+ * @return 0 if success, negative otherwise.
+ */
+int comm_init_lpc(void);
+
+/**
+ * Select how protocol v3 packets are moved over LPC.  Called before
+ * comm_init_lpc(), it selects the engine that will use.
+ *
+ * @param fast	Non-zero to move the packet area 32 bits at a time and
+ *		spin on the busy flag before sleeping; zero for the
+ *		byte-at-a-time engine (the default).  The memory map is
+ *		always read a byte at a time.
+ * @return 0 if success, non-zero if the LPC protocol v3 transport is not in
+ *	   use.
+ */
+int comm_lpc_set_engine(int fast);
+
+/**
+ * Return non-zero if the 32-bit engine is selected.
+ */
+int comm_lpc_get_engine(void);
+
+#endif /* __UTIL_COMM_LPC_H */
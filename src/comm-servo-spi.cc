@@ -13,6 +13,10 @@
  * The USB serial number of the servo board can be passed in the 'name'
  * parameter, e.g. :
  * sudo ectool_servo --name=905537-00474 version
+ *
+ * Each host command is sent as a few queued MPSSE command streams: chip
+ * select, the request and the first status polls go out in one USB
+ * transfer, and the response is read along with the chip select release.
  */
 
 #include <errno.h>
@@ -26,21 +30,37 @@
 #include <libftdi1/ftdi.h>
 
 #include "comm-host.h"
+#include "comm-servo-spi.h"
 #include "cros_ec_dev.h"
+#include "misc_util.h"
 
 /* Servo V2 SPI1 interface identifiers */
 #define SERVO_V2_USB_VID 0x18d1
 #define SERVO_V2_USB_PID 0x5003
 #define SERVO_V2_USB_SPI1_INTERFACE INTERFACE_B
 
-/* SPI clock frequency in Hz */
+/* Default SPI clock frequency in Hz, and the range the MPSSE can divide to */
 #define SPI_CLOCK_FREQ 1000000
+#define SPI_CLOCK_MIN 100
+#define SPI_CLOCK_MAX 30000000
 
 #define FTDI_LATENCY_1MS 2
 
 /* Timeout when waiting for the EC answer to our request */
 #define RESP_TIMEOUT 2 /* second */
 
+/*
+ * While waiting for the EC, clock in this long a run of status bytes per
+ * USB round trip rather than a single byte.
+ */
+#define POLL_WINDOW_US 200
+
+/*
+ * Responses of up to this many bytes are read in the same transfer as their
+ * header; larger ones are read once the header gives their actual length.
+ */
+#define SPECULATIVE_BODY 64
+
 #ifdef DEBUG
 #define debug(format, arg...) printf(format, ##arg)
 #else
@@ -53,6 +73,29 @@ static struct ftdi_context ftdi;
 /* Size of a MPSSE command packet */
 #define MPSSE_CMD_SIZE 3
 
+/*
+ * MPSSE commands are queued and sent in one USB transfer.  The bytes read
+ * by a single transfer must fit the FT4232H receive buffer, or the engine
+ * stalls before the host starts reading.
+ */
+#define MPSSE_QUEUE_SIZE 4096
+#define MPSSE_RX_MAX 2048
+
+static uint8_t mpsse_queue[MPSSE_QUEUE_SIZE];
+static int mpsse_queue_len;
+/* Number of bytes the queued commands will read */
+static int mpsse_queue_rx;
+/* Chip select state set by the queued commands (1 asserted), or -1 */
+static int mpsse_queue_cs = -1;
+/* What the last transfer read */
+static uint8_t mpsse_rx[MPSSE_RX_MAX];
+
+static uint32_t spi_clock = SPI_CLOCK_FREQ;
+/* Status bytes read per poll, from POLL_WINDOW_US at the current clock */
+static int poll_len = 25;
+static int cs_active;
+static int servo_spi_ready;
+
 enum mpsse_commands {
 	ENABLE_ADAPTIVE_CLOCK = 0x96,
 	DISABLE_ADAPTIVE_CLOCK = 0x97,
@@ -92,122 +135,217 @@ static int raw_read(uint8_t *buf, int size)
 	return !!size;
 }
 
-static int mpsse_set_pins(uint8_t levels)
+static void mpsse_queue_reset(void)
 {
-	uint8_t buf[MPSSE_CMD_SIZE] = { 0 };
+	mpsse_queue_len = 0;
+	mpsse_queue_rx = 0;
+	mpsse_queue_cs = -1;
+}
+
+static int mpsse_queue_add(const uint8_t *data, int size)
+{
+	/* Keep one byte for SEND_IMMEDIATE */
+	if (mpsse_queue_len + size >= MPSSE_QUEUE_SIZE)
+		return -1;
+
+	memcpy(mpsse_queue + mpsse_queue_len, data, size);
+	mpsse_queue_len += size;
+	return 0;
+}
+
+static int mpsse_queue_pins(uint8_t levels)
+{
+	uint8_t buf[MPSSE_CMD_SIZE];
 
 	buf[0] = SET_BITS_LOW;
 	buf[1] = levels;
 	buf[2] = PINS_DIR;
 
-	return ftdi_write_data(&ftdi, buf, sizeof(buf)) != sizeof(buf);
+	if (mpsse_queue_add(buf, sizeof(buf)))
+		return -1;
+	mpsse_queue_cs = !(levels & CS_L);
+	return 0;
 }
 
-static int send_request(int cmd, int version, const uint8_t *outdata,
-			size_t outsize)
+/* Queue the header of a 'size' byte SPI transfer */
+static int mpsse_queue_spi_cmd(uint8_t op, int size)
 {
-	uint8_t *txbuf;
-	struct ec_host_request *request;
-	size_t i;
-	int ret = -EC_RES_ERROR;
-	uint8_t csum = 0;
-	size_t block_size = sizeof(struct ec_host_request) + outsize;
-	size_t total_len = MPSSE_CMD_SIZE + block_size;
-
-	txbuf = (uint8_t *)(calloc(1, total_len));
-	if (!txbuf)
-		return -ENOMEM;
-
-	/* MPSSE block size is the full command minus 1 byte */
-	txbuf[0] = SPI_CMD_TXRX;
-	txbuf[1] = ((block_size - 1) & 0xFF);
-	txbuf[2] = (((block_size - 1) >> 8) & 0xFF);
-
-	/* Command header first */
-	request = (struct ec_host_request *)(txbuf + MPSSE_CMD_SIZE);
-	request->struct_version = EC_HOST_REQUEST_VERSION;
-	request->checksum = 0;
-	request->command = cmd;
-	request->command_version = version;
-	request->reserved = 0;
-	request->data_len = outsize;
-
-	/* copy the data to transmit after the command header */
-	memcpy(txbuf + MPSSE_CMD_SIZE + sizeof(struct ec_host_request), outdata,
-	       outsize);
+	uint8_t cmd[MPSSE_CMD_SIZE];
 
-	/* Compute the checksum */
-	for (i = MPSSE_CMD_SIZE; i < total_len; i++)
-		csum += txbuf[i];
-	request->checksum = -csum;
+	if ((op & MPSSE_DO_READ) && mpsse_queue_rx + size > MPSSE_RX_MAX)
+		return -1;
 
-	if (ftdi_write_data(&ftdi, txbuf, total_len) != total_len)
-		goto free_request;
+	/* MPSSE block size is the full transfer minus 1 byte */
+	cmd[0] = op;
+	cmd[1] = ((size - 1) & 0xFF);
+	cmd[2] = (((size - 1) >> 8) & 0xFF);
 
-	if (raw_read(txbuf, block_size) != 0)
-		goto free_request;
+	if (mpsse_queue_add(cmd, sizeof(cmd)))
+		return -1;
+	if (op & MPSSE_DO_READ)
+		mpsse_queue_rx += size;
+	return 0;
+}
 
-	/* Make sure the EC was listening */
-	ret = 0;
-	for (i = 0; i < block_size; i++) {
-		switch (txbuf[i]) {
-		case EC_SPI_PAST_END:
-		case EC_SPI_RX_BAD_DATA:
-		case EC_SPI_NOT_READY:
-			ret = txbuf[i];
-			/* Fall-through */
-		default:
-			break;
-		}
-		if (ret)
-			break;
-	}
+/*
+ * Send everything queued in one transfer, and read what it clocked in into
+ * mpsse_rx.
+ */
+static int mpsse_flush(void)
+{
+	int len = mpsse_queue_len;
+	int rx = mpsse_queue_rx;
+	int cs = mpsse_queue_cs;
 
-free_request:
-	free(txbuf);
-	return ret;
+	mpsse_queue_reset();
+
+	/* Return the read data now rather than at the latency timer */
+	if (rx)
+		mpsse_queue[len++] = SEND_IMMEDIATE;
+
+	if (ftdi_write_data(&ftdi, mpsse_queue, len) != len)
+		return -1;
+	if (rx && raw_read(mpsse_rx, rx))
+		return -1;
+
+	if (cs >= 0)
+		cs_active = cs;
+	return 0;
 }
 
-static int spi_read(uint8_t *buf, size_t size)
+static int mpsse_set_pins(uint8_t levels)
 {
-	uint8_t cmd[MPSSE_CMD_SIZE];
+	if (mpsse_queue_pins(levels))
+		return -1;
+	return mpsse_flush();
+}
 
-	cmd[0] = SPI_CMD_RX;
-	cmd[1] = ((size - 1) & 0xFF);
-	cmd[2] = (((size - 1) >> 8) & 0xFF);
+/* Queue the request packet as a full duplex transfer */
+static int queue_request(int cmd, int version, const uint8_t *outdata,
+			 size_t outsize)
+{
+	struct ec_host_request request;
+	size_t block_size = sizeof(request) + outsize;
+	uint8_t *packet;
+	uint8_t csum = 0;
+	size_t i;
 
-	if (ftdi_write_data(&ftdi, cmd, sizeof(cmd)) != sizeof(cmd))
-		return -EC_RES_ERROR;
+	if (mpsse_queue_spi_cmd(SPI_CMD_TXRX, block_size))
+		return -1;
+	packet = mpsse_queue + mpsse_queue_len;
 
-	return raw_read(buf, size) != 0;
+	request.struct_version = EC_HOST_REQUEST_VERSION;
+	request.checksum = 0;
+	request.command = cmd;
+	request.command_version = version;
+	request.reserved = 0;
+	request.data_len = outsize;
+
+	if (mpsse_queue_add((const uint8_t *)&request, sizeof(request)) ||
+	    (outsize && mpsse_queue_add(outdata, outsize)))
+		return -1;
+
+	/* Compute the checksum */
+	for (i = 0; i < block_size; i++)
+		csum += packet[i];
+	((struct ec_host_request *)packet)->checksum = -csum;
+
+	return 0;
+}
+
+/*
+ * Store 'n' bytes at offset 'pos' of the response frame, which is split
+ * between the header and the caller's buffer.  Bytes past the end of both
+ * are dropped.
+ */
+static void frame_store(struct ec_host_response *hdr, uint8_t *body,
+			size_t bodylen, size_t pos, const uint8_t *src,
+			size_t n)
+{
+	for (; n; n--, pos++, src++) {
+		if (pos < sizeof(*hdr))
+			((uint8_t *)hdr)[pos] = *src;
+		else if (pos - sizeof(*hdr) < bodylen)
+			body[pos - sizeof(*hdr)] = *src;
+		else
+			return;
+	}
 }
 
-static int get_response(uint8_t *bodydest, size_t bodylen)
+/*
+ * Read the next 'n' bytes of the response frame; if 'last', chip select is
+ * released in the same transfer as the final bytes.
+ */
+static int frame_read(struct ec_host_response *hdr, uint8_t *body,
+		      size_t bodylen, size_t *pos, size_t n, int last)
+{
+	size_t chunk;
+
+	while (n) {
+		chunk = MIN(n, MPSSE_RX_MAX);
+		if (mpsse_queue_spi_cmd(SPI_CMD_RX, chunk) ||
+		    (last && chunk == n && mpsse_queue_pins(CS_L)) ||
+		    mpsse_flush()) {
+			mpsse_queue_reset();
+			return -1;
+		}
+		frame_store(hdr, body, bodylen, *pos, mpsse_rx, chunk);
+		*pos += chunk;
+		n -= chunk;
+	}
+	return 0;
+}
+
+/*
+ * Get the response, given that mpsse_rx[start..end) holds the status bytes
+ * already clocked in after the request.
+ */
+static int get_response(int start, int end, uint8_t *bodydest, size_t bodylen)
 {
 	uint8_t sum = 0;
-	size_t i;
+	size_t i, pos;
 	struct ec_host_response hdr;
-	uint8_t status;
+	const uint8_t *frame = NULL;
 	time_t deadline = time(NULL) + RESP_TIMEOUT;
 
 	/*
-	 * Read a byte at a time until we see the start of the frame.
-	 * This is slow, but often still faster than the EC.
+	 * Look for the start of the frame, a window of status bytes at a
+	 * time so each USB round trip covers POLL_WINDOW_US of EC time.
 	 */
-	while (time(NULL) < deadline) {
-		if (spi_read(&status, sizeof(status)))
-			goto read_error;
-		if (status == EC_SPI_FRAME_START)
+	while (1) {
+		if (end > start)
+			frame = (const uint8_t *)memchr(mpsse_rx + start,
+							EC_SPI_FRAME_START,
+							end - start);
+		if (frame)
 			break;
-	}
-	if (status != EC_SPI_FRAME_START) {
-		fprintf(stderr, "timeout wait for response\n");
-		return -EC_RES_ERROR;
+		if (time(NULL) >= deadline) {
+			fprintf(stderr, "timeout wait for response\n");
+			return -EC_RES_ERROR;
+		}
+		if (mpsse_queue_spi_cmd(SPI_CMD_RX, poll_len) ||
+		    mpsse_flush()) {
+			mpsse_queue_reset();
+			goto read_error;
+		}
+		start = 0;
+		end = poll_len;
 	}
 
-	/* Now read the response header */
-	if (spi_read((uint8_t *)(&hdr), sizeof(hdr)))
-		goto read_error;
+	/* Whatever followed the start of frame in the window is kept */
+	frame++;
+	pos = mpsse_rx + end - frame;
+	frame_store(&hdr, bodydest, bodylen, 0, frame, pos);
+
+	/* Small responses are read whole along with the rest of the header */
+	if (pos < sizeof(hdr)) {
+		int whole = bodylen <= SPECULATIVE_BODY;
+
+		if (frame_read(&hdr, bodydest, bodylen, &pos,
+			       sizeof(hdr) + (whole ? bodylen : 0) - pos,
+			       whole))
+			goto read_error;
+	}
 
 	/* Check the header */
 	if (hdr.struct_version != EC_HOST_RESPONSE_VERSION) {
@@ -221,8 +359,10 @@ static int get_response(uint8_t *bodydest, size_t bodylen)
 		return -EC_RES_ERROR;
 	}
 
-	/* Read the data if needed */
-	if (hdr.data_len && spi_read(bodydest, hdr.data_len))
+	/* Read the rest of the data if needed, then release chip select */
+	if (pos < sizeof(hdr) + hdr.data_len &&
+	    frame_read(&hdr, bodydest, bodylen, &pos,
+		       sizeof(hdr) + hdr.data_len - pos, 1))
 		goto read_error;
 
 	/* Verify the checksum */
@@ -235,7 +375,7 @@ static int get_response(uint8_t *bodydest, size_t bodylen)
 		return -EC_RES_ERROR;
 	}
 
-	return hdr.result ? -EECRESULT - hdr.result : 0;
+	return hdr.result ? -EECRESULT - hdr.result : hdr.data_len;
 
 read_error:
 	fprintf(stderr, "Read failed: %s\n", ftdi_get_error_string(&ftdi));
@@ -245,20 +385,47 @@ read_error:
 static int ec_command_servo_spi(int cmd, int version, const void *outdata,
 				int outsize, void *indata, int insize)
 {
+	int block_size = sizeof(struct ec_host_request) + outsize;
+	int window = poll_len;
 	int ret = -EC_RES_ERROR;
+	int i;
 
-	/* Set the chip select low */
-	if (mpsse_set_pins(0) != 0) {
+	/* The request and its echo have to fit in a single transfer */
+	if (block_size > MPSSE_RX_MAX) {
+		fprintf(stderr, "Request too large: %d bytes\n", outsize);
+		return -EC_RES_REQUEST_TRUNCATED;
+	}
+	if (block_size + window > MPSSE_RX_MAX)
+		window = 0;
+
+	/*
+	 * Chip select, the request and the first poll for the response all
+	 * go out in one transfer.
+	 */
+	if (mpsse_queue_pins(0) ||
+	    queue_request(cmd, version, (const uint8_t *)outdata, outsize) ||
+	    (window && mpsse_queue_spi_cmd(SPI_CMD_RX, window)) ||
+	    mpsse_flush()) {
+		mpsse_queue_reset();
 		fprintf(stderr, "Start failed: %s\n",
 			ftdi_get_error_string(&ftdi));
-		return -EC_RES_ERROR;
+		goto release;
 	}
 
-	if (send_request(cmd, version, (const uint8_t *)(outdata), outsize) ==
-	    0)
-		ret = get_response((uint8_t *)(indata), insize);
+	/* Make sure the EC was listening */
+	for (i = 0; i < block_size; i++) {
+		if (mpsse_rx[i] == EC_SPI_PAST_END ||
+		    mpsse_rx[i] == EC_SPI_RX_BAD_DATA ||
+		    mpsse_rx[i] == EC_SPI_NOT_READY)
+			break;
+	}
+	if (i == block_size)
+		ret = get_response(block_size, block_size + window,
+				   (uint8_t *)indata, insize);
 
-	if (mpsse_set_pins(CS_L) != 0) {
+release:
+	/* Usually already released along with the last response bytes */
+	if ((cs_active || ret < 0) && mpsse_set_pins(CS_L) != 0) {
 		fprintf(stderr, "Stop failed: %s\n",
 			ftdi_get_error_string(&ftdi));
 		return -EC_RES_ERROR;
@@ -283,7 +450,7 @@ static int mpsse_set_clock(uint32_t freq)
 		system_clock = 12000000;
 	}
 
-	if (ftdi_write_data(&ftdi, buf, 1) != 1)
+	if (mpsse_queue_add(buf, 1))
 		return -EC_RES_ERROR;
 
 	divisor = (((system_clock / freq) / 2) - 1);
@@ -292,7 +459,27 @@ static int mpsse_set_clock(uint32_t freq)
 	buf[1] = (divisor & 0xFF);
 	buf[2] = ((divisor >> 8) & 0xFF);
 
-	return ftdi_write_data(&ftdi, buf, MPSSE_CMD_SIZE) != MPSSE_CMD_SIZE;
+	if (mpsse_queue_add(buf, MPSSE_CMD_SIZE) || mpsse_flush()) {
+		mpsse_queue_reset();
+		return -EC_RES_ERROR;
+	}
+
+	/* 8 clocks per status byte */
+	poll_len = freq / 8 / (1000000 / POLL_WINDOW_US);
+	poll_len = MIN(MAX(poll_len, 8), 256);
+
+	return 0;
+}
+
+int comm_servo_spi_set_clock(uint32_t freq)
+{
+	if (freq < SPI_CLOCK_MIN || freq > SPI_CLOCK_MAX)
+		return -1;
+
+	spi_clock = freq;
+	if (servo_spi_ready && mpsse_set_clock(freq))
+		return -1;
+	return 0;
 }
 
 static void servo_spi_close(void)
@@ -328,7 +515,7 @@ int comm_init_servo_spi(const char *device_name)
 		goto err_close;
 
 	ftdi_set_bitmode(&ftdi, 0, BITMODE_MPSSE);
-	if (mpsse_set_clock(SPI_CLOCK_FREQ))
+	if (mpsse_set_clock(spi_clock))
 		goto err_close;
 
 	/* Disable FTDI internal loopback */
@@ -343,7 +530,9 @@ int comm_init_servo_spi(const char *device_name)
 	if (mpsse_set_pins(CS_L) != 0)
 		goto err_close;
 
+	servo_spi_ready = 1;
 	ec_command_proto = ec_command_servo_spi;
+	ec_transport_name = "servo";
 	/* Set temporary size, will be updated later. */
 	ec_max_outsize = EC_PROTO2_MAX_PARAM_SIZE - 8;
 	ec_max_insize = EC_PROTO2_MAX_PARAM_SIZE;
@@ -0,0 +1,33 @@
+/* Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Servo V2 SPI (FTDI MPSSE) transport.
+ */
+
+#ifndef __UTIL_COMM_SERVO_SPI_H
+#define __UTIL_COMM_SERVO_SPI_H
+
+#include <stdint.h>
+
+/**
+ * Initialize the servo SPI transport.
+ *
+ * @param device_name	USB serial number of the servo board, or
+ *			CROS_EC_DEV_NAME for the first one found.
+ * @return 0 if success, negative otherwise.
+ */
+int comm_init_servo_spi(const char *device_name);
+
+/**
+ * Set the SPI clock.  May be called before comm_init_servo_spi().
+ *
+ * The MPSSE divides its clock down in steps, so the actual frequency is the
+ * nearest one at or above 'freq' that it can generate.
+ *
+ * @param freq	Clock frequency in Hz, 100 to 30000000.  Defaults to 1 MHz.
+ * @return 0 if success, non-zero otherwise.
+ */
+int comm_servo_spi_set_clock(uint32_t freq);
+
+#endif /* __UTIL_COMM_SERVO_SPI_H */
@@ -0,0 +1,1709 @@
+/* Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+/*
+ * Transport to an in-process simulated EC.
+ *
+ * Requests are framed as host command protocol v3 packets and handed to a
+ * small model of the EC host command layer, which validates the packet,
+ * dispatches it to a command handler and frames the response exactly as EC
+ * firmware would. The model has a memory map, a flash array with NOR
+ * semantics (writes can only clear bits, erases set them) and a per-command
+ * latency, so that the flash engine, the stress test and the other commands
+ * can be benchmarked and profiled on any machine:
+ *
+ *   ectool --interface=sim [--name=<config file>] <command>
+ *
+ * See comm-sim.h for the configuration file format.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "comm-host.h"
+#include "comm-sim.h"
+#include "crc.h"
+#include "ec_commands.h"
+#include "host_command.h"
+#include "misc_util.h"
+#include "sha256.h"
+
+#ifndef _WIN32
+#include "cros_ec_dev.h"
+#endif
+
+#define SIM_MAX_COMMANDS 64
+#define SIM_MAX_EVENTS 16
+#define SIM_MAX_PACKET_SIZE 0x1000
+
+#define SIM_DEFAULT_FLASH_SIZE 0x80000 /* 512 KiB */
+#define SIM_DEFAULT_ERASE_SIZE 0x1000 /* 4 KiB */
+#define SIM_DEFAULT_WRITE_BLOCK_SIZE 4
+#define SIM_DEFAULT_WRITE_IDEAL_SIZE 0x80
+#define SIM_DEFAULT_PACKET_SIZE 0x220
+#define SIM_DEFAULT_ERASE_TIME 20000 /* 20 ms per erase block */
+#define SIM_DEFAULT_HASH_TIME 50 /* 50 us per KiB hashed */
+#define SIM_DEFAULT_PCHG_WRITE_TIME 5000 /* 5 ms per update block */
+#define SIM_PCHG_BLOCK_SIZE 128
+#define SIM_DEFAULT_FP_CAPTURE_TIME 30000 /* 30 ms per frame */
+#define SIM_FP_WIDTH 160
+#define SIM_FP_HEIGHT 160
+/* Vendor frames carry a header before the image */
+#define SIM_FP_FRAME_SIZE (SIM_FP_WIDTH * SIM_FP_HEIGHT + 512)
+#define SIM_FP_TEMPLATE_SIZE 0x1300
+#define SIM_FP_TEMPLATE_MAX 5
+#define SIM_FP_TEMPLATE_VERSION 4
+/* Touchpad mutual capacitance and self capacitance frames */
+#define SIM_TP_FRAME0_SIZE (24 * 40 * 2)
+#define SIM_TP_FRAME1_SIZE ((24 + 40) * 2)
+/* Lid and base accelerometers */
+#define SIM_MS_SENSORS 2
+#define SIM_MS_FIFO_SIZE 256
+#define SIM_MS_DEFAULT_ODR 50000 /* mHz */
+#define SIM_MS_MAX_ODR 400000 /* mHz */
+#define SIM_MS_DEFAULT_EC_RATE 100 /* ms */
+
+/* Latencies shorter than this are busy-waited for accuracy */
+#define SIM_SPIN_USEC 100
+
+using sim_clock = std::chrono::steady_clock;
+
+struct sim_command {
+	struct host_command cmd;
+	int latency_us;
+};
+
+struct sim_event {
+	/* Not delivered before this time */
+	sim_clock::time_point ready;
+	uint8_t event_type;
+	uint8_t size;
+	uint8_t data[sizeof(union ec_response_get_next_data_v1)];
+};
+
+static struct sim_ec {
+	/* Command set */
+	struct sim_command commands[SIM_MAX_COMMANDS];
+	int num_commands;
+	int latency_us;
+	int memmap_latency_us;
+
+	/* Memory map */
+	uint8_t memmap[EC_MEMMAP_SIZE];
+
+	/* Flash array and geometry */
+	uint8_t *flash;
+	int flash_size;
+	int erase_size;
+	int write_block_size;
+	int write_ideal_size;
+	int erase_time_us;
+
+	/* Pending FLASH_ERASE_SECTOR_ASYNC */
+	bool erase_pending;
+	sim_clock::time_point erase_done;
+	enum ec_status erase_result;
+
+	/* EC_CMD_VBOOT_HASH state; the digest is ready at hash_done */
+	int hash_time_us;
+	uint8_t hash_status;
+	uint32_t hash_offset;
+	uint32_t hash_size;
+	uint8_t hash_digest[SHA256_DIGEST_SIZE];
+	sim_clock::time_point hash_done;
+
+	/*
+	 * Peripheral charger on port 0, whose firmware update completes each
+	 * block write pchg_write_time_us after it is sent.
+	 */
+	int pchg_write_time_us;
+	uint8_t pchg_state;
+	uint32_t pchg_version;
+	uint32_t pchg_crc;
+	sim_clock::time_point pchg_write_done;
+
+	/*
+	 * Fingerprint sensor.  A capture fills fp_frame fp_capture_time_us
+	 * after it is asked for, and raises EC_MKBP_FP_IMAGE_READY.
+	 */
+	int fp_capture_time_us;
+	uint32_t fp_mode;
+	uint32_t fp_frames;
+	sim_clock::time_point fp_capture_done;
+	uint8_t fp_frame[SIM_FP_FRAME_SIZE];
+	/* Templates are uploaded into fp_upload, then committed to a slot */
+	int fp_templates;
+	uint8_t fp_template[SIM_FP_TEMPLATE_MAX][SIM_FP_TEMPLATE_SIZE];
+	uint8_t fp_upload[SIM_FP_TEMPLATE_SIZE];
+
+	/* Touchpad frames, refreshed by each snapshot */
+	uint32_t tp_snapshots;
+	uint8_t tp_frame0[SIM_TP_FRAME0_SIZE];
+	uint8_t tp_frame1[SIM_TP_FRAME1_SIZE];
+
+	/*
+	 * Motion sensors.  Each samples at its ODR; every ec_rate the EC
+	 * moves the samples taken so far into the FIFO, a timestamp entry
+	 * and a data entry for each, and raises EC_MKBP_EVENT_SENSOR_FIFO
+	 * if the interrupt is enabled.  A full FIFO drops its oldest entry.
+	 */
+	int ms_odr[SIM_MS_SENSORS];
+	int ms_ec_rate[SIM_MS_SENSORS];
+	sim_clock::time_point ms_next_sample[SIM_MS_SENSORS];
+	uint32_t ms_samples[SIM_MS_SENSORS];
+	uint16_t ms_lost[SIM_MS_SENSORS];
+	uint16_t ms_total_lost;
+	sim_clock::time_point ms_next_flush;
+	/* Time of the last EC_MKBP_EVENT_SENSOR_FIFO posted */
+	sim_clock::time_point ms_event;
+	bool ms_int_enable;
+	struct ec_response_motion_sensor_data ms_fifo[SIM_MS_FIFO_SIZE];
+	int ms_fifo_head;
+	int ms_fifo_count;
+
+	/* EC timestamps count from here */
+	sim_clock::time_point boot;
+
+	/* Protocol */
+	int packet_size;
+	char version[32];
+	char build_info[128];
+
+	/* MKBP event queue */
+	std::mutex event_lock;
+	std::condition_variable event_cv;
+	struct sim_event events[SIM_MAX_EVENTS];
+	int event_head;
+	int num_events;
+} sim;
+
+/* Packet buffers used by the transport side */
+static uint8_t sim_request[SIM_MAX_PACKET_SIZE];
+static uint8_t sim_response[SIM_MAX_PACKET_SIZE];
+
+static void sim_delay_us(int usec)
+{
+	sim_clock::time_point deadline;
+
+	if (usec <= 0)
+		return;
+
+	deadline = sim_clock::now() + std::chrono::microseconds(usec);
+	if (usec > SIM_SPIN_USEC)
+		std::this_thread::sleep_for(
+			std::chrono::microseconds(usec - SIM_SPIN_USEC));
+	while (sim_clock::now() < deadline)
+		;
+}
+
+static int sum_bytes(const void *data, int length)
+{
+	const uint8_t *bytes = (const uint8_t *)data;
+	int sum = 0;
+	int i;
+
+	for (i = 0; i < length; i++)
+		sum += bytes[i];
+	return sum;
+}
+
+static struct sim_command *sim_find_command(int command)
+{
+	int i;
+
+	for (i = 0; i < sim.num_commands; i++) {
+		if (sim.commands[i].cmd.command == command)
+			return &sim.commands[i];
+	}
+	return NULL;
+}
+
+/*****************************************************************************/
+/* Command handlers */
+
+static enum ec_status sim_hello(struct host_cmd_handler_args *args)
+{
+	const struct ec_params_hello *p =
+		(const struct ec_params_hello *)args->params;
+	struct ec_response_hello *r = (struct ec_response_hello *)args->response;
+
+	if (args->params_size < sizeof(*p))
+		return EC_RES_INVALID_PARAM;
+
+	r->out_data = p->in_data + 0x01020304;
+	args->response_size = sizeof(*r);
+	return EC_RES_SUCCESS;
+}
+
+static enum ec_status sim_get_version(struct host_cmd_handler_args *args)
+{
+	struct ec_response_get_version_v1 *r =
+		(struct ec_response_get_version_v1 *)args->response;
+
+	memset(r, 0, sizeof(*r));
+	strncpy(r->version_string_ro, sim.version,
+		sizeof(r->version_string_ro) - 1);
+	strncpy(r->version_string_rw, sim.version,
+		sizeof(r->version_string_rw) - 1);
+	r->current_image = EC_IMAGE_RW;
+
+	if (args->version == 0) {
+		args->response_size = sizeof(struct ec_response_get_version);
+	} else {
+		strncpy(r->cros_fwid_ro, sim.version,
+			sizeof(r->cros_fwid_ro) - 1);
+		strncpy(r->cros_fwid_rw, sim.version,
+			sizeof(r->cros_fwid_rw) - 1);
+		args->response_size = sizeof(*r);
+	}
+	return EC_RES_SUCCESS;
+}
+
+static enum ec_status sim_get_build_info(struct host_cmd_handler_args *args)
+{
+	int len = MIN(strlen(sim.build_info) + 1, args->response_max);
+
+	memcpy(args->response, sim.build_info, len);
+	((char *)args->response)[len - 1] = '\0';
+	args->response_size = len;
+	return EC_RES_SUCCESS;
+}
+
+static enum ec_status sim_get_chip_info(struct host_cmd_handler_args *args)
+{
+	struct ec_response_get_chip_info *r =
+		(struct ec_response_get_chip_info *)args->response;
+
+	memset(r, 0, sizeof(*r));
+	strcpy(r->vendor, "sim");
+	strcpy(r->name, "ectool-sim");
+	strcpy(r->revision, "1");
+	args->response_size = sizeof(*r);
+	return EC_RES_SUCCESS;
+}
+
+static enum ec_status sim_read_memmap(struct host_cmd_handler_args *args)
+{
+	const struct ec_params_read_memmap *p =
+		(const struct ec_params_read_memmap *)args->params;
+
+	if (args->params_size < sizeof(*p))
+		return EC_RES_INVALID_PARAM;
+	if (p->offset + p->size > EC_MEMMAP_SIZE ||
+	    p->size > args->response_max)
+		return EC_RES_INVALID_PARAM;
+
+	memcpy(args->response, sim.memmap + p->offset, p->size);
+	args->response_size = p->size;
+	return EC_RES_SUCCESS;
+}
+
+static enum ec_status sim_get_cmd_versions(struct host_cmd_handler_args *args)
+{
+	struct ec_response_get_cmd_versions *r =
+		(struct ec_response_get_cmd_versions *)args->response;
+	struct sim_command *c;
+	int cmd;
+
+	if (args->version == 0 &&
+	    args->params_size >= sizeof(struct ec_params_get_cmd_versions))
+		cmd = ((const struct ec_params_get_cmd_versions *)args->params)
+			      ->cmd;
+	else if (args->params_size >=
+		 sizeof(struct ec_params_get_cmd_versions_v1))
+		cmd = ((const struct ec_params_get_cmd_versions_v1 *)
+			       args->params)
+			      ->cmd;
+	else
+		return EC_RES_INVALID_PARAM;
+
+	c = sim_find_command(cmd);
+	if (!c)
+		return EC_RES_INVALID_PARAM;
+
+	r->version_mask = c->cmd.version_mask;
+	args->response_size = sizeof(*r);
+	return EC_RES_SUCCESS;
+}
+
+static enum ec_status sim_test_protocol(struct host_cmd_handler_args *args)
+{
+	const struct ec_params_test_protocol *p =
+		(const struct ec_params_test_protocol *)args->params;
+	struct ec_response_test_protocol *r =
+		(struct ec_response_test_protocol *)args->response;
+
+	if (args->params_size < sizeof(*p))
+		return EC_RES_INVALID_PARAM;
+
+	memcpy(r->buf, p->buf, sizeof(r->buf));
+	args->response_size = MIN(p->ret_len, sizeof(r->buf));
+	return (enum ec_status)p->ec_result;
+}
+
+static enum ec_status sim_get_protocol_info(struct host_cmd_handler_args *args)
+{
+	struct ec_response_get_protocol_info *r =
+		(struct ec_response_get_protocol_info *)args->response;
+
+	memset(r, 0, sizeof(*r));
+	r->protocol_versions = BIT(3);
+	r->max_request_packet_size = sim.packet_size;
+	r->max_response_packet_size = sim.packet_size;
+	args->response_size = sizeof(*r);
+	return EC_RES_SUCCESS;
+}
+
+static enum ec_status sim_get_features(struct host_cmd_handler_args *args)
+{
+	struct ec_response_get_features *r =
+		(struct ec_response_get_features *)args->response;
+
+	memset(r, 0, sizeof(*r));
+	r->flags[0] = EC_FEATURE_MASK_0(EC_FEATURE_FLASH) |
+		      EC_FEATURE_MASK_0(EC_FEATURE_PWM_FAN) |
+		      EC_FEATURE_MASK_0(EC_FEATURE_THERMAL);
+	args->response_size = sizeof(*r);
+	return EC_RES_SUCCESS;
+}
+
+static int sim_log2(int value)
+{
+	int i;
+
+	for (i = 0; (1 << i) < value; i++)
+		;
+	return i;
+}
+
+static enum ec_status sim_flash_info(struct host_cmd_handler_args *args)
+{
+	struct ec_response_flash_info_1 *r1 =
+		(struct ec_response_flash_info_1 *)args->response;
+	struct ec_response_flash_info_2 *r2 =
+		(struct ec_response_flash_info_2 *)args->response;
+	const struct ec_params_flash_info_2 *p2 =
+		(const struct ec_params_flash_info_2 *)args->params;
+
+	if (args->version < 2) {
+		r1->flash_size = sim.flash_size;
+		r1->write_block_size = sim.write_block_size;
+		r1->erase_block_size = sim.erase_size;
+		r1->protect_block_size = sim.erase_size;
+		r1->write_ideal_size = sim.write_ideal_size;
+		r1->flags = 0;
+		args->response_size = args->version ?
+					      sizeof(*r1) :
+					      sizeof(struct ec_response_flash_info);
+		return EC_RES_SUCCESS;
+	}
+
+	if (args->params_size < sizeof(*p2))
+		return EC_RES_INVALID_PARAM;
+
+	r2->flash_size = sim.flash_size;
+	r2->flags = 0;
+	r2->write_ideal_size = sim.write_ideal_size;
+	r2->num_banks_total = 1;
+	r2->num_banks_desc = MIN(p2->num_banks_desc, 1);
+	args->response_size = sizeof(*r2);
+	if (r2->num_banks_desc) {
+		if (args->response_max < sizeof(*r2) + sizeof(r2->banks[0]))
+			return EC_RES_OVERFLOW;
+		memset(&r2->banks[0], 0, sizeof(r2->banks[0]));
+		r2->banks[0].count = sim.flash_size / sim.erase_size;
+		r2->banks[0].size_exp = sim_log2(sim.erase_size);
+		r2->banks[0].write_size_exp = sim_log2(sim.write_block_size);
+		r2->banks[0].erase_size_exp = sim_log2(sim.erase_size);
+		r2->banks[0].protect_size_exp = sim_log2(sim.erase_size);
+		args->response_size += sizeof(r2->banks[0]);
+	}
+	return EC_RES_SUCCESS;
+}
+
+static enum ec_status sim_flash_read(struct host_cmd_handler_args *args)
+{
+	const struct ec_params_flash_read *p =
+		(const struct ec_params_flash_read *)args->params;
+
+	if (args->params_size < sizeof(*p))
+		return EC_RES_INVALID_PARAM;
+	if (p->size > args->response_max)
+		return EC_RES_OVERFLOW;
+	if (p->offset > sim.flash_size || p->size > sim.flash_size - p->offset)
+		return EC_RES_INVALID_PARAM;
+
+	memcpy(args->response, sim.flash + p->offset, p->size);
+	args->response_size = p->size;
+	return EC_RES_SUCCESS;
+}
+
+static enum ec_status sim_flash_write(struct host_cmd_handler_args *args)
+{
+	const struct ec_params_flash_write *p =
+		(const struct ec_params_flash_write *)args->params;
+	const uint8_t *data = (const uint8_t *)(p + 1);
+	uint32_t i;
+
+	if (args->params_size < sizeof(*p) ||
+	    p->size > args->params_size - sizeof(*p))
+		return EC_RES_INVALID_PARAM;
+	if (p->offset > sim.flash_size || p->size > sim.flash_size - p->offset)
+		return EC_RES_INVALID_PARAM;
+	if (p->offset % sim.write_block_size || p->size % sim.write_block_size)
+		return EC_RES_INVALID_PARAM;
+	if (sim.erase_pending)
+		return EC_RES_BUSY;
+
+	/* NOR flash: programming can only clear bits */
+	for (i = 0; i < p->size; i++)
+		sim.flash[p->offset + i] &= data[i];
+	return EC_RES_SUCCESS;
+}
+
+static enum ec_status sim_erase(uint32_t offset, uint32_t size, bool async)
+{
+	int usec;
+
+	if (offset > sim.flash_size || size > sim.flash_size - offset)
+		return EC_RES_INVALID_PARAM;
+	if (offset % sim.erase_size || size % sim.erase_size)
+		return EC_RES_INVALID_PARAM;
+
+	memset(sim.flash + offset, 0xff, size);
+	usec = (size / sim.erase_size) * sim.erase_time_us;
+
+	if (!async) {
+		sim_delay_us(usec);
+		return EC_RES_SUCCESS;
+	}
+
+	sim.erase_pending = true;
+	sim.erase_result = EC_RES_SUCCESS;
+	sim.erase_done = sim_clock::now() + std::chrono::microseconds(usec);
+	return EC_RES_SUCCESS;
+}
+
+static enum ec_status sim_flash_erase(struct host_cmd_handler_args *args)
+{
+	const struct ec_params_flash_erase *p0 =
+		(const struct ec_params_flash_erase *)args->params;
+	const struct ec_params_flash_erase_v1 *p1 =
+		(const struct ec_params_flash_erase_v1 *)args->params;
+
+	if (sim.erase_pending && sim_clock::now() >= sim.erase_done)
+		sim.erase_pending = false;
+
+	if (args->version == 0) {
+		if (args->params_size < sizeof(*p0))
+			return EC_RES_INVALID_PARAM;
+		if (sim.erase_pending)
+			return EC_RES_BUSY;
+		return sim_erase(p0->offset, p0->size, false);
+	}
+
+	if (args->params_size < sizeof(*p1))
+		return EC_RES_INVALID_PARAM;
+
+	switch (p1->cmd) {
+	case FLASH_ERASE_SECTOR:
+	case FLASH_ERASE_SECTOR_ASYNC:
+		if (sim.erase_pending)
+			return EC_RES_BUSY;
+		return sim_erase(p1->params.offset, p1->params.size,
+				 p1->cmd == FLASH_ERASE_SECTOR_ASYNC);
+	case FLASH_ERASE_GET_RESULT:
+		if (sim.erase_pending)
+			return EC_RES_BUSY;
+		return sim.erase_result;
+	default:
+		return EC_RES_INVALID_PARAM;
+	}
+}
+
+static enum ec_status sim_vboot_hash(struct host_cmd_handler_args *args)
+{
+	const struct ec_params_vboot_hash *p =
+		(const struct ec_params_vboot_hash *)args->params;
+	struct ec_response_vboot_hash *r =
+		(struct ec_response_vboot_hash *)args->response;
+	struct sha256_ctx ctx;
+	int usec;
+
+	if (args->params_size < sizeof(*p))
+		return EC_RES_INVALID_PARAM;
+
+	if (sim.hash_status == EC_VBOOT_HASH_STATUS_BUSY &&
+	    sim_clock::now() >= sim.hash_done)
+		sim.hash_status = EC_VBOOT_HASH_STATUS_DONE;
+
+	switch (p->cmd) {
+	case EC_VBOOT_HASH_GET:
+		break;
+	case EC_VBOOT_HASH_ABORT:
+		sim.hash_status = EC_VBOOT_HASH_STATUS_NONE;
+		return EC_RES_SUCCESS;
+	case EC_VBOOT_HASH_START:
+	case EC_VBOOT_HASH_RECALC:
+		/* No image layout, so no RO/RW shortcuts */
+		if (p->hash_type != EC_VBOOT_HASH_TYPE_SHA256 ||
+		    p->nonce_size > sizeof(p->nonce_data) ||
+		    p->offset > sim.flash_size ||
+		    p->size > sim.flash_size - p->offset)
+			return EC_RES_INVALID_PARAM;
+		if (sim.hash_status == EC_VBOOT_HASH_STATUS_BUSY)
+			return EC_RES_BUSY;
+
+		SHA256_init(&ctx);
+		SHA256_update(&ctx, p->nonce_data, p->nonce_size);
+		SHA256_update(&ctx, sim.flash + p->offset, p->size);
+		memcpy(sim.hash_digest, SHA256_final(&ctx),
+		       SHA256_DIGEST_SIZE);
+		sim.hash_offset = p->offset;
+		sim.hash_size = p->size;
+
+		usec = (int)((uint64_t)p->size * sim.hash_time_us / 1024);
+		if (p->cmd == EC_VBOOT_HASH_RECALC) {
+			sim_delay_us(usec);
+			sim.hash_status = EC_VBOOT_HASH_STATUS_DONE;
+			break;
+		}
+		sim.hash_status = EC_VBOOT_HASH_STATUS_BUSY;
+		sim.hash_done = sim_clock::now() +
+				std::chrono::microseconds(usec);
+		return EC_RES_SUCCESS;
+	default:
+		return EC_RES_INVALID_PARAM;
+	}
+
+	memset(r, 0, sizeof(*r));
+	r->status = sim.hash_status;
+	r->hash_type = EC_VBOOT_HASH_TYPE_SHA256;
+	if (sim.hash_status == EC_VBOOT_HASH_STATUS_DONE) {
+		r->digest_size = SHA256_DIGEST_SIZE;
+		r->offset = sim.hash_offset;
+		r->size = sim.hash_size;
+		memcpy(r->hash_digest, sim.hash_digest, SHA256_DIGEST_SIZE);
+	}
+	args->response_size = sizeof(*r);
+	return EC_RES_SUCCESS;
+}
+
+/* The RO image takes the first quarter of flash, the RW image the second */
+static enum ec_status sim_flash_region_info(struct host_cmd_handler_args *args)
+{
+	const struct ec_params_flash_region_info *p =
+		(const struct ec_params_flash_region_info *)args->params;
+	struct ec_response_flash_region_info *r =
+		(struct ec_response_flash_region_info *)args->response;
+	int quarter = sim.flash_size / sim.erase_size / 4 * sim.erase_size;
+
+	if (args->params_size < sizeof(*p))
+		return EC_RES_INVALID_PARAM;
+
+	switch (p->region) {
+	case EC_FLASH_REGION_RO:
+	case EC_FLASH_REGION_WP_RO:
+		r->offset = 0;
+		r->size = quarter;
+		break;
+	case EC_FLASH_REGION_ACTIVE:
+		r->offset = quarter;
+		r->size = quarter;
+		break;
+	case EC_FLASH_REGION_UPDATE:
+		r->offset = 0;
+		r->size = 0;
+		break;
+	default:
+		return EC_RES_INVALID_PARAM;
+	}
+	args->response_size = sizeof(*r);
+	return EC_RES_SUCCESS;
+}
+
+static enum ec_status sim_flash_protect(struct host_cmd_handler_args *args)
+{
+	struct ec_response_flash_protect *r =
+		(struct ec_response_flash_protect *)args->response;
+
+	r->flags = 0;
+	r->valid_flags = EC_FLASH_PROTECT_RO_AT_BOOT | EC_FLASH_PROTECT_RO_NOW |
+			 EC_FLASH_PROTECT_ALL_NOW |
+			 EC_FLASH_PROTECT_GPIO_ASSERTED;
+	r->writable_flags = EC_FLASH_PROTECT_RO_AT_BOOT;
+	args->response_size = sizeof(*r);
+	return EC_RES_SUCCESS;
+}
+
+static enum ec_status sim_get_next_event(struct host_cmd_handler_args *args)
+{
+	uint8_t *r = (uint8_t *)args->response;
+	struct sim_event *e;
+	std::lock_guard<std::mutex> guard(sim.event_lock);
+
+	if (!sim.num_events)
+		return EC_RES_UNAVAILABLE;
+
+	e = &sim.events[sim.event_head];
+	if (sim_clock::now() < e->ready)
+		return EC_RES_UNAVAILABLE;
+	if (args->response_max < 1 + e->size)
+		return EC_RES_OVERFLOW;
+
+	r[0] = e->event_type;
+	if (sim.num_events > 1)
+		r[0] |= EC_MKBP_HAS_MORE_EVENTS;
+	memcpy(r + 1, e->data, e->size);
+	args->response_size = 1 + e->size;
+
+	sim.event_head = (sim.event_head + 1) % SIM_MAX_EVENTS;
+	sim.num_events--;
+	return EC_RES_SUCCESS;
+}
+
+static int sim_post_event(uint8_t event_type, const void *data, int size,
+			  sim_clock::time_point ready);
+
+static void sim_pchg_event(uint32_t event, sim_clock::time_point ready)
+{
+	event |= EC_MKBP_PCHG_PORT_TO_EVENT(0);
+	sim_post_event(EC_MKBP_EVENT_PCHG, &event, sizeof(event), ready);
+}
+
+static enum ec_status sim_pchg_count(struct host_cmd_handler_args *args)
+{
+	struct ec_response_pchg_count *r =
+		(struct ec_response_pchg_count *)args->response;
+
+	r->port_count = 1;
+	args->response_size = sizeof(*r);
+	return EC_RES_SUCCESS;
+}
+
+static enum ec_status sim_pchg(struct host_cmd_handler_args *args)
+{
+	const struct ec_params_pchg *p =
+		(const struct ec_params_pchg *)args->params;
+	struct ec_response_pchg_v2 *r =
+		(struct ec_response_pchg_v2 *)args->response;
+
+	if (p->port)
+		return EC_RES_INVALID_PARAM;
+
+	memset(r, 0, sizeof(*r));
+	r->state = sim.pchg_state;
+	r->fw_version = sim.pchg_version;
+	args->response_size = args->version == 2 ?
+				      sizeof(struct ec_response_pchg_v2) :
+				      sizeof(struct ec_response_pchg);
+	return EC_RES_SUCCESS;
+}
+
+static enum ec_status sim_pchg_update(struct host_cmd_handler_args *args)
+{
+	const struct ec_params_pchg_update *p =
+		(const struct ec_params_pchg_update *)args->params;
+	struct ec_response_pchg_update *r =
+		(struct ec_response_pchg_update *)args->response;
+	sim_clock::time_point now = sim_clock::now();
+
+	if (args->params_size < sizeof(*p) || p->port)
+		return EC_RES_INVALID_PARAM;
+
+	switch (p->cmd) {
+	case EC_PCHG_UPDATE_CMD_RESET_TO_NORMAL:
+		sim.pchg_state = PCHG_STATE_ENABLED;
+		return EC_RES_SUCCESS;
+	case EC_PCHG_UPDATE_CMD_OPEN:
+		sim.pchg_state = PCHG_STATE_DOWNLOAD;
+		sim.pchg_version = p->version;
+		crc32_ctx_init(&sim.pchg_crc);
+		r->block_size = SIM_PCHG_BLOCK_SIZE;
+		args->response_size = sizeof(*r);
+		sim_pchg_event(EC_MKBP_PCHG_DEVICE_EVENT, now);
+		sim_pchg_event(EC_MKBP_PCHG_UPDATE_OPENED, now);
+		return EC_RES_SUCCESS;
+	case EC_PCHG_UPDATE_CMD_WRITE:
+		if (p->size > SIM_PCHG_BLOCK_SIZE ||
+		    p->size > args->params_size - sizeof(*p))
+			return EC_RES_INVALID_PARAM;
+		if (sim.pchg_state != PCHG_STATE_DOWNLOAD &&
+		    sim.pchg_state != PCHG_STATE_DOWNLOADING)
+			return EC_RES_INVALID_PARAM;
+		/* One block at a time */
+		if (now < sim.pchg_write_done)
+			return EC_RES_BUSY;
+		sim.pchg_state = PCHG_STATE_DOWNLOADING;
+		crc32_ctx_hash(&sim.pchg_crc, p->data, p->size);
+		sim.pchg_write_done =
+			now + std::chrono::microseconds(sim.pchg_write_time_us);
+		sim_pchg_event(EC_MKBP_PCHG_WRITE_COMPLETE,
+			       sim.pchg_write_done);
+		return EC_RES_SUCCESS;
+	case EC_PCHG_UPDATE_CMD_CLOSE:
+		if (now < sim.pchg_write_done)
+			return EC_RES_BUSY;
+		sim.pchg_state = PCHG_STATE_ENABLED;
+		sim_pchg_event(crc32_ctx_result(&sim.pchg_crc) == p->crc32 ?
+				       EC_MKBP_PCHG_UPDATE_CLOSED :
+				       EC_MKBP_PCHG_UPDATE_ERROR,
+			       now);
+		return EC_RES_SUCCESS;
+	default:
+		return EC_RES_INVALID_PARAM;
+	}
+}
+
+/* Finish a capture which is due */
+static void sim_fp_update(void)
+{
+	if ((sim.fp_mode & FP_MODE_CAPTURE) &&
+	    sim_clock::now() >= sim.fp_capture_done)
+		sim.fp_mode &= ~(FP_MODE_CAPTURE | FP_MODE_CAPTURE_TYPE_MASK);
+}
+
+/* Enroll 'count' fingers, each template different */
+static void sim_fp_enroll(int count)
+{
+	int i, j;
+
+	for (i = 0; i < count; i++)
+		for (j = 0; j < SIM_FP_TEMPLATE_SIZE; j++)
+			sim.fp_template[i][j] = j * (i + 3) + i;
+	sim.fp_templates = count;
+}
+
+static enum ec_status sim_fp_info(struct host_cmd_handler_args *args)
+{
+	struct ec_response_fp_info *r =
+		(struct ec_response_fp_info *)args->response;
+
+	memset(r, 0, sizeof(*r));
+	r->vendor_id = 0x53494d; /* "SIM" */
+	r->frame_size = SIM_FP_FRAME_SIZE;
+	r->width = SIM_FP_WIDTH;
+	r->height = SIM_FP_HEIGHT;
+	r->bpp = 8;
+	r->template_size = SIM_FP_TEMPLATE_SIZE;
+	r->template_max = SIM_FP_TEMPLATE_MAX;
+	r->template_valid = sim.fp_templates;
+	r->template_version = SIM_FP_TEMPLATE_VERSION;
+	args->response_size = args->version ?
+				      sizeof(*r) :
+				      sizeof(struct ec_response_fp_info_v0);
+	return EC_RES_SUCCESS;
+}
+
+static enum ec_status sim_fp_mode(struct host_cmd_handler_args *args)
+{
+	const struct ec_params_fp_mode *p =
+		(const struct ec_params_fp_mode *)args->params;
+	struct ec_response_fp_mode *r =
+		(struct ec_response_fp_mode *)args->response;
+	uint32_t event = EC_MKBP_FP_IMAGE_READY;
+	int i;
+
+	sim_fp_update();
+	if (!(p->mode & FP_MODE_DONT_CHANGE)) {
+		sim.fp_mode = p->mode;
+		if (p->mode & FP_MODE_CAPTURE) {
+			/* Each frame differs from the last */
+			sim.fp_frames++;
+			for (i = 0; i < SIM_FP_FRAME_SIZE; i++)
+				sim.fp_frame[i] = i + sim.fp_frames * 7;
+			sim.fp_capture_done =
+				sim_clock::now() +
+				std::chrono::microseconds(
+					sim.fp_capture_time_us);
+			sim_post_event(EC_MKBP_EVENT_FINGERPRINT, &event,
+				       sizeof(event), sim.fp_capture_done);
+		}
+	}
+
+	r->mode = sim.fp_mode;
+	args->response_size = sizeof(*r);
+	return EC_RES_SUCCESS;
+}
+
+static enum ec_status sim_fp_frame(struct host_cmd_handler_args *args)
+{
+	const struct ec_params_fp_frame *p =
+		(const struct ec_params_fp_frame *)args->params;
+	uint32_t offset = p->offset & FP_FRAME_OFFSET_MASK;
+	int index = FP_FRAME_GET_BUFFER_INDEX(p->offset);
+
+	sim_fp_update();
+	if (index != FP_FRAME_INDEX_RAW_IMAGE) {
+		index -= FP_FRAME_INDEX_TEMPLATE;
+		if (index >= sim.fp_templates ||
+		    p->size > args->response_max ||
+		    offset > SIM_FP_TEMPLATE_SIZE ||
+		    p->size > SIM_FP_TEMPLATE_SIZE - offset)
+			return EC_RES_INVALID_PARAM;
+		memcpy(args->response, sim.fp_template[index] + offset,
+		       p->size);
+		args->response_size = p->size;
+		return EC_RES_SUCCESS;
+	}
+	if (sim.fp_mode & FP_MODE_CAPTURE)
+		return EC_RES_BUSY;
+	if (p->size > args->response_max || offset > SIM_FP_FRAME_SIZE ||
+	    p->size > SIM_FP_FRAME_SIZE - offset)
+		return EC_RES_INVALID_PARAM;
+
+	memcpy(args->response, sim.fp_frame + offset, p->size);
+	args->response_size = p->size;
+	return EC_RES_SUCCESS;
+}
+
+static enum ec_status sim_fp_template(struct host_cmd_handler_args *args)
+{
+	const struct ec_params_fp_template *p =
+		(const struct ec_params_fp_template *)args->params;
+	uint32_t size = p->size & ~FP_TEMPLATE_COMMIT;
+
+	if (args->params_size < offsetof(struct ec_params_fp_template, data) ||
+	    args->params_size <
+		    offsetof(struct ec_params_fp_template, data) + size ||
+	    p->offset > SIM_FP_TEMPLATE_SIZE ||
+	    size > SIM_FP_TEMPLATE_SIZE - p->offset)
+		return EC_RES_INVALID_PARAM;
+
+	memcpy(sim.fp_upload + p->offset, p->data, size);
+	if (!(p->size & FP_TEMPLATE_COMMIT))
+		return EC_RES_SUCCESS;
+
+	/* Only a whole template can be committed */
+	if (p->offset + size != SIM_FP_TEMPLATE_SIZE)
+		return EC_RES_INVALID_PARAM;
+	if (sim.fp_templates >= SIM_FP_TEMPLATE_MAX)
+		return EC_RES_OVERFLOW;
+	memcpy(sim.fp_template[sim.fp_templates++], sim.fp_upload,
+	       SIM_FP_TEMPLATE_SIZE);
+	return EC_RES_SUCCESS;
+}
+
+static enum ec_status sim_tp_frame_info(struct host_cmd_handler_args *args)
+{
+	struct ec_response_tp_frame_info *r =
+		(struct ec_response_tp_frame_info *)args->response;
+
+	if (args->response_max < sizeof(*r) + 2 * sizeof(r->frame_sizes[0]))
+		return EC_RES_RESPONSE_TOO_BIG;
+	r->n_frames = 2;
+	r->frame_sizes[0] = SIM_TP_FRAME0_SIZE;
+	r->frame_sizes[1] = SIM_TP_FRAME1_SIZE;
+	args->response_size = sizeof(*r) + 2 * sizeof(r->frame_sizes[0]);
+	return EC_RES_SUCCESS;
+}
+
+static enum ec_status
+sim_tp_frame_snapshot(struct host_cmd_handler_args *args)
+{
+	int i;
+
+	sim.tp_snapshots++;
+	for (i = 0; i < SIM_TP_FRAME0_SIZE; i++)
+		sim.tp_frame0[i] = i + sim.tp_snapshots;
+	for (i = 0; i < SIM_TP_FRAME1_SIZE; i++)
+		sim.tp_frame1[i] = i ^ sim.tp_snapshots;
+	return EC_RES_SUCCESS;
+}
+
+static enum ec_status sim_tp_frame_get(struct host_cmd_handler_args *args)
+{
+	const struct ec_params_tp_frame_get *p =
+		(const struct ec_params_tp_frame_get *)args->params;
+	const uint8_t *frame;
+	uint32_t size;
+
+	switch (p->frame_index) {
+	case 0:
+		frame = sim.tp_frame0;
+		size = SIM_TP_FRAME0_SIZE;
+		break;
+	case 1:
+		frame = sim.tp_frame1;
+		size = SIM_TP_FRAME1_SIZE;
+		break;
+	default:
+		return EC_RES_INVALID_PARAM;
+	}
+	if (p->size > args->response_max || p->offset > size ||
+	    p->size > size - p->offset)
+		return EC_RES_INVALID_PARAM;
+
+	memcpy(args->response, frame + p->offset, p->size);
+	args->response_size = p->size;
+	return EC_RES_SUCCESS;
+}
+
+static uint32_t sim_timestamp(sim_clock::time_point t)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		       t - sim.boot)
+		.count();
+}
+
+static void sim_ms_fifo_push(const struct ec_response_motion_sensor_data *v)
+{
+	const struct ec_response_motion_sensor_data *old;
+
+	if (sim.ms_fifo_count == SIM_MS_FIFO_SIZE) {
+		old = &sim.ms_fifo[sim.ms_fifo_head];
+		if (!(old->flags & MOTIONSENSE_SENSOR_FLAG_TIMESTAMP)) {
+			sim.ms_lost[old->sensor_num]++;
+			sim.ms_total_lost++;
+		}
+		sim.ms_fifo_head = (sim.ms_fifo_head + 1) % SIM_MS_FIFO_SIZE;
+		sim.ms_fifo_count--;
+	}
+	sim.ms_fifo[(sim.ms_fifo_head + sim.ms_fifo_count++) %
+		    SIM_MS_FIFO_SIZE] = *v;
+}
+
+/* Time between FIFO flushes, or zero if no sensor is running */
+static std::chrono::milliseconds sim_ms_interval(void)
+{
+	int i, rate = 0;
+
+	for (i = 0; i < SIM_MS_SENSORS; i++)
+		if (sim.ms_odr[i] && (!rate || sim.ms_ec_rate[i] < rate))
+			rate = sim.ms_ec_rate[i];
+	return std::chrono::milliseconds(rate);
+}
+
+/* Run the FIFO flushes which are due, and post the next one's event */
+static void sim_ms_update(void)
+{
+	sim_clock::time_point now = sim_clock::now();
+	std::chrono::milliseconds interval = sim_ms_interval();
+	struct ec_response_motion_sensor_data v;
+	struct ec_response_motion_sense_fifo_info info;
+	uint8_t event[3 + sizeof(info)] = { 0 };
+	int i;
+
+	if (!interval.count())
+		return;
+
+	while (sim.ms_next_flush <= now) {
+		for (i = 0; i < SIM_MS_SENSORS; i++) {
+			if (!sim.ms_odr[i])
+				continue;
+			while (sim.ms_next_sample[i] <= sim.ms_next_flush) {
+				memset(&v, 0, sizeof(v));
+				v.flags = MOTIONSENSE_SENSOR_FLAG_TIMESTAMP;
+				v.sensor_num = i;
+				v.timestamp =
+					sim_timestamp(sim.ms_next_sample[i]);
+				sim_ms_fifo_push(&v);
+
+				memset(&v, 0, sizeof(v));
+				v.sensor_num = i;
+				v.data[0] = sim.ms_samples[i];
+				v.data[1] = -sim.ms_samples[i];
+				v.data[2] = 1024; /* 1 g */
+				sim_ms_fifo_push(&v);
+
+				sim.ms_samples[i]++;
+				sim.ms_next_sample[i] +=
+					std::chrono::microseconds(
+						1000000000LL / sim.ms_odr[i]);
+			}
+		}
+		sim.ms_next_flush += interval;
+	}
+
+	if (sim.ms_int_enable && sim.ms_event < sim.ms_next_flush) {
+		memset(&info, 0, sizeof(info));
+		info.size = SIM_MS_FIFO_SIZE;
+		info.timestamp = sim_timestamp(sim.ms_next_flush);
+		memcpy(event + 3, &info, sizeof(info));
+		if (!sim_post_event(EC_MKBP_EVENT_SENSOR_FIFO, event,
+				    sizeof(event), sim.ms_next_flush))
+			sim.ms_event = sim.ms_next_flush;
+	}
+}
+
+static enum ec_status sim_motion_sense(struct host_cmd_handler_args *args)
+{
+	const struct ec_params_motion_sense *p =
+		(const struct ec_params_motion_sense *)args->params;
+	struct ec_response_motion_sense *r =
+		(struct ec_response_motion_sense *)args->response;
+	struct ec_response_motion_sense_fifo_data *fifo =
+		(struct ec_response_motion_sense_fifo_data *)args->response;
+	sim_clock::time_point now = sim_clock::now();
+	struct ec_response_motion_sensor_data v;
+	uint8_t event[3 + sizeof(struct ec_response_motion_sense_fifo_info)] = {
+		0
+	};
+	int i, n;
+
+	sim_ms_update();
+
+	switch (p->cmd) {
+	case MOTIONSENSE_CMD_DUMP:
+		n = MIN(p->dump.max_sensor_count, SIM_MS_SENSORS);
+		if (args->response_max <
+		    sizeof(r->dump) + n * sizeof(r->dump.sensor[0]))
+			return EC_RES_RESPONSE_TOO_BIG;
+		r->dump.module_flags = MOTIONSENSE_MODULE_FLAG_ACTIVE;
+		r->dump.sensor_count = SIM_MS_SENSORS;
+		for (i = 0; i < n; i++) {
+			memset(&r->dump.sensor[i], 0,
+			       sizeof(r->dump.sensor[i]));
+			r->dump.sensor[i].flags =
+				MOTIONSENSE_SENSOR_FLAG_PRESENT;
+			r->dump.sensor[i].data[2] = 1024;
+		}
+		args->response_size =
+			sizeof(r->dump) + n * sizeof(r->dump.sensor[0]);
+		return EC_RES_SUCCESS;
+
+	case MOTIONSENSE_CMD_EC_RATE:
+		if (p->ec_rate.sensor_num >= SIM_MS_SENSORS)
+			return EC_RES_INVALID_PARAM;
+		if (p->ec_rate.data != EC_MOTION_SENSE_NO_VALUE) {
+			if (p->ec_rate.data <= 0)
+				return EC_RES_INVALID_PARAM;
+			sim.ms_ec_rate[p->ec_rate.sensor_num] =
+				p->ec_rate.data;
+			/* Don't wait out a longer rate */
+			if (sim.ms_next_flush > now + sim_ms_interval())
+				sim.ms_next_flush = now + sim_ms_interval();
+		}
+		r->ec_rate.ret = sim.ms_ec_rate[p->ec_rate.sensor_num];
+		args->response_size = sizeof(r->ec_rate);
+		return EC_RES_SUCCESS;
+
+	case MOTIONSENSE_CMD_SENSOR_ODR:
+		i = p->sensor_odr.sensor_num;
+		if (i >= SIM_MS_SENSORS)
+			return EC_RES_INVALID_PARAM;
+		if (p->sensor_odr.data != EC_MOTION_SENSE_NO_VALUE) {
+			if (p->sensor_odr.data < 0)
+				return EC_RES_INVALID_PARAM;
+			if (!sim_ms_interval().count())
+				sim.ms_next_flush = now;
+			sim.ms_odr[i] =
+				MIN(p->sensor_odr.data, SIM_MS_MAX_ODR);
+			sim.ms_next_sample[i] = now;
+		}
+		r->sensor_odr.ret = sim.ms_odr[i];
+		args->response_size = sizeof(r->sensor_odr);
+		return EC_RES_SUCCESS;
+
+	case MOTIONSENSE_CMD_FIFO_INFO:
+		n = sizeof(r->fifo_info) + sizeof(sim.ms_lost);
+		if (args->response_max < n)
+			return EC_RES_RESPONSE_TOO_BIG;
+		r->fifo_info.size = SIM_MS_FIFO_SIZE;
+		r->fifo_info.count = sim.ms_fifo_count;
+		r->fifo_info.timestamp = sim_timestamp(now);
+		r->fifo_info.total_lost = sim.ms_total_lost;
+		memcpy(r->fifo_info.lost, sim.ms_lost, sizeof(sim.ms_lost));
+		memset(sim.ms_lost, 0, sizeof(sim.ms_lost));
+		sim.ms_total_lost = 0;
+		args->response_size = n;
+		return EC_RES_SUCCESS;
+
+	case MOTIONSENSE_CMD_FIFO_READ:
+		n = MIN(p->fifo_read.max_data_vector, sim.ms_fifo_count);
+		n = MIN(n, (args->response_max - sizeof(*fifo)) /
+				   sizeof(fifo->data[0]));
+		for (i = 0; i < n; i++) {
+			fifo->data[i] = sim.ms_fifo[sim.ms_fifo_head];
+			sim.ms_fifo_head =
+				(sim.ms_fifo_head + 1) % SIM_MS_FIFO_SIZE;
+		}
+		sim.ms_fifo_count -= n;
+		fifo->number_data = n;
+		args->response_size = sizeof(*fifo) + n * sizeof(fifo->data[0]);
+		return EC_RES_SUCCESS;
+
+	case MOTIONSENSE_CMD_FIFO_FLUSH:
+		if (p->fifo_flush.sensor_num >= SIM_MS_SENSORS)
+			return EC_RES_INVALID_PARAM;
+		memset(&v, 0, sizeof(v));
+		v.flags = MOTIONSENSE_SENSOR_FLAG_FLUSH |
+			  MOTIONSENSE_SENSOR_FLAG_TIMESTAMP;
+		v.sensor_num = p->fifo_flush.sensor_num;
+		v.timestamp = sim_timestamp(now);
+		sim_ms_fifo_push(&v);
+		if (sim.ms_int_enable)
+			sim_post_event(EC_MKBP_EVENT_SENSOR_FIFO, event,
+				       sizeof(event), now);
+		args->response_size = 0;
+		return EC_RES_SUCCESS;
+
+	case MOTIONSENSE_CMD_FIFO_INT_ENABLE:
+		if (p->fifo_int_enable.enable != EC_MOTION_SENSE_NO_VALUE) {
+			sim.ms_int_enable = p->fifo_int_enable.enable;
+			sim_ms_update();
+		}
+		r->fifo_int_enable.ret = sim.ms_int_enable;
+		args->response_size = sizeof(r->fifo_int_enable);
+		return EC_RES_SUCCESS;
+
+	default:
+		return EC_RES_INVALID_PARAM;
+	}
+}
+
+static const struct host_command sim_default_commands[] = {
+	{ sim_hello, EC_CMD_HELLO, EC_VER_MASK(0) },
+	{ sim_get_version, EC_CMD_GET_VERSION,
+	  EC_VER_MASK(0) | EC_VER_MASK(1) },
+	{ sim_get_build_info, EC_CMD_GET_BUILD_INFO, EC_VER_MASK(0) },
+	{ sim_get_chip_info, EC_CMD_GET_CHIP_INFO, EC_VER_MASK(0) },
+	{ sim_read_memmap, EC_CMD_READ_MEMMAP, EC_VER_MASK(0) },
+	{ sim_get_cmd_versions, EC_CMD_GET_CMD_VERSIONS,
+	  EC_VER_MASK(0) | EC_VER_MASK(1) },
+	{ sim_test_protocol, EC_CMD_TEST_PROTOCOL, EC_VER_MASK(0) },
+	{ sim_get_protocol_info, EC_CMD_GET_PROTOCOL_INFO, EC_VER_MASK(0) },
+	{ sim_get_features, EC_CMD_GET_FEATURES, EC_VER_MASK(0) },
+	{ sim_flash_info, EC_CMD_FLASH_INFO,
+	  EC_VER_MASK(0) | EC_VER_MASK(1) | EC_VER_MASK(2) },
+	{ sim_flash_read, EC_CMD_FLASH_READ, EC_VER_MASK(0) },
+	{ sim_flash_write, EC_CMD_FLASH_WRITE,
+	  EC_VER_MASK(0) | EC_VER_MASK(EC_VER_FLASH_WRITE) },
+	{ sim_flash_erase, EC_CMD_FLASH_ERASE, EC_VER_MASK(0) | EC_VER_MASK(1) },
+	{ sim_flash_region_info, EC_CMD_FLASH_REGION_INFO,
+	  EC_VER_MASK(EC_VER_FLASH_REGION_INFO) },
+	{ sim_flash_protect, EC_CMD_FLASH_PROTECT,
+	  EC_VER_MASK(EC_VER_FLASH_PROTECT) },
+	{ sim_vboot_hash, EC_CMD_VBOOT_HASH, EC_VER_MASK(0) },
+	{ sim_get_next_event, EC_CMD_GET_NEXT_EVENT,
+	  EC_VER_MASK(0) | EC_VER_MASK(1) | EC_VER_MASK(2) },
+	{ sim_pchg_count, EC_CMD_PCHG_COUNT, EC_VER_MASK(0) },
+	{ sim_pchg, EC_CMD_PCHG, EC_VER_MASK(1) | EC_VER_MASK(2) },
+	{ sim_pchg_update, EC_CMD_PCHG_UPDATE, EC_VER_MASK(0) },
+	{ sim_fp_mode, EC_CMD_FP_MODE, EC_VER_MASK(0) },
+	{ sim_fp_info, EC_CMD_FP_INFO, EC_VER_MASK(0) | EC_VER_MASK(1) },
+	{ sim_fp_frame, EC_CMD_FP_FRAME, EC_VER_MASK(0) },
+	{ sim_fp_template, EC_CMD_FP_TEMPLATE, EC_VER_MASK(0) },
+	{ sim_tp_frame_info, EC_CMD_TP_FRAME_INFO, EC_VER_MASK(0) },
+	{ sim_tp_frame_snapshot, EC_CMD_TP_FRAME_SNAPSHOT, EC_VER_MASK(0) },
+	{ sim_tp_frame_get, EC_CMD_TP_FRAME_GET, EC_VER_MASK(0) },
+	{ sim_motion_sense, EC_CMD_MOTION_SENSE_CMD,
+	  EC_VER_MASK(0) | EC_VER_MASK(1) | EC_VER_MASK(2) },
+};
+
+/*****************************************************************************/
+/* Host command layer */
+
+/*
+ * Process one protocol v3 request packet and build the response packet, the
+ * way host_packet_receive() does in EC firmware.  Returns the size of the
+ * response packet.
+ */
+static int sim_packet_receive(const uint8_t *request, int request_size,
+			      uint8_t *response, int response_max)
+{
+	const struct ec_host_request *rq =
+		(const struct ec_host_request *)request;
+	struct ec_host_response *rs = (struct ec_host_response *)response;
+	struct host_cmd_handler_args args = {};
+	struct sim_command *c = NULL;
+	int latency_us = sim.latency_us;
+
+	args.result = EC_RES_SUCCESS;
+
+	if (request_size < sizeof(*rq) ||
+	    rq->struct_version != EC_HOST_REQUEST_VERSION)
+		args.result = EC_RES_INVALID_HEADER;
+	else if (rq->data_len > request_size - sizeof(*rq))
+		args.result = EC_RES_REQUEST_TRUNCATED;
+	else if ((uint8_t)sum_bytes(request, sizeof(*rq) + rq->data_len))
+		args.result = EC_RES_INVALID_CHECKSUM;
+
+	if (args.result == EC_RES_SUCCESS) {
+		c = sim_find_command(rq->command);
+		if (!c)
+			args.result = EC_RES_INVALID_COMMAND;
+		else if (rq->command_version >= 32 ||
+			 !(c->cmd.version_mask &
+			   EC_VER_MASK(rq->command_version)))
+			args.result = EC_RES_INVALID_VERSION;
+	}
+
+	if (args.result == EC_RES_SUCCESS) {
+		args.command = rq->command;
+		args.version = rq->command_version;
+		args.params = rq + 1;
+		args.params_size = rq->data_len;
+		args.response = rs + 1;
+		args.response_max = response_max - sizeof(*rs);
+		args.result = c->cmd.handler(&args);
+		if (c->latency_us >= 0)
+			latency_us = c->latency_us;
+	}
+
+	if (args.result != EC_RES_SUCCESS)
+		args.response_size = 0;
+
+	rs->struct_version = EC_HOST_RESPONSE_VERSION;
+	rs->checksum = 0;
+	rs->result = args.result;
+	rs->data_len = args.response_size;
+	rs->reserved = 0;
+	rs->checksum = (uint8_t)(-sum_bytes(response,
+					    sizeof(*rs) + rs->data_len));
+
+	sim_delay_us(latency_us);
+
+	return sizeof(*rs) + rs->data_len;
+}
+
+/*****************************************************************************/
+/* Transport */
+
+static int ec_command_sim(int command, int version, const void *outdata,
+			  int outsize, void *indata, int insize)
+{
+	struct ec_host_request *rq = (struct ec_host_request *)sim_request;
+	struct ec_host_response *rs = (struct ec_host_response *)sim_response;
+	int request_size = sizeof(*rq) + outsize;
+	int response_size;
+
+	if (request_size > sim.packet_size)
+		return -EC_RES_REQUEST_TRUNCATED;
+
+	rq->struct_version = EC_HOST_REQUEST_VERSION;
+	rq->checksum = 0;
+	rq->command = command;
+	rq->command_version = version;
+	rq->reserved = 0;
+	rq->data_len = outsize;
+	if (outsize)
+		memcpy(rq + 1, outdata, outsize);
+	rq->checksum = (uint8_t)(-sum_bytes(rq, request_size));
+
+	response_size = sim_packet_receive(sim_request, request_size,
+					   sim_response, sim.packet_size);
+
+	if (rs->struct_version != EC_HOST_RESPONSE_VERSION) {
+		fprintf(stderr, "EC response version mismatch\n");
+		return -EC_RES_INVALID_RESPONSE;
+	}
+
+	if ((uint8_t)sum_bytes(rs, response_size)) {
+		fprintf(stderr, "EC response has invalid checksum\n");
+		return -EC_RES_INVALID_CHECKSUM;
+	}
+
+	if (rs->result != EC_RES_SUCCESS)
+		return -EECRESULT - rs->result;
+
+	if (rs->data_len > insize) {
+		fprintf(stderr, "EC returned too much data\n");
+		return -EC_RES_RESPONSE_TOO_BIG;
+	}
+
+	if (rs->data_len)
+		memcpy(indata, rs + 1, rs->data_len);
+	return rs->data_len;
+}
+
+static int ec_readmem_sim(int offset, int bytes, void *dest)
+{
+	char *s = (char *)dest;
+	int cnt = 0;
+
+	if (offset < 0 || offset >= EC_MEMMAP_SIZE - bytes)
+		return -1;
+
+	sim_delay_us(sim.memmap_latency_us);
+
+	if (bytes) { /* fixed length */
+		memcpy(dest, sim.memmap + offset, bytes);
+		return bytes;
+	}
+
+	/* string */
+	for (; offset < EC_MEMMAP_SIZE; offset++, s++) {
+		*s = sim.memmap[offset];
+		cnt++;
+		if (!*s)
+			break;
+	}
+	return cnt;
+}
+
+static int ec_pollevent_sim(unsigned long mask, void *buffer, size_t buf_size,
+			    int timeout)
+{
+	std::unique_lock<std::mutex> lock(sim.event_lock);
+	auto deadline = sim_clock::now() + std::chrono::milliseconds(timeout);
+	uint8_t *r = (uint8_t *)buffer;
+	struct sim_event *e;
+	int i, n;
+
+	for (;;) {
+		/* Discard events which have not been asked for */
+		while (sim.num_events) {
+			e = &sim.events[sim.event_head];
+			if (mask & BIT(e->event_type))
+				break;
+			sim.event_head = (sim.event_head + 1) % SIM_MAX_EVENTS;
+			sim.num_events--;
+		}
+		if (sim.num_events) {
+			/* Wait for an event posted for later to be due */
+			e = &sim.events[sim.event_head];
+			if (sim_clock::now() >= e->ready)
+				break;
+			if (timeout >= 0 && e->ready > deadline) {
+				sim.event_cv.wait_until(lock, deadline);
+				if (sim_clock::now() >= deadline)
+					return 0;
+				continue;
+			}
+			sim.event_cv.wait_until(lock, e->ready);
+			continue;
+		}
+		if (timeout >= 0 && sim.event_cv.wait_until(lock, deadline) ==
+					    std::cv_status::timeout)
+			return 0;
+		if (timeout < 0)
+			sim.event_cv.wait(lock);
+	}
+
+	e = &sim.events[sim.event_head];
+	n = MIN(buf_size, 1 + e->size);
+	for (i = 0; i < n; i++)
+		r[i] = i ? e->data[i - 1] : e->event_type;
+
+	sim.event_head = (sim.event_head + 1) % SIM_MAX_EVENTS;
+	sim.num_events--;
+	return n;
+}
+
+/*****************************************************************************/
+/* Public interface */
+
+int sim_ec_set_command(int command, int version_mask,
+		       enum ec_status (*handler)(
+			       struct host_cmd_handler_args *args))
+{
+	struct sim_command *c = sim_find_command(command);
+
+	if (!version_mask || !handler) {
+		if (c)
+			*c = sim.commands[--sim.num_commands];
+		return 0;
+	}
+
+	if (!c) {
+		if (sim.num_commands == SIM_MAX_COMMANDS)
+			return 1;
+		c = &sim.commands[sim.num_commands++];
+		c->latency_us = -1;
+	}
+
+	c->cmd.handler = handler;
+	c->cmd.command = command;
+	c->cmd.version_mask = version_mask;
+	return 0;
+}
+
+int sim_ec_set_latency(int command, int usec)
+{
+	struct sim_command *c;
+
+	if (command < 0) {
+		sim.latency_us = usec;
+		return 0;
+	}
+
+	c = sim_find_command(command);
+	if (!c)
+		return 1;
+	c->latency_us = usec;
+	return 0;
+}
+
+uint8_t *sim_ec_memmap(void)
+{
+	return sim.memmap;
+}
+
+uint8_t *sim_ec_flash(int *size)
+{
+	if (size)
+		*size = sim.flash_size;
+	return sim.flash;
+}
+
+/*
+ * Queue an event to be delivered from 'ready'.  Events are delivered in
+ * order, so a later one waits behind it.
+ */
+static int sim_post_event(uint8_t event_type, const void *data, int size,
+			  sim_clock::time_point ready)
+{
+	std::lock_guard<std::mutex> guard(sim.event_lock);
+	struct sim_event *e;
+
+	if (sim.num_events == SIM_MAX_EVENTS || size > sizeof(e->data))
+		return 1;
+
+	e = &sim.events[(sim.event_head + sim.num_events) % SIM_MAX_EVENTS];
+	e->ready = ready;
+	e->event_type = event_type;
+	e->size = size;
+	memcpy(e->data, data, size);
+	sim.num_events++;
+	sim.event_cv.notify_all();
+	return 0;
+}
+
+int sim_ec_post_event(uint8_t event_type, const void *data, int size)
+{
+	return sim_post_event(event_type, data, size, sim_clock::now());
+}
+
+/*****************************************************************************/
+/* Initialization */
+
+static void sim_init_memmap(uint8_t *m)
+{
+	uint16_t *fans = (uint16_t *)(m + EC_MEMMAP_FAN);
+	uint32_t *batt = (uint32_t *)(m + EC_MEMMAP_BATT_VOLT);
+	int i;
+
+	memset(m, 0, EC_MEMMAP_SIZE);
+
+	/* Two temperature sensors, one fan */
+	memset(m + EC_MEMMAP_TEMP_SENSOR, EC_TEMP_SENSOR_NOT_PRESENT, 16);
+	memset(m + EC_MEMMAP_TEMP_SENSOR_B, EC_TEMP_SENSOR_NOT_PRESENT, 8);
+	m[EC_MEMMAP_TEMP_SENSOR + 0] = 300 - EC_TEMP_SENSOR_OFFSET;
+	m[EC_MEMMAP_TEMP_SENSOR + 1] = 310 - EC_TEMP_SENSOR_OFFSET;
+	for (i = 0; i < EC_FAN_SPEED_ENTRIES; i++)
+		fans[i] = EC_FAN_SPEED_NOT_PRESENT;
+	fans[0] = 2500;
+
+	m[EC_MEMMAP_ID] = 'E';
+	m[EC_MEMMAP_ID + 1] = 'C';
+	m[EC_MEMMAP_ID_VERSION] = 1;
+	m[EC_MEMMAP_THERMAL_VERSION] = 2;
+	m[EC_MEMMAP_BATTERY_VERSION] = 1;
+	m[EC_MEMMAP_SWITCHES_VERSION] = 1;
+	m[EC_MEMMAP_EVENTS_VERSION] = 1;
+	m[EC_MEMMAP_HOST_CMD_FLAGS] = EC_HOST_CMD_FLAG_VERSION_3;
+
+	/* A charging battery */
+	batt[0] = 12600; /* EC_MEMMAP_BATT_VOLT */
+	batt[1] = 1500; /* EC_MEMMAP_BATT_RATE */
+	batt[2] = 3900; /* EC_MEMMAP_BATT_CAP */
+	m[EC_MEMMAP_BATT_FLAG] = EC_BATT_FLAG_AC_PRESENT |
+				 EC_BATT_FLAG_BATT_PRESENT |
+				 EC_BATT_FLAG_CHARGING;
+	m[EC_MEMMAP_BATT_COUNT] = 1;
+	*(uint32_t *)(m + EC_MEMMAP_BATT_DCAP) = 5000;
+	*(uint32_t *)(m + EC_MEMMAP_BATT_DVLT) = 11550;
+	*(uint32_t *)(m + EC_MEMMAP_BATT_LFCC) = 4800;
+	*(uint32_t *)(m + EC_MEMMAP_BATT_CCNT) = 42;
+	strcpy((char *)m + EC_MEMMAP_BATT_MFGR, "SIM");
+	strcpy((char *)m + EC_MEMMAP_BATT_MODEL, "SIMBAT");
+	strcpy((char *)m + EC_MEMMAP_BATT_SERIAL, "0001");
+	strcpy((char *)m + EC_MEMMAP_BATT_TYPE, "LION");
+}
+
+static int sim_load_file(const char *filename, uint8_t *dest, int size)
+{
+	FILE *f = fopen(filename, "rb");
+	int n;
+
+	if (!f) {
+		perror("Error opening simulator input file");
+		return -1;
+	}
+	n = fread(dest, 1, size, f);
+	fclose(f);
+	return n < 0 ? -1 : 0;
+}
+
+static int sim_parse_int(const char *s, int *dest)
+{
+	char *e;
+
+	*dest = strtol(s, &e, 0);
+	return (!*s || (e && *e)) ? -1 : 0;
+}
+
+static int sim_read_config(const char *filename, char *flash_image,
+			   char *memmap_image, int image_max)
+{
+	FILE *f = fopen(filename, "r");
+	char line[256];
+	char *key, *arg1, *arg2;
+	int lineno = 0;
+	int v1, v2;
+	int rv = 0;
+
+	if (!f) {
+		perror("Error opening simulator config");
+		return -1;
+	}
+
+	while (!rv && fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (strchr(line, '#'))
+			*strchr(line, '#') = '\0';
+
+		key = strtok(line, " \t\r\n=");
+		if (!key)
+			continue;
+		arg1 = strtok(NULL, " \t\r\n");
+		arg2 = strtok(NULL, " \t\r\n");
+		if (!arg1) {
+			rv = -1;
+			break;
+		}
+
+		if (!strcmp(key, "version")) {
+			strncpy(sim.version, arg1, sizeof(sim.version) - 1);
+		} else if (!strcmp(key, "build_info")) {
+			strncpy(sim.build_info, arg1,
+				sizeof(sim.build_info) - 1);
+		} else if (!strcmp(key, "flash_image")) {
+			strncpy(flash_image, arg1, image_max - 1);
+		} else if (!strcmp(key, "memmap_image")) {
+			strncpy(memmap_image, arg1, image_max - 1);
+		} else if (sim_parse_int(arg1, &v1)) {
+			rv = -1;
+		} else if (!strcmp(key, "flash_size")) {
+			sim.flash_size = v1;
+		} else if (!strcmp(key, "erase_size")) {
+			sim.erase_size = v1;
+		} else if (!strcmp(key, "write_block_size")) {
+			sim.write_block_size = v1;
+		} else if (!strcmp(key, "write_ideal_size")) {
+			sim.write_ideal_size = v1;
+		} else if (!strcmp(key, "packet_size")) {
+			sim.packet_size = v1;
+		} else if (!strcmp(key, "erase_time")) {
+			sim.erase_time_us = v1;
+		} else if (!strcmp(key, "hash_time")) {
+			sim.hash_time_us = v1;
+		} else if (!strcmp(key, "pchg_write_time")) {
+			sim.pchg_write_time_us = v1;
+		} else if (!strcmp(key, "fp_capture_time")) {
+			sim.fp_capture_time_us = v1;
+		} else if (!strcmp(key, "fp_templates")) {
+			if (v1 < 0 || v1 > SIM_FP_TEMPLATE_MAX)
+				rv = -1;
+			else
+				sim_fp_enroll(v1);
+		} else if (!strcmp(key, "memmap_latency")) {
+			sim.memmap_latency_us = v1;
+		} else if (!strcmp(key, "latency")) {
+			if (!arg2)
+				sim_ec_set_latency(-1, v1);
+			else if (sim_parse_int(arg2, &v2) ||
+				 sim_ec_set_latency(v1, v2))
+				rv = -1;
+		} else if (!strcmp(key, "disable")) {
+			sim_ec_set_command(v1, 0, NULL);
+		} else {
+			rv = -1;
+		}
+	}
+	fclose(f);
+
+	if (rv)
+		fprintf(stderr, "%s:%d: invalid simulator directive\n",
+			filename, lineno);
+	return rv;
+}
+
+int comm_init_sim(const char *config)
+{
+	char flash_image[256] = "";
+	char memmap_image[256] = "";
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sim_default_commands); i++)
+		sim_ec_set_command(sim_default_commands[i].command,
+				   sim_default_commands[i].version_mask,
+				   sim_default_commands[i].handler);
+	sim.latency_us = 0;
+	sim.memmap_latency_us = 0;
+	sim.flash_size = SIM_DEFAULT_FLASH_SIZE;
+	sim.erase_size = SIM_DEFAULT_ERASE_SIZE;
+	sim.write_block_size = SIM_DEFAULT_WRITE_BLOCK_SIZE;
+	sim.write_ideal_size = SIM_DEFAULT_WRITE_IDEAL_SIZE;
+	sim.erase_time_us = SIM_DEFAULT_ERASE_TIME;
+	sim.hash_time_us = SIM_DEFAULT_HASH_TIME;
+	sim.pchg_write_time_us = SIM_DEFAULT_PCHG_WRITE_TIME;
+	sim.fp_capture_time_us = SIM_DEFAULT_FP_CAPTURE_TIME;
+	sim.pchg_state = PCHG_STATE_ENABLED;
+	sim.packet_size = SIM_DEFAULT_PACKET_SIZE;
+	sim.boot = sim_clock::now();
+	for (i = 0; i < SIM_MS_SENSORS; i++) {
+		sim.ms_odr[i] = SIM_MS_DEFAULT_ODR;
+		sim.ms_ec_rate[i] = SIM_MS_DEFAULT_EC_RATE;
+		sim.ms_next_sample[i] = sim.boot;
+	}
+	sim.ms_next_flush = sim.boot;
+	strcpy(sim.version, "sim_v1.0.0");
+	strcpy(sim.build_info, "sim_v1.0.0 ectool-sim");
+	sim_init_memmap(sim.memmap);
+
+	if (config && strcmp(config, CROS_EC_DEV_NAME) &&
+	    sim_read_config(config, flash_image, memmap_image,
+			    sizeof(flash_image)))
+		return 1;
+
+	if (sim.packet_size <= (int)sizeof(struct ec_host_request) ||
+	    sim.packet_size > SIM_MAX_PACKET_SIZE) {
+		fprintf(stderr, "Invalid simulator packet size %d\n",
+			sim.packet_size);
+		return 1;
+	}
+	if (sim.erase_size <= 0 || sim.write_block_size <= 0 ||
+	    sim.write_ideal_size <= 0 || sim.flash_size <= 0 ||
+	    sim.flash_size % sim.erase_size) {
+		fprintf(stderr, "Invalid simulator flash geometry\n");
+		return 1;
+	}
+
+	free(sim.flash);
+	sim.flash = (uint8_t *)malloc(sim.flash_size);
+	if (!sim.flash) {
+		fprintf(stderr, "Unable to allocate simulator flash\n");
+		return 1;
+	}
+	memset(sim.flash, 0xff, sim.flash_size);
+
+	if (*flash_image &&
+	    sim_load_file(flash_image, sim.flash, sim.flash_size))
+		return 1;
+	if (*memmap_image &&
+	    sim_load_file(memmap_image, sim.memmap, EC_MEMMAP_SIZE))
+		return 1;
+
+	ec_command_proto = ec_command_sim;
+	ec_readmem = ec_readmem_sim;
+	ec_pollevent = ec_pollevent_sim;
+	ec_transport_name = "sim";
+
+	/* Set temporary size, will be updated later. */
+	ec_max_outsize = EC_PROTO2_MAX_PARAM_SIZE - 8;
+	ec_max_insize = EC_PROTO2_MAX_PARAM_SIZE;
+
+	return 0;
+}
@@ -0,0 +1,96 @@
+/* Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * In-process simulated EC, used to benchmark and regression test ectool
+ * without real hardware.
+ */
+
+#ifndef __UTIL_COMM_SIM_H
+#define __UTIL_COMM_SIM_H
+
+#include "common.h"
+#include "ec_commands.h"
+
+struct host_cmd_handler_args;
+
+/**
+ * Initialize the simulated EC transport.
+ *
+ * The simulated EC speaks host command protocol v3 and models a memory map,
+ * a flash array and a set of host commands, each with a configurable
+ * latency.
+ *
+ * @param config  Path to a configuration file, or NULL (or the default
+ *                device name) to use the built-in defaults.  The file
+ *                contains one directive per line; '#' starts a comment:
+ *
+ *                  flash_size <bytes>
+ *                  erase_size <bytes>
+ *                  write_block_size <bytes>
+ *                  write_ideal_size <bytes>
+ *                  packet_size <bytes>
+ *                  erase_time <usec per erase block>
+ *                  hash_time <usec per KiB for EC_CMD_VBOOT_HASH>
+ *                  pchg_write_time <usec per peripheral charger
+ *                                   firmware update block>
+ *                  fp_capture_time <usec per fingerprint capture>
+ *                  fp_templates <count>      (enrolled at start)
+ *                  latency <usec>            (default for all commands)
+ *                  latency <cmd> <usec>      (for a single command)
+ *                  memmap_latency <usec>     (per ec_readmem() call)
+ *                  disable <cmd>             (remove from command set)
+ *                  version <string>
+ *                  build_info <string>
+ *                  flash_image <file>
+ *                  memmap_image <file>
+ * @return 0 if success, non-zero otherwise.
+ */
+int comm_init_sim(const char *config);
+
+/**
+ * Add, replace or remove a command of the simulated EC.
+ *
+ * @param command	Command code (EC_CMD_...)
+ * @param version_mask	Mask of supported versions; 0 removes the command.
+ * @param handler	Command handler, with the same contract as an EC
+ *			firmware host command handler.
+ * @return 0 if success, non-zero if the command table is full.
+ */
+int sim_ec_set_command(int command, int version_mask,
+		       enum ec_status (*handler)(
+			       struct host_cmd_handler_args *args));
+
+/**
+ * Set the simulated processing latency of a command.
+ *
+ * @param command	Command code, or -1 to set the default latency.
+ * @param usec		Latency in microseconds.
+ * @return 0 if success, non-zero if the command is not implemented.
+ */
+int sim_ec_set_latency(int command, int usec);
+
+/**
+ * Return the simulated memory map (EC_MEMMAP_SIZE bytes).
+ */
+uint8_t *sim_ec_memmap(void);
+
+/**
+ * Return the simulated flash array.
+ *
+ * @param size	If not NULL, the flash size in bytes is stored here.
+ */
+uint8_t *sim_ec_flash(int *size);
+
+/**
+ * Queue a MKBP event, to be returned by ec_pollevent() or
+ * EC_CMD_GET_NEXT_EVENT.
+ *
+ * @param event_type	One of enum ec_mkbp_event.
+ * @param data		Event data
+ * @param size		Size of event data in bytes
+ * @return 0 if success, non-zero if the event queue is full.
+ */
+int sim_ec_post_event(uint8_t event_type, const void *data, int size);
+
+#endif /* __UTIL_COMM_SIM_H */
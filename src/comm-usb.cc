@@ -11,6 +11,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 #include "comm-host.h"
 #include "comm-usb.h"
 #include "ec_commands.h"
@@ -35,6 +40,39 @@ struct usb_endpoint {
 
 struct usb_endpoint uep;
 
+/*
+ * Asynchronous transfer engine.
+ *
+ * Each command in flight uses a slot: an OUT and an IN transfer, with their
+ * buffers, which are reused from one command to the next.  The IN transfer
+ * is submitted before the OUT one, so the response is collected as soon as
+ * the EC has it.  A libusb event thread completes transfers while callers
+ * wait.  ec_command_batch() keeps up to usb_queue_depth commands in flight;
+ * by default only one, since the EC only queues requests if its USB
+ * endpoint buffers allow it.
+ */
+#define USB_MAX_QUEUE_DEPTH 8
+#define USB_OUT_TIMEOUT_MS 2000
+#define USB_IN_TIMEOUT_MS 5000
+
+struct usb_slot {
+	struct libusb_transfer *out;
+	struct libusb_transfer *in;
+	uint8_t *out_buf;
+	uint8_t *in_buf;
+	int buf_size;
+	/* Transfers submitted and not yet completed, under usb_lock */
+	int pending;
+};
+
+static struct usb_slot usb_slots[USB_MAX_QUEUE_DEPTH];
+static int usb_queue_depth = 1;
+static std::mutex usb_lock;
+static std::condition_variable usb_cond;
+static std::thread usb_event_thread;
+static std::atomic<bool> usb_event_stop;
+static bool usb_event_stop_registered;
+
 static void print_libusb_error(const char *file, int line, const char *message,
 			       int error_code)
 {
@@ -45,10 +83,31 @@ static void print_libusb_error(const char *file, int line, const char *message,
 		error_code, libusb_strerror((enum libusb_error)error_code));
 }
 
+static void usb_event_thread_stop(void)
+{
+	if (usb_event_thread.joinable()) {
+		usb_event_stop = true;
+		libusb_interrupt_event_handler(NULL);
+		usb_event_thread.join();
+	}
+}
+
 void comm_usb_exit(void)
 {
+	int i;
+
 	debug("Exit libusb.\n");
 
+	usb_event_thread_stop();
+
+	for (i = 0; i < USB_MAX_QUEUE_DEPTH; i++) {
+		libusb_free_transfer(usb_slots[i].out);
+		libusb_free_transfer(usb_slots[i].in);
+		free(usb_slots[i].out_buf);
+		free(usb_slots[i].in_buf);
+		memset(&usb_slots[i], 0, sizeof(usb_slots[i]));
+	}
+
 	if (uep.iface_num)
 		libusb_release_interface(uep.devh, uep.iface_num);
 	if (uep.devh)
@@ -58,63 +117,6 @@ void comm_usb_exit(void)
 	memset(&uep, 0, sizeof(uep));
 }
 
-/*
- * Actual USB transfer function, <allow_less> indicates that a valid response
- * (e.g. EC_CMD_GET_BUILD_INFO) could be shorter than <inlen>.
- *
- * Returns enum libusb_error (< 0) or -EECRESULT on error. On success, returns
- * actually transferred OUT data size or IN data size if read is performed.
- */
-static int do_xfer(struct usb_endpoint *uep, void *outbuf, int outlen,
-		   void *inbuf, int inlen, int allow_less)
-{
-	int r, actual;
-
-	/* Send data out */
-	if (outbuf && outlen) {
-		actual = 0;
-		r = libusb_bulk_transfer(uep->devh, uep->ep_num,
-					 (uint8_t *)outbuf, outlen, &actual,
-					 2000);
-		if (r != 0) {
-			USB_ERROR("libusb_bulk_transfer", r);
-			return r;
-		}
-		if (actual != outlen) {
-			fprintf(stderr, "%s:%d, only sent %d/%d bytes\n",
-				__FILE__, __LINE__, actual, outlen);
-			return -EECRESULT;
-		}
-	}
-	debug("Sent %d bytes, expecting to receive %d bytes.\n", outlen, inlen);
-
-	/* Read reply back */
-	if (inbuf && inlen) {
-		actual = 0;
-		/*
-		 * libusb_bulk_transfer may time out if actual < inlen and
-		 * actual is a multiple of ep->wMaxPacketSize.
-		 */
-		r = libusb_bulk_transfer(uep->devh, uep->ep_num | USB_DIR_IN,
-					 (uint8_t *)inbuf, inlen, &actual,
-					 5000);
-		if (r != 0) {
-			USB_ERROR("libusb_bulk_transfer", r);
-			return r;
-		}
-		if ((actual != inlen) && !allow_less) {
-			fprintf(stderr, "%s:%d, only received %d/%d bytes\n",
-				__FILE__, __LINE__, actual, inlen);
-			return -EECRESULT;
-		}
-	}
-
-	debug("Received %d bytes.\n", actual);
-
-	/* actual is useful for allow_less. */
-	return actual;
-}
-
 /* Return iface # or -1 if not found. */
 static int find_interface_with_endpoint(struct usb_endpoint *uep)
 {
@@ -295,24 +297,73 @@ static int sum_bytes(const void *data, int length)
 	return sum;
 }
 
-static int ec_command_usb(int command, int version, const void *outdata,
-			  int outsize, void *indata, int insize)
+static void LIBUSB_CALL usb_transfer_done(struct libusb_transfer *t)
 {
-	struct ec_host_request *req;
-	struct ec_host_response *res;
-	size_t req_len, res_len;
-	int rv = -1;
+	struct usb_slot *slot = (struct usb_slot *)t->user_data;
+	std::lock_guard<std::mutex> lock(usb_lock);
 
-	assert(outsize == 0 || outdata != NULL);
-	assert(insize == 0 || indata != NULL);
+	/* Don't wait for a response to a request which wasn't sent */
+	if (t == slot->out && t->status != LIBUSB_TRANSFER_COMPLETED &&
+	    slot->pending == 2)
+		libusb_cancel_transfer(slot->in);
+
+	slot->pending--;
+	usb_cond.notify_all();
+}
+
+static void usb_event_loop(void)
+{
+	struct timeval tv = { 1, 0 };
+
+	while (!usb_event_stop)
+		libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+}
+
+static void usb_slot_wait(struct usb_slot *slot)
+{
+	std::unique_lock<std::mutex> lock(usb_lock);
+
+	usb_cond.wait(lock, [slot] { return !slot->pending; });
+}
+
+static int usb_slot_reserve(struct usb_slot *slot, int size)
+{
+	if (!slot->out)
+		slot->out = libusb_alloc_transfer(0);
+	if (!slot->in)
+		slot->in = libusb_alloc_transfer(0);
+	if (!slot->out || !slot->in)
+		return LIBUSB_ERROR_NO_MEM;
+
+	if (size <= slot->buf_size)
+		return 0;
+
+	free(slot->out_buf);
+	free(slot->in_buf);
+	slot->out_buf = (uint8_t *)malloc(size);
+	slot->in_buf = (uint8_t *)malloc(size);
+	if (!slot->out_buf || !slot->in_buf) {
+		slot->buf_size = 0;
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	slot->buf_size = size;
+	return 0;
+}
+
+/* Build a request in a slot and start its transfers */
+static int usb_slot_submit(struct usb_slot *slot, int command, int version,
+			   const void *outdata, int outsize, int insize)
+{
+	struct ec_host_request *req;
+	int req_len = sizeof(*req) + outsize;
+	int res_len = sizeof(struct ec_host_response) + insize;
+	int r;
 
-	req_len = sizeof(*req) + outsize;
-	req = (struct ec_host_request *)malloc(req_len);
-	res_len = sizeof(*res) + insize;
-	res = (struct ec_host_response *)malloc(res_len);
-	if (req == NULL || res == NULL)
-		goto out;
+	r = usb_slot_reserve(slot, MAX(req_len, res_len));
+	if (r < 0)
+		return r;
 
+	req = (struct ec_host_request *)slot->out_buf;
 	req->struct_version = EC_HOST_REQUEST_VERSION; /* 3 */
 	req->checksum = 0;
 	req->command = command;
@@ -323,27 +374,147 @@ static int ec_command_usb(int command, int version, const void *outdata,
 		memcpy(&req[1], outdata, outsize);
 	req->checksum = (uint8_t)(-sum_bytes(req, req_len));
 
-	memset(res, 0, res_len);
+	memset(slot->in_buf, 0, res_len);
+
+	libusb_fill_bulk_transfer(slot->in, uep.devh, uep.ep_num | USB_DIR_IN,
+				  slot->in_buf, res_len, usb_transfer_done,
+				  slot, USB_IN_TIMEOUT_MS);
+	libusb_fill_bulk_transfer(slot->out, uep.devh, uep.ep_num,
+				  slot->out_buf, req_len, usb_transfer_done,
+				  slot, USB_OUT_TIMEOUT_MS);
 
 	debug("Running command 0x%04x\n", command);
-	rv = do_xfer(&uep, req, req_len, res, res_len, 1);
-	if (rv < 0)
-		goto out;
+
+	slot->pending = 2;
+	r = libusb_submit_transfer(slot->in);
+	if (r < 0) {
+		slot->pending = 0;
+		USB_ERROR("libusb_submit_transfer", r);
+		return r;
+	}
+	r = libusb_submit_transfer(slot->out);
+	if (r < 0) {
+		USB_ERROR("libusb_submit_transfer", r);
+		{
+			std::lock_guard<std::mutex> lock(usb_lock);
+			slot->pending--;
+		}
+		libusb_cancel_transfer(slot->in);
+		usb_slot_wait(slot);
+		return r;
+	}
+
+	return 0;
+}
+
+/* Wait for a slot's transfers; returns what ec_command() should return */
+static int usb_slot_finish(struct usb_slot *slot, void *indata, int insize)
+{
+	struct ec_host_response *res = (struct ec_host_response *)slot->in_buf;
+	struct libusb_transfer *out = slot->out;
+	struct libusb_transfer *in = slot->in;
+
+	usb_slot_wait(slot);
+
+	if (out->status != LIBUSB_TRANSFER_COMPLETED ||
+	    out->actual_length != out->length) {
+		fprintf(stderr, "%s:%d, only sent %d/%d bytes (status %d)\n",
+			__FILE__, __LINE__, out->actual_length, out->length,
+			out->status);
+		return out->status == LIBUSB_TRANSFER_TIMED_OUT ?
+			       LIBUSB_ERROR_TIMEOUT :
+			       -EECRESULT;
+	}
+
+	/*
+	 * The response may be shorter than asked for (for example
+	 * EC_CMD_GET_BUILD_INFO), but must have a header.
+	 */
+	if (in->status != LIBUSB_TRANSFER_COMPLETED ||
+	    in->actual_length < (int)sizeof(*res)) {
+		fprintf(stderr, "%s:%d, only received %d/%d bytes (status %d)\n",
+			__FILE__, __LINE__, in->actual_length, in->length,
+			in->status);
+		return in->status == LIBUSB_TRANSFER_TIMED_OUT ?
+			       LIBUSB_ERROR_TIMEOUT :
+			       -EECRESULT;
+	}
+
+	debug("Received %d bytes.\n", in->actual_length);
 
 	if (indata)
 		memcpy(indata, &res[1], insize);
 	if (res->result == EC_RES_SUCCESS)
-		rv = res->data_len;
-	else
-		rv = -EECRESULT - res->result;
+		return res->data_len;
+	return -EECRESULT - res->result;
+}
 
-out:
-	if (req)
-		free(req);
-	if (res)
-		free(res);
+static int ec_command_usb(int command, int version, const void *outdata,
+			  int outsize, void *indata, int insize)
+{
+	struct usb_slot *slot = &usb_slots[0];
+	int rv;
+
+	assert(outsize == 0 || outdata != NULL);
+	assert(insize == 0 || indata != NULL);
 
-	return rv;
+	rv = usb_slot_submit(slot, command, version, outdata, outsize, insize);
+	if (rv < 0)
+		return rv;
+
+	return usb_slot_finish(slot, indata, insize);
+}
+
+static int ec_command_batch_usb(struct ec_command_batch_entry *cmds,
+				int count)
+{
+	struct ec_command_batch_entry *e;
+	int failed = count;
+	int sent = 0;
+	int done = 0;
+	int rv;
+
+	while (1) {
+		/* Keep the queue full until something fails */
+		while (sent < count && failed == count &&
+		       sent - done < usb_queue_depth) {
+			e = &cmds[sent];
+			rv = usb_slot_submit(&usb_slots[sent % usb_queue_depth],
+					     e->command, e->version, e->outdata,
+					     e->outsize, e->insize);
+			if (rv < 0) {
+				e->result = rv;
+				failed = sent;
+				break;
+			}
+			sent++;
+		}
+
+		if (done == sent)
+			break;
+
+		e = &cmds[done];
+		e->result = usb_slot_finish(&usb_slots[done % usb_queue_depth],
+					    e->indata, e->insize);
+		if (e->result < 0 && done < failed)
+			failed = done;
+		done++;
+	}
+
+	return failed;
+}
+
+int comm_usb_set_queue_depth(int depth)
+{
+	if (depth < 1 || depth > USB_MAX_QUEUE_DEPTH)
+		return -1;
+
+	usb_queue_depth = depth;
+	/* With one command in flight a batch is no better than a loop */
+	if (ec_command_proto == ec_command_usb)
+		ec_command_batch_proto = depth > 1 ? ec_command_batch_usb :
+						     NULL;
+	return 0;
 }
 
 int comm_init_usb(uint16_t vid, uint16_t pid)
@@ -355,7 +526,18 @@ int comm_init_usb(uint16_t vid, uint16_t pid)
 	if (find_endpoint(vid, pid, NULL, &uep) < 0)
 		return -1;
 
+	usb_event_stop = false;
+	usb_event_thread = std::thread(usb_event_loop);
+	/*
+	 * Commands call exit() on some errors without comm_usb_exit(), and
+	 * destroying a joinable std::thread terminates the process.
+	 */
+	if (!usb_event_stop_registered && !atexit(usb_event_thread_stop))
+		usb_event_stop_registered = true;
+
 	ec_command_proto = ec_command_usb;
+	ec_transport_name = "usb";
+	comm_usb_set_queue_depth(usb_queue_depth);
 
 	/* Set large size temporarily, will be updated (reduced) later. */
 	ec_max_outsize = 0x400;
@@ -29,6 +29,16 @@ int parse_vidpid(const char *input, uint16_t *vid_ptr, uint16_t *pid_ptr);
  */
 int comm_init_usb(uint16_t vid, uint16_t pid);
 
+/**
+ * Set how many commands ec_command_batch() keeps in flight.  Only raise it
+ * for targets which can queue host commands on their USB endpoint.  May be
+ * called before comm_init_usb().
+ *
+ * @param depth  Number of commands, 1 to 8.  Defaults to 1.
+ * @return       Zero if success or non-zero otherwise.
+ */
+int comm_usb_set_queue_depth(int depth);
+
 /**
  * Clean up USB communication.
  */
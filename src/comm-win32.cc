@@ -161,6 +161,7 @@ int comm_init_dev(const char *device_name)
 		return 1;
 
 	ec_command_proto = ec_command_win32;
+	ec_transport_name = "dev";
 	ec_cmd_readmem = ec_readmem_win32;
 
 	if (ec_cmd_readmem(EC_MEMMAP_ID, 2, version) == 2 &&
@@ -56,12 +56,17 @@ static const uint32_t crc32_tab[] = {
 	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
 };
 
-static uint32_t _crc32_hash(uint32_t crc, const void *buf, int size)
-{
-	const uint8_t *p;
+/*
+ * Tables for slicing-by-8: crc32_tables[k][b] is the CRC of byte b followed
+ * by k zero bytes, so eight bytes can be folded in with eight lookups.
+ */
+static uint32_t crc32_tables[8][256];
 
-	p = (const uint8_t *)buf;
+/* Bytes needed before the carry-less multiply kernels are worth using */
+#define CRC32_FOLD_MIN 64
 
+static uint32_t crc32_hash_bytes(uint32_t crc, const uint8_t *p, int size)
+{
 	while (size--) {
 		crc ^= *p++;
 		crc = crc32_tab[crc & 0xFF] ^ (crc >> 8);
@@ -70,6 +75,280 @@ static uint32_t _crc32_hash(uint32_t crc, const void *buf, int size)
 	return crc;
 }
 
+static uint32_t crc32_hash_slice8(uint32_t crc, const uint8_t *p, int size)
+{
+	uint32_t one;
+
+	for (; size >= 8; p += 8, size -= 8) {
+		one = crc ^ (p[0] | p[1] << 8 | p[2] << 16 |
+			     (uint32_t)p[3] << 24);
+		crc = crc32_tables[7][one & 0xff] ^
+		      crc32_tables[6][(one >> 8) & 0xff] ^
+		      crc32_tables[5][(one >> 16) & 0xff] ^
+		      crc32_tables[4][one >> 24] ^ crc32_tables[3][p[4]] ^
+		      crc32_tables[2][p[5]] ^ crc32_tables[1][p[6]] ^
+		      crc32_tables[0][p[7]];
+	}
+
+	return crc32_hash_bytes(crc, p, size);
+}
+
+/*
+ * Folding with carry-less multiplies, after "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction" (Intel, 2009).  Four
+ * 128-bit lanes are folded 64 bytes at a time, then into one lane, which
+ * is Barrett-reduced to the CRC.  'size' must be a multiple of 16, at least
+ * CRC32_FOLD_MIN.  The constants are for the bit-reflected polynomial.
+ */
+static const uint64_t crc32_k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+static const uint64_t crc32_k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+static const uint64_t crc32_k5k0[] = { 0x0163cd6124, 0x0000000000 };
+static const uint64_t crc32_poly[] = { 0x01db710641, 0x01f7011641 };
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC32_HAVE_FOLD
+#include <immintrin.h>
+
+__attribute__((target("pclmul,sse2"))) static uint32_t
+crc32_fold(uint32_t crc, const uint8_t *p, int size)
+{
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_loadu_si128((const __m128i *)crc32_k1k2);
+	p += 64;
+	size -= 64;
+
+	/* Fold 64 bytes at a time into the four lanes */
+	for (; size >= 64; p += 64, size -= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+				   _mm_loadu_si128((const __m128i *)(p + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+				   _mm_loadu_si128((const __m128i *)(p + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+				   _mm_loadu_si128((const __m128i *)(p + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+				   _mm_loadu_si128((const __m128i *)(p + 0x30)));
+	}
+
+	/* Fold the lanes into one, then any 16-byte blocks left */
+	x0 = _mm_loadu_si128((const __m128i *)crc32_k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+	for (; size >= 16; p += 16, size -= 16) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(
+			_mm_xor_si128(x1,
+				      _mm_loadu_si128((const __m128i *)p)),
+			x5);
+	}
+
+	/* Fold 128 bits to 64 */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x0 = _mm_loadl_epi64((const __m128i *)crc32_k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_loadu_si128((const __m128i *)crc32_poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+
+static bool crc32_fold_supported(void)
+{
+	return __builtin_cpu_supports("pclmul");
+}
+
+#elif defined(__aarch64__) && defined(__AARCH64EL__) && defined(__linux__)
+#define CRC32_HAVE_FOLD
+#include <arm_neon.h>
+#include <sys/auxv.h>
+
+#ifdef __clang__
+#define CRC32_TARGET_PMULL __attribute__((target("aes")))
+#else
+#define CRC32_TARGET_PMULL __attribute__((target("+crypto")))
+#endif
+
+/*
+ * Multiply the low or high 64 bits of 'a' by those of 'b', as selected by
+ * 'ha' and 'hb'.  Equivalent to _mm_clmulepi64_si128().
+ */
+#define CRC32_CLMUL(a, b, ha, hb)                                   \
+	vreinterpretq_u64_p128(vmull_p64(                           \
+		(poly64_t)vgetq_lane_u64(a, ha),                    \
+		(poly64_t)vgetq_lane_u64(b, hb)))
+
+/* Shift right by 'n' bytes, like _mm_srli_si128() */
+#define CRC32_SHR(a, n)                                                \
+	vreinterpretq_u64_u8(vextq_u8(vreinterpretq_u8_u64(a), vdupq_n_u8(0), \
+				      n))
+
+/* Load 16 bytes of data as a 128-bit lane */
+#define CRC32_LOAD(p) vreinterpretq_u64_u8(vld1q_u8(p))
+
+CRC32_TARGET_PMULL static uint32_t crc32_fold(uint32_t crc, const uint8_t *p,
+					      int size)
+{
+	uint64x2_t x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = CRC32_LOAD(p + 0x00);
+	x2 = CRC32_LOAD(p + 0x10);
+	x3 = CRC32_LOAD(p + 0x20);
+	x4 = CRC32_LOAD(p + 0x30);
+	x1 = veorq_u64(x1, vsetq_lane_u64(crc, vdupq_n_u64(0), 0));
+	x0 = vld1q_u64(crc32_k1k2);
+	p += 64;
+	size -= 64;
+
+	/* Fold 64 bytes at a time into the four lanes */
+	for (; size >= 64; p += 64, size -= 64) {
+		x5 = CRC32_CLMUL(x1, x0, 0, 0);
+		x6 = CRC32_CLMUL(x2, x0, 0, 0);
+		x7 = CRC32_CLMUL(x3, x0, 0, 0);
+		x8 = CRC32_CLMUL(x4, x0, 0, 0);
+		x1 = CRC32_CLMUL(x1, x0, 1, 1);
+		x2 = CRC32_CLMUL(x2, x0, 1, 1);
+		x3 = CRC32_CLMUL(x3, x0, 1, 1);
+		x4 = CRC32_CLMUL(x4, x0, 1, 1);
+		x1 = veorq_u64(veorq_u64(x1, x5), CRC32_LOAD(p + 0x00));
+		x2 = veorq_u64(veorq_u64(x2, x6), CRC32_LOAD(p + 0x10));
+		x3 = veorq_u64(veorq_u64(x3, x7), CRC32_LOAD(p + 0x20));
+		x4 = veorq_u64(veorq_u64(x4, x8), CRC32_LOAD(p + 0x30));
+	}
+
+	/* Fold the lanes into one, then any 16-byte blocks left */
+	x0 = vld1q_u64(crc32_k3k4);
+	x5 = CRC32_CLMUL(x1, x0, 0, 0);
+	x1 = CRC32_CLMUL(x1, x0, 1, 1);
+	x1 = veorq_u64(veorq_u64(x1, x2), x5);
+	x5 = CRC32_CLMUL(x1, x0, 0, 0);
+	x1 = CRC32_CLMUL(x1, x0, 1, 1);
+	x1 = veorq_u64(veorq_u64(x1, x3), x5);
+	x5 = CRC32_CLMUL(x1, x0, 0, 0);
+	x1 = CRC32_CLMUL(x1, x0, 1, 1);
+	x1 = veorq_u64(veorq_u64(x1, x4), x5);
+	for (; size >= 16; p += 16, size -= 16) {
+		x5 = CRC32_CLMUL(x1, x0, 0, 0);
+		x1 = CRC32_CLMUL(x1, x0, 1, 1);
+		x1 = veorq_u64(veorq_u64(x1, CRC32_LOAD(p)), x5);
+	}
+
+	/* Fold 128 bits to 64 */
+	x2 = CRC32_CLMUL(x1, x0, 0, 1);
+	x3 = vdupq_n_u64(0xffffffff);
+	x1 = veorq_u64(CRC32_SHR(x1, 8), x2);
+	x0 = vld1q_u64(crc32_k5k0);
+	x2 = CRC32_SHR(x1, 4);
+	x1 = vandq_u64(x1, x3);
+	x1 = CRC32_CLMUL(x1, x0, 0, 0);
+	x1 = veorq_u64(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = vld1q_u64(crc32_poly);
+	x2 = vandq_u64(x1, x3);
+	x2 = CRC32_CLMUL(x2, x0, 0, 1);
+	x2 = vandq_u64(x2, x3);
+	x2 = CRC32_CLMUL(x2, x0, 0, 0);
+	x1 = veorq_u64(x1, x2);
+
+	return vgetq_lane_u32(vreinterpretq_u32_u64(x1), 1);
+}
+
+static bool crc32_fold_supported(void)
+{
+	return getauxval(AT_HWCAP) & HWCAP_PMULL;
+}
+#endif
+
+/*
+ * Build the slicing tables and pick the fastest kernel, checking it gives
+ * the same answers as the byte-at-a-time loop.
+ */
+static uint32_t (*crc32_fold_kernel)(uint32_t crc, const uint8_t *p,
+				     int size);
+
+static bool crc32_setup(void)
+{
+	int i, k;
+
+	for (i = 0; i < 256; i++)
+		crc32_tables[0][i] = crc32_tab[i];
+	for (k = 1; k < 8; k++) {
+		for (i = 0; i < 256; i++)
+			crc32_tables[k][i] =
+				(crc32_tables[k - 1][i] >> 8) ^
+				crc32_tab[crc32_tables[k - 1][i] & 0xff];
+	}
+
+#ifdef CRC32_HAVE_FOLD
+	if (crc32_fold_supported()) {
+		uint8_t check[3 * CRC32_FOLD_MIN];
+		int n;
+
+		for (i = 0; i < (int)sizeof(check); i++)
+			check[i] = i * 0x9d + 0x31;
+		crc32_fold_kernel = crc32_fold;
+		for (n = CRC32_FOLD_MIN; n <= (int)sizeof(check); n += 16) {
+			if (crc32_fold(0xFFFFFFFF, check, n) !=
+			    crc32_hash_bytes(0xFFFFFFFF, check, n))
+				crc32_fold_kernel = NULL;
+		}
+	}
+#endif
+	return true;
+}
+
+static uint32_t _crc32_hash(uint32_t crc, const void *buf, int size)
+{
+	const uint8_t *p;
+
+	static const bool ready = crc32_setup();
+	int n;
+
+	(void)ready;
+	p = (const uint8_t *)buf;
+
+	if (crc32_fold_kernel && size >= CRC32_FOLD_MIN) {
+		n = size & ~15;
+		crc = crc32_fold_kernel(crc, p, n);
+		p += n;
+		size -= n;
+	}
+
+	return crc32_hash_slice8(crc, p, size);
+}
+
 void crc32_ctx_init(uint32_t *crc)
 {
 	*crc = CRC32_INITIAL;
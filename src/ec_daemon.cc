@@ -0,0 +1,443 @@
+/* Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+/*
+ * ectool daemon.
+ *
+ * A single process opens the EC transport (and holds the GEC lock, if the
+ * transport needs it) and serves requests from local clients over a Unix
+ * domain socket, so pollers no longer contend for the lock or re-probe the
+ * transport on every invocation.
+ *
+ * The daemon is single threaded: it polls the listening socket and all
+ * clients, collects complete request frames, then serves one round.  In a
+ * round every client with a pending request gets exactly one request sent
+ * to the EC, starting from a different client each round, so a busy client
+ * cannot starve the others.  Requests known to have no side effects which
+ * are identical (same operation, command, version, size and data) are sent
+ * to the EC once per round and the response is copied to every client that
+ * asked for it.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "comm-daemon.h"
+#include "comm-host.h"
+#include "ec_commands.h"
+#include "misc_util.h"
+
+#define DAEMON_MAX_CLIENTS 32
+
+struct daemon_client {
+	int fd;
+	struct ec_daemon_request req;
+	/* Request data, ec_max_outsize bytes */
+	uint8_t *data;
+	/* Bytes of header and data received so far */
+	int received;
+	/* A complete request is waiting to be served */
+	bool ready;
+	/* Response the socket could not take at once, and how much is left */
+	uint8_t *out;
+	int out_pos;
+	int out_len;
+};
+
+static struct daemon_client clients[DAEMON_MAX_CLIENTS];
+static uint8_t *response_buf;
+static int response_max;
+static volatile sig_atomic_t daemon_stop;
+
+/* Commands which only read EC state, and so may be coalesced */
+static const uint16_t daemon_read_only_commands[] = {
+	EC_CMD_HELLO,
+	EC_CMD_GET_VERSION,
+	EC_CMD_GET_BUILD_INFO,
+	EC_CMD_GET_CHIP_INFO,
+	EC_CMD_GET_BOARD_VERSION,
+	EC_CMD_READ_MEMMAP,
+	EC_CMD_GET_CMD_VERSIONS,
+	EC_CMD_GET_PROTOCOL_INFO,
+	EC_CMD_GET_FEATURES,
+	EC_CMD_GET_UPTIME_INFO,
+	EC_CMD_FLASH_INFO,
+	EC_CMD_FLASH_READ,
+	EC_CMD_PWM_GET_FAN_TARGET_RPM,
+	EC_CMD_PWM_GET_KEYBOARD_BACKLIGHT,
+	EC_CMD_TEMP_SENSOR_GET_INFO,
+	EC_CMD_THERMAL_GET_THRESHOLD,
+	EC_CMD_POWER_INFO,
+	EC_CMD_BATTERY_GET_STATIC,
+	EC_CMD_BATTERY_GET_DYNAMIC,
+	EC_CMD_USB_PD_PORTS,
+	EC_CMD_USB_PD_POWER_INFO,
+	EC_CMD_GET_PD_PORT_CAPS,
+};
+
+static bool daemon_is_read_only(const struct ec_daemon_request *req)
+{
+	int i;
+
+	if (req->op == EC_DAEMON_OP_READMEM)
+		return true;
+	if (req->op != EC_DAEMON_OP_COMMAND)
+		return false;
+
+	for (i = 0; i < ARRAY_SIZE(daemon_read_only_commands); i++) {
+		if (req->command == daemon_read_only_commands[i])
+			return true;
+	}
+	return false;
+}
+
+static bool daemon_same_request(const struct daemon_client *a,
+				const struct daemon_client *b)
+{
+	return a->req.op == b->req.op && a->req.command == b->req.command &&
+	       a->req.command_version == b->req.command_version &&
+	       a->req.insize == b->req.insize &&
+	       a->req.data_len == b->req.data_len &&
+	       !memcmp(a->data, b->data, a->req.data_len);
+}
+
+static void daemon_close_client(struct daemon_client *c)
+{
+	close(c->fd);
+	free(c->data);
+	free(c->out);
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+}
+
+static void daemon_accept(int listen_fd)
+{
+	struct daemon_client *c = NULL;
+	int fd, i;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	for (i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+		if (clients[i].fd < 0) {
+			c = &clients[i];
+			break;
+		}
+	}
+	if (!c) {
+		fprintf(stderr, "Too many clients, dropping connection\n");
+		close(fd);
+		return;
+	}
+
+	c->data = (uint8_t *)malloc(ec_max_outsize);
+	c->out = (uint8_t *)malloc(sizeof(struct ec_daemon_response) +
+				   response_max);
+	if (!c->data || !c->out) {
+		free(c->data);
+		free(c->out);
+		c->data = c->out = NULL;
+		close(fd);
+		return;
+	}
+	c->fd = fd;
+	c->received = 0;
+	c->ready = false;
+}
+
+/* Receive more of a client's request.  Returns non-zero to drop it. */
+static int daemon_receive(struct daemon_client *c)
+{
+	const int hdr = sizeof(c->req);
+	uint8_t *dest;
+	int want, n;
+
+	if (c->received < hdr) {
+		dest = (uint8_t *)&c->req + c->received;
+		want = hdr - c->received;
+	} else {
+		dest = c->data + (c->received - hdr);
+		want = hdr + c->req.data_len - c->received;
+	}
+
+	n = recv(c->fd, dest, want, 0);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return 0;
+	if (n <= 0)
+		return 1;
+
+	c->received += n;
+	if (c->received < hdr)
+		return 0;
+
+	if (c->received == hdr &&
+	    (c->req.struct_version != EC_DAEMON_VERSION ||
+	     c->req.data_len > ec_max_outsize)) {
+		fprintf(stderr, "Bad request from client, dropping it\n");
+		return 1;
+	}
+
+	if (c->received == hdr + c->req.data_len)
+		c->ready = true;
+	return 0;
+}
+
+/* Execute a request; fills response_buf and returns its total length */
+static int daemon_execute(const struct daemon_client *c)
+{
+	struct ec_daemon_response *resp =
+		(struct ec_daemon_response *)response_buf;
+	uint8_t *data = response_buf + sizeof(*resp);
+	struct ec_daemon_info *info;
+	int insize = MIN((int)c->req.insize, response_max);
+	int len = 0;
+	int rv;
+
+	switch (c->req.op) {
+	case EC_DAEMON_OP_COMMAND:
+		insize = MIN(insize, ec_max_insize);
+		rv = ec_command(c->req.command, c->req.command_version,
+				c->data, c->req.data_len, data, insize);
+		if (rv > 0)
+			len = MIN(rv, insize);
+		break;
+	case EC_DAEMON_OP_READMEM:
+		if (!ec_readmem || c->req.insize > EC_MEMMAP_SIZE) {
+			rv = -EC_RES_INVALID_PARAM;
+			break;
+		}
+		if (c->req.command_version) {
+			/* String, including the terminating '\0' */
+			rv = ec_readmem(c->req.command, 0, data);
+			if (rv >= 0)
+				len = MIN(rv + 1, EC_MEMMAP_TEXT_MAX);
+		} else {
+			rv = ec_readmem(c->req.command, c->req.insize, data);
+			if (rv > 0)
+				len = MIN(rv, (int)c->req.insize);
+		}
+		break;
+	case EC_DAEMON_OP_INFO:
+		info = (struct ec_daemon_info *)data;
+		memset(info, 0, sizeof(*info));
+		info->max_outsize = ec_max_outsize;
+		info->max_insize = ec_max_insize;
+		strncpy(info->transport,
+			ec_transport_name ? ec_transport_name : "",
+			sizeof(info->transport));
+		rv = len = sizeof(*info);
+		break;
+	default:
+		rv = -EC_RES_INVALID_COMMAND - EECRESULT;
+		break;
+	}
+
+	resp->struct_version = EC_DAEMON_VERSION;
+	resp->reserved = 0;
+	resp->data_len = len;
+	resp->result = rv;
+	return sizeof(*resp) + len;
+}
+
+/*
+ * Send what is left of a buffered response.  Returns non-zero to drop the
+ * client.
+ */
+static int daemon_flush(struct daemon_client *c)
+{
+	int n;
+
+	n = send(c->fd, c->out + c->out_pos, c->out_len - c->out_pos,
+		 MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (n < 0)
+		return errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+	c->out_pos += n;
+	if (c->out_pos == c->out_len)
+		c->out_pos = c->out_len = 0;
+	return 0;
+}
+
+/*
+ * Send a response.  Never block on a client which is not reading its
+ * responses: whatever the socket can't take now is kept, and sent as it
+ * becomes writable.  The client's next request isn't read until then.
+ */
+static void daemon_reply(struct daemon_client *c, int len)
+{
+	memcpy(c->out, response_buf, len);
+	c->out_pos = 0;
+	c->out_len = len;
+	c->received = 0;
+	c->ready = false;
+	if (daemon_flush(c))
+		daemon_close_client(c);
+}
+
+static void daemon_serve_round(int first)
+{
+	struct daemon_client *c, *other;
+	int i, j, len;
+
+	for (i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+		c = &clients[(first + i) % DAEMON_MAX_CLIENTS];
+		if (c->fd < 0 || !c->ready)
+			continue;
+
+		len = daemon_execute(c);
+
+		/* Answer identical read-only requests later in this round */
+		if (daemon_is_read_only(&c->req)) {
+			for (j = i + 1; j < DAEMON_MAX_CLIENTS; j++) {
+				other = &clients[(first + j) %
+						 DAEMON_MAX_CLIENTS];
+				if (other->fd >= 0 && other->ready &&
+				    daemon_same_request(c, other))
+					daemon_reply(other, len);
+			}
+		}
+
+		daemon_reply(c, len);
+	}
+}
+
+static void daemon_signal(int sig)
+{
+	daemon_stop = 1;
+}
+
+static int daemon_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* Remove a stale socket, but not one a live daemon is serving */
+	if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		fprintf(stderr, "A daemon is already serving %s\n", path);
+		close(fd);
+		return -1;
+	}
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    chmod(path, 0660) < 0 || listen(fd, DAEMON_MAX_CLIENTS) < 0) {
+		fprintf(stderr, "Unable to listen on %s: %s\n", path,
+			strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int ec_daemon_run(const char *path)
+{
+	struct pollfd fds[DAEMON_MAX_CLIENTS + 1];
+	struct sigaction sa;
+	int listen_fd;
+	int first = 0;
+	bool pending;
+	int i, n, rv;
+
+	if (!path)
+		path = EC_DAEMON_SOCKET;
+
+	response_max = MAX(ec_max_insize, EC_MEMMAP_SIZE);
+	response_buf = (uint8_t *)malloc(sizeof(struct ec_daemon_response) +
+					 response_max);
+	if (!response_buf) {
+		fprintf(stderr, "Unable to allocate buffers\n");
+		return 1;
+	}
+
+	for (i = 0; i < DAEMON_MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	listen_fd = daemon_listen(path);
+	if (listen_fd < 0)
+		return 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = daemon_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	fprintf(stderr, "Serving EC (transport %s) on %s\n",
+		ec_transport_name ? ec_transport_name : "unknown", path);
+
+	while (!daemon_stop) {
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+		pending = false;
+		for (i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+			/*
+			 * Don't read ahead of a request not yet served, or
+			 * of a response not yet sent.
+			 */
+			fds[i + 1].fd = clients[i].ready ? -1 : clients[i].fd;
+			fds[i + 1].events = clients[i].out_len ? POLLOUT :
+								 POLLIN;
+			fds[i + 1].revents = 0;
+			pending |= clients[i].ready;
+		}
+
+		n = poll(fds, DAEMON_MAX_CLIENTS + 1, pending ? 0 : -1);
+		if (n < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+
+		if (n > 0) {
+			for (i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+				if (!fds[i + 1].revents)
+					continue;
+				if (clients[i].out_len)
+					rv = daemon_flush(&clients[i]);
+				else
+					rv = daemon_receive(&clients[i]);
+				if (rv)
+					daemon_close_client(&clients[i]);
+			}
+			if (fds[0].revents & POLLIN)
+				daemon_accept(listen_fd);
+		}
+
+		daemon_serve_round(first);
+		first = (first + 1) % DAEMON_MAX_CLIENTS;
+	}
+
+	for (i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0)
+			daemon_close_client(&clients[i]);
+	}
+	close(listen_fd);
+	unlink(path);
+	free(response_buf);
+
+	return 0;
+}
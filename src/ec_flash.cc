@@ -13,61 +13,338 @@
 #include <thread>
 
 #include "comm-host.h"
+#include "crc.h"
+#include "ec_flash.h"
 #include "misc_util.h"
+#include "sha256.h"
 #include "timer.h"
 
 static const auto ERASE_ASYNC_TIMEOUT = std::chrono::seconds(10);
-static const auto ERASE_ASYNC_WAIT_MS = std::chrono::milliseconds(500);
 static const int FLASH_ERASE_BUSY_RV = -EECRESULT - EC_RES_BUSY;
 
-int ec_flash_read(uint8_t *buf, int offset, int size)
+/* Commands per ec_command_batch(), on transports which pipeline them */
+#define FLASH_BATCH_SIZE 16
+
+static struct progress *flash_progress;
+/* Where in the caller's range the current read or write starts */
+static int flash_progress_base;
+
+void ec_flash_set_progress(struct progress *p)
+{
+	flash_progress = p;
+}
+
+static void flash_progress_update(int done)
+{
+	if (flash_progress)
+		progress_update(flash_progress, flash_progress_base + done);
+}
+
+/*
+ * Learned per-chip settings, kept across runs in FLASH_STATE_FILE as
+ * "<chip> <key> <value>" lines.  The chip is identified by the vendor and
+ * name from EC_CMD_GET_CHIP_INFO; if the EC does not report them nothing
+ * is remembered.
+ */
+#define FLASH_STATE_FILE "/run/ectool-flash.state"
+#define FLASH_STATE_MAX 16
+
+static struct {
+	char key[32];
+	int value;
+} flash_state[FLASH_STATE_MAX];
+static int flash_state_count;
+static char flash_state_chip[66];
+static bool flash_state_loaded;
+
+static void flash_state_load(void)
 {
-	struct ec_params_flash_read p;
+	struct ec_response_get_chip_info info;
+	char line[160], chip[sizeof(flash_state_chip)];
+	char key[sizeof(flash_state[0].key)];
+	char *c;
+	FILE *f;
+	int value;
+
+	if (flash_state_loaded)
+		return;
+	flash_state_loaded = true;
+
+	memset(&info, 0, sizeof(info));
+	if (ec_command(EC_CMD_GET_CHIP_INFO, 0, NULL, 0, &info,
+		       sizeof(info)) < 0 ||
+	    !info.vendor[0])
+		return;
+	snprintf(flash_state_chip, sizeof(flash_state_chip), "%.32s/%.32s",
+		 info.vendor, info.name);
+	for (c = flash_state_chip; *c; c++) {
+		if (*c == ' ' || *c < 0x20 || *c > 0x7e)
+			*c = '_';
+	}
+
+	f = fopen(FLASH_STATE_FILE, "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f) &&
+	       flash_state_count < FLASH_STATE_MAX) {
+		if (sscanf(line, "%65s %31s %d", chip, key, &value) != 3 ||
+		    strcmp(chip, flash_state_chip))
+			continue;
+		strcpy(flash_state[flash_state_count].key, key);
+		flash_state[flash_state_count++].value = value;
+	}
+	fclose(f);
+}
+
+static int flash_state_get(const char *key, int def)
+{
+	int i;
+
+	flash_state_load();
+	for (i = 0; i < flash_state_count; i++) {
+		if (!strcmp(flash_state[i].key, key))
+			return flash_state[i].value;
+	}
+	return def;
+}
+
+static void flash_state_set(const char *key, int value)
+{
+	char lines[FLASH_STATE_MAX * 128];
+	int i, n;
+
+	flash_state_load();
+	if (!flash_state_chip[0])
+		return;
+	for (i = 0; i < flash_state_count; i++) {
+		if (!strcmp(flash_state[i].key, key))
+			break;
+	}
+	if (i == FLASH_STATE_MAX)
+		return;
+	if (i == flash_state_count) {
+		snprintf(flash_state[i].key, sizeof(flash_state[i].key), "%s",
+			 key);
+		flash_state_count++;
+	}
+	flash_state[i].value = value;
+
+	for (i = n = 0; i < flash_state_count; i++)
+		n += snprintf(lines + n, sizeof(lines) - n, "%s %s %d\n",
+			      flash_state_chip, flash_state[i].key,
+			      flash_state[i].value);
+	/* Not fatal if it fails; it will just be learned again */
+	state_file_update(FLASH_STATE_FILE, flash_state_chip, lines);
+}
+
+/* Setting names for the chunk sizes which work best on this transport */
+static void flash_chunk_key(char *key, int key_size, const char *op)
+{
+	snprintf(key, key_size, "%s_chunk.%s", op,
+		 ec_transport_name ? ec_transport_name : "none");
+}
+
+/* Bytes per EC_CMD_FLASH_READ: the saved setting, else the most possible */
+static int flash_read_chunk(void)
+{
+	char key[32];
+	int chunk;
+
+	flash_chunk_key(key, sizeof(key), "read");
+	chunk = flash_state_get(key, 0);
+	if (chunk <= 0 || chunk > ec_max_insize)
+		chunk = ec_max_insize;
+	return chunk;
+}
+
+static int ec_flash_read_batched(uint8_t *buf, int offset, int size,
+				 int chunk)
+{
+	struct ec_command_batch_entry cmds[FLASH_BATCH_SIZE];
+	struct ec_params_flash_read params[FLASH_BATCH_SIZE];
+	int i = 0;
+	int n, done;
+
+	while (i < size) {
+		/* Responses go straight to the caller's buffer */
+		for (n = 0; n < FLASH_BATCH_SIZE && i < size; n++) {
+			params[n].offset = offset + i;
+			params[n].size = MIN(size - i, chunk);
+			cmds[n].command = EC_CMD_FLASH_READ;
+			cmds[n].version = 0;
+			cmds[n].outdata = &params[n];
+			cmds[n].outsize = sizeof(params[n]);
+			cmds[n].indata = buf + i;
+			cmds[n].insize = params[n].size;
+			i += params[n].size;
+		}
+
+		done = ec_command_batch(cmds, n);
+		if (done < n) {
+			fprintf(stderr, "Read error at offset %d\n",
+				params[done].offset - offset);
+			return cmds[done].result;
+		}
+		flash_progress_update(i);
+	}
+
+	return 0;
+}
+
+static int ec_flash_read_chunk(uint8_t *buf, int offset, int size,
+			       int chunk)
+{
+	struct ec_params_flash_read *p;
+	uint8_t *data;
+	int n;
 	int rv;
 	int i;
 
+	if (ec_command_batch_proto)
+		return ec_flash_read_batched(buf, offset, size, chunk);
+
+	/* Params and response share the command buffer */
+	data = (uint8_t *)ec_command_buffer(MAX(chunk, (int)sizeof(*p)));
+	if (!data)
+		return -1;
+	p = (struct ec_params_flash_read *)data;
+
 	/* Read data in chunks */
-	for (i = 0; i < size; i += ec_max_insize) {
-		p.offset = offset + i;
-		p.size = MIN(size - i, ec_max_insize);
-		rv = ec_command(EC_CMD_FLASH_READ, 0, &p, sizeof(p), ec_inbuf,
-				p.size);
+	for (i = 0; i < size; i += chunk) {
+		n = MIN(size - i, chunk);
+		p->offset = offset + i;
+		p->size = n;
+		rv = ec_command(EC_CMD_FLASH_READ, 0, p, sizeof(*p), data, n);
 		if (rv < 0) {
 			fprintf(stderr, "Read error at offset %d\n", i);
 			return rv;
 		}
-		memcpy(buf + i, ec_inbuf, p.size);
+		memcpy(buf + i, data, n);
+		flash_progress_update(i + n);
 	}
 
 	return 0;
 }
 
+int ec_flash_read(uint8_t *buf, int offset, int size)
+{
+	return ec_flash_read_chunk(buf, offset, size, flash_read_chunk());
+}
+
+/* Wait for an EC_CMD_VBOOT_HASH result for up to this long */
+static const auto HASH_TIMEOUT = std::chrono::seconds(30);
+static const auto HASH_POLL_MS = std::chrono::milliseconds(5);
+
+/* Bytes compared per read when reading flash back */
+#define FLASH_VERIFY_BLOCK 0x1000
+
+/*
+ * Wait for the hash started over [offset, offset + size) and store its
+ * digest.  Returns 0 if success, negative if the EC could not provide it.
+ */
+static int ec_flash_hash_wait(int offset, int size, uint8_t *digest)
+{
+	struct ec_params_vboot_hash p;
+	struct ec_response_vboot_hash r;
+	auto deadline = std::chrono::steady_clock::now() + HASH_TIMEOUT;
+	int rv;
+
+	memset(&p, 0, sizeof(p));
+	p.cmd = EC_VBOOT_HASH_GET;
+
+	do {
+		rv = ec_command(EC_CMD_VBOOT_HASH, 0, &p, sizeof(p), &r,
+				sizeof(r));
+		if (rv < 0)
+			return rv;
+		if (r.status != EC_VBOOT_HASH_STATUS_BUSY)
+			break;
+		std::this_thread::sleep_for(HASH_POLL_MS);
+	} while (std::chrono::steady_clock::now() < deadline);
+
+	/* Someone else may have started another hash meanwhile */
+	if (r.status != EC_VBOOT_HASH_STATUS_DONE ||
+	    r.hash_type != EC_VBOOT_HASH_TYPE_SHA256 ||
+	    r.digest_size != SHA256_DIGEST_SIZE || r.offset != offset ||
+	    r.size != size)
+		return -1;
+
+	memcpy(digest, r.hash_digest, SHA256_DIGEST_SIZE);
+	return 0;
+}
+
+/*
+ * Have the EC hash the range while we hash the image.  Returns 1 if the
+ * digests match, 0 if they differ, negative if the EC could not hash it.
+ */
+static int ec_flash_verify_hash(const uint8_t *buf, int offset, int size)
+{
+	struct ec_params_vboot_hash p;
+	struct ec_response_vboot_hash r;
+	struct sha256_ctx ctx;
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	int rv;
+
+	if (!ec_cmd_version_supported(EC_CMD_VBOOT_HASH, 0))
+		return -1;
+
+	memset(&p, 0, sizeof(p));
+	p.cmd = EC_VBOOT_HASH_START;
+	p.hash_type = EC_VBOOT_HASH_TYPE_SHA256;
+	p.offset = offset;
+	p.size = size;
+	rv = ec_command(EC_CMD_VBOOT_HASH, 0, &p, sizeof(p), &r, sizeof(r));
+	if (rv < 0)
+		return rv;
+
+	SHA256_init(&ctx);
+	SHA256_update(&ctx, buf, size);
+	SHA256_final(&ctx);
+
+	rv = ec_flash_hash_wait(offset, size, digest);
+	if (rv < 0)
+		return rv;
+
+	return !memcmp(digest, ctx.buf, SHA256_DIGEST_SIZE);
+}
+
 int ec_flash_verify(const uint8_t *buf, int offset, int size)
 {
-	uint8_t *rbuf = (uint8_t *)(malloc(size));
+	uint8_t *rbuf;
 	int rv;
-	int i;
+	int i, n, j;
+
+	rv = ec_flash_verify_hash(buf, offset, size);
+	if (rv == 1)
+		return 0;
+	if (rv == 0)
+		fprintf(stderr, "EC hash differs, reading flash back...\n");
 
+	/* Read back a block at a time, stopping at the first difference */
+	rbuf = (uint8_t *)(malloc(FLASH_VERIFY_BLOCK));
 	if (!rbuf) {
 		fprintf(stderr, "Unable to allocate buffer.\n");
 		return -1;
 	}
 
-	rv = ec_flash_read(rbuf, offset, size);
-	if (rv < 0) {
-		free(rbuf);
-		return rv;
-	}
-
-	for (i = 0; i < size; i++) {
-		if (buf[i] != rbuf[i]) {
-			fprintf(stderr,
-				"Mismatch at offset 0x%x: "
-				"want 0x%02x, got 0x%02x\n",
-				i, buf[i], rbuf[i]);
+	for (i = 0; i < size; i += n) {
+		n = MIN(size - i, FLASH_VERIFY_BLOCK);
+		rv = ec_flash_read(rbuf, offset + i, n);
+		if (rv < 0) {
 			free(rbuf);
-			return -1;
+			return rv;
 		}
+		if (!memcmp(buf + i, rbuf, n))
+			continue;
+
+		for (j = 0; buf[i + j] == rbuf[j]; j++)
+			;
+		fprintf(stderr,
+			"Mismatch in block 0x%x-0x%x, first at offset 0x%x: "
+			"want 0x%02x, got 0x%02x\n",
+			i, i + n - 1, i + j, buf[i + j], rbuf[j]);
+		free(rbuf);
+		return -1;
 	}
 
 	free(rbuf);
@@ -139,15 +416,68 @@ static int get_flash_write_size(void)
 	return write_size;
 }
 
-int ec_flash_write(const uint8_t *buf, int offset, int size)
+/*
+ * EC_CMD_FLASH_WRITE version to send.  Writes always use version 0, as
+ * ectool has always done; only ec_flash_bench() tries others.
+ */
+static int flash_write_version;
+
+static int ec_flash_write_batched(const uint8_t *buf, int offset, int size,
+				  int step)
 {
-	struct ec_params_flash_write *p =
-		(struct ec_params_flash_write *)ec_outbuf;
-	int write_size;
+	struct ec_command_batch_entry cmds[FLASH_BATCH_SIZE];
+	struct ec_params_flash_write *p;
+	int stride = sizeof(*p) + step;
+	uint8_t *bufs;
+	int i = 0;
+	int n, done;
+	int rv = 0;
+
+	/* Each command in flight needs its own request buffer */
+	bufs = (uint8_t *)malloc(FLASH_BATCH_SIZE * stride);
+	if (!bufs)
+		return -1;
+
+	while (i < size) {
+		for (n = 0; n < FLASH_BATCH_SIZE && i < size; n++) {
+			p = (struct ec_params_flash_write *)(bufs + n * stride);
+			p->offset = offset + i;
+			p->size = MIN(size - i, step);
+			memcpy(p + 1, buf + i, p->size);
+			cmds[n].command = EC_CMD_FLASH_WRITE;
+			cmds[n].version = flash_write_version;
+			cmds[n].outdata = p;
+			cmds[n].outsize = sizeof(*p) + p->size;
+			cmds[n].indata = NULL;
+			cmds[n].insize = 0;
+			i += p->size;
+		}
+
+		done = ec_command_batch(cmds, n);
+		if (done < n) {
+			p = (struct ec_params_flash_write *)(bufs +
+							     done * stride);
+			fprintf(stderr, "Write error at offset %d\n",
+				p->offset - offset);
+			rv = cmds[done].result;
+			break;
+		}
+		flash_progress_update(i);
+	}
+
+	free(bufs);
+	return rv;
+}
+
+/**
+ * @param write_size	Set to the size writes must be a multiple of
+ * @return Most bytes per EC_CMD_FLASH_WRITE on success, negative on failure
+ */
+static int get_flash_write_step_max(int *write_size)
+{
+	struct ec_params_flash_write *p;
 	int pdata_max_size = (int)(ec_max_outsize - sizeof(*p));
 	int step;
-	int rv;
-	int i;
 
 	/*
 	 * Determine whether we can use version 1 of the EC_CMD_FLASH_WRITE
@@ -156,43 +486,514 @@ int ec_flash_write(const uint8_t *buf, int offset, int size)
 	if (!ec_cmd_version_supported(EC_CMD_FLASH_WRITE, EC_VER_FLASH_WRITE))
 		pdata_max_size = EC_FLASH_WRITE_VER0_SIZE;
 
-	write_size = get_flash_write_size();
-	if (write_size < 0)
-		return write_size;
+	*write_size = get_flash_write_size();
+	if (*write_size < 0)
+		return *write_size;
 
 	/*
 	 * shouldn't ever happen, but report an error rather than a division
 	 * by zero in the next statement.
 	 */
-	if (write_size == 0)
+	if (*write_size == 0)
 		return -1;
 
-	step = (pdata_max_size / write_size) * write_size;
+	step = (pdata_max_size / *write_size) * *write_size;
 
 	if (!step) {
 		fprintf(stderr, "Write block size %d > max param size %d\n",
-			write_size, pdata_max_size);
+			*write_size, pdata_max_size);
 		return -1;
 	}
+	return step;
+}
+
+/**
+ * @return Bytes per EC_CMD_FLASH_WRITE on success, negative on failure
+ */
+static int get_flash_write_step(void)
+{
+	char key[32];
+	int write_size, saved;
+	int step = get_flash_write_step_max(&write_size);
+
+	if (step < 0)
+		return step;
+
+	/* Use a smaller step if flashbench found one works better */
+	flash_chunk_key(key, sizeof(key), "write");
+	saved = flash_state_get(key, 0);
+	if (saved > 0 && saved < step && !(saved % write_size))
+		step = saved;
 
-	/* Write data in chunks */
 	printf("Write size %d...\n", step);
+	return step;
+}
+
+static int ec_flash_write_step(const uint8_t *buf, int offset, int size,
+			       int step)
+{
+	struct ec_params_flash_write *p;
+	int rv;
+	int i;
+
+	if (ec_command_batch_proto)
+		return ec_flash_write_batched(buf, offset, size, step);
+
+	/* Build each chunk in place in the command buffer */
+	p = (struct ec_params_flash_write *)ec_command_buffer(ec_max_outsize);
+	if (!p)
+		return -1;
 
 	for (i = 0; i < size; i += step) {
 		p->offset = offset + i;
 		p->size = MIN(size - i, step);
 		memcpy(p + 1, buf + i, p->size);
-		rv = ec_command(EC_CMD_FLASH_WRITE, 0, p, sizeof(*p) + p->size,
-				NULL, 0);
+		rv = ec_command(EC_CMD_FLASH_WRITE, flash_write_version, p,
+				sizeof(*p) + p->size, NULL, 0);
 		if (rv < 0) {
 			fprintf(stderr, "Write error at offset %d\n", i);
 			return rv;
 		}
+		flash_progress_update(i + p->size);
+	}
+
+	return 0;
+}
+
+/*
+ * Journal of the blocks a write has completed, so an interrupted write can
+ * be resumed.  There is one per transport and device.  The first line
+ * identifies the write by the SHA-256 of the image, the offset and the
+ * size.  Each following line is the offset of a completed JOURNAL_BLOCK in
+ * the image and the CRC-32 of its data.
+ */
+#define FLASH_JOURNAL_DIR "/var/tmp"
+#define JOURNAL_BLOCK 0x1000
+/* Blocks written between journal updates */
+#define JOURNAL_FLUSH_BLOCKS 16
+
+static void journal_path(char *path, int path_size)
+{
+	char *c;
+
+	snprintf(path, path_size,
+		 FLASH_JOURNAL_DIR "/ectool-flash.%s.%s.journal",
+		 ec_transport_name ? ec_transport_name : "none", ec_device_id);
+	for (c = path + sizeof(FLASH_JOURNAL_DIR); *c; c++) {
+		if (*c == '/' || *c == ' ' || *c < 0x20 || *c > 0x7e)
+			*c = '_';
+	}
+}
+
+static uint32_t journal_crc(const uint8_t *buf, int size)
+{
+	uint32_t crc;
+
+	crc32_ctx_init(&crc);
+	crc32_ctx_hash(&crc, buf, size);
+	return crc32_ctx_result(&crc);
+}
+
+/*
+ * Mark the blocks the journal for this write says are done.  Returns how
+ * many there are.
+ */
+static int journal_load(const char *path, const char *id, const uint8_t *buf,
+			int size, uint8_t *done)
+{
+	char line[160];
+	unsigned int block, crc;
+	int n = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	if (!fgets(line, sizeof(line), f) || strcmp(line, id)) {
+		fclose(f);
+		return 0;
+	}
+	while (fscanf(f, "%x %x", &block, &crc) == 2) {
+		/* Only trust lines which match the image */
+		if (block % JOURNAL_BLOCK || block >= (unsigned int)size ||
+		    done[block / JOURNAL_BLOCK] ||
+		    crc != journal_crc(buf + block,
+				       MIN(JOURNAL_BLOCK, size - block)))
+			continue;
+		done[block / JOURNAL_BLOCK] = 1;
+		n++;
+	}
+	fclose(f);
+	return n;
+}
+
+/*
+ * Check the blocks the journal says are done are still in flash, and
+ * forget any run of them which is not.
+ */
+static void journal_check(const uint8_t *buf, int offset, int size,
+			  uint8_t *done, int blocks)
+{
+	int i, n, len;
+
+	for (i = 0; i < blocks; i += n) {
+		for (n = 0; i + n < blocks && done[i + n] == done[i]; n++)
+			;
+		if (!done[i])
+			continue;
+		len = MIN(n * JOURNAL_BLOCK, size - i * JOURNAL_BLOCK);
+		if (ec_flash_verify(buf + i * JOURNAL_BLOCK,
+				    offset + i * JOURNAL_BLOCK, len) < 0)
+			memset(done + i, 0, n);
+	}
+}
+
+static void journal_add(FILE *f, const uint8_t *buf, int size, int from,
+			int to)
+{
+	int i;
+
+	if (!f)
+		return;
+	for (i = from; i < to; i += JOURNAL_BLOCK)
+		fprintf(f, "%x %08x\n", i,
+			journal_crc(buf + i, MIN(JOURNAL_BLOCK, size - i)));
+	fflush(f);
+}
+
+int ec_flash_write(const uint8_t *buf, int offset, int size, int flags)
+{
+	struct sha256_ctx ctx;
+	char id[160], path[128];
+	uint8_t *digest, *done;
+	int blocks = (size + JOURNAL_BLOCK - 1) / JOURNAL_BLOCK;
+	int start, end, i, n, len;
+	int rv = 0;
+	FILE *f = NULL;
+	int step = get_flash_write_step();
+
+	if (step < 0)
+		return step;
+
+	done = (uint8_t *)calloc(blocks, 1);
+	if (!done)
+		return -1;
+
+	if (!(flags & (EC_FLASH_WRITE_JOURNAL | EC_FLASH_WRITE_RESUME)))
+		goto write;
+
+	journal_path(path, sizeof(path));
+	SHA256_init(&ctx);
+	SHA256_update(&ctx, buf, size);
+	digest = SHA256_final(&ctx);
+	n = snprintf(id, sizeof(id), "ectool-flash-journal ");
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+		n += snprintf(id + n, sizeof(id) - n, "%02x", digest[i]);
+	snprintf(id + n, sizeof(id) - n, " %d %d\n", offset, size);
+
+	if ((flags & EC_FLASH_WRITE_RESUME) &&
+	    journal_load(path, id, buf, size, done)) {
+		journal_check(buf, offset, size, done, blocks);
+		for (i = n = 0; i < blocks; i++)
+			n += done[i];
+		printf("Resuming, %d of %d blocks already written\n", n,
+		       blocks);
+	}
+
+	/* Start the journal afresh with what is known to be done */
+	f = fopen(path, "w");
+	if (!f)
+		fprintf(stderr, "Unable to write %s, cannot resume later\n",
+			path);
+	if (f) {
+		fputs(id, f);
+		for (i = 0; i < blocks; i++) {
+			if (done[i])
+				journal_add(f, buf, size, i * JOURNAL_BLOCK,
+					    (i + 1) * JOURNAL_BLOCK);
+		}
+		fflush(f);
+	}
+
+write:
+	/* Write data in chunks, a few blocks between journal updates */
+	for (i = 0; i < blocks; i += n) {
+		if (done[i]) {
+			n = 1;
+			continue;
+		}
+		for (n = 0; i + n < blocks && !done[i + n] &&
+			    n < JOURNAL_FLUSH_BLOCKS;
+		     n++)
+			;
+		start = i * JOURNAL_BLOCK;
+		end = MIN((i + n) * JOURNAL_BLOCK, size);
+		len = end - start;
+		flash_progress_base = start;
+		rv = ec_flash_write_step(buf + start, offset + start, len,
+					 step);
+		if (rv < 0)
+			break;
+		journal_add(f, buf, size, start, end);
+	}
+	flash_progress_base = 0;
+
+	if (f) {
+		fclose(f);
+		/* Nothing to resume once it is all written */
+		if (rv >= 0)
+			remove(path);
+	}
+	free(done);
+	return rv;
+}
+
+/* Banks of same-sized erase blocks, as reported by EC_CMD_FLASH_INFO */
+#define FLASH_MAX_BANKS 16
+
+struct flash_geometry {
+	int flash_size;
+	/* Value of an erased byte */
+	uint8_t erased;
+	int num_banks;
+	struct {
+		int start;
+		int size;
+		int erase_size;
+	} banks[FLASH_MAX_BANKS];
+};
+
+static int get_flash_geometry(struct flash_geometry *g)
+{
+	struct ec_params_flash_info_2 p2;
+	struct ec_response_flash_info_2 *r2;
+	struct ec_response_flash_info_1 r1;
+	uint8_t buf[sizeof(*r2) + FLASH_MAX_BANKS * sizeof(r2->banks[0])];
+	int start = 0;
+	int rv, i;
+
+	memset(g, 0, sizeof(*g));
+
+	if (!ec_cmd_version_supported(EC_CMD_FLASH_INFO, 2)) {
+		/* Older ECs have a single erase block size */
+		memset(&r1, 0, sizeof(r1));
+		if (ec_cmd_version_supported(EC_CMD_FLASH_INFO, 1))
+			rv = ec_command(EC_CMD_FLASH_INFO, 1, NULL, 0, &r1,
+					sizeof(r1));
+		else
+			rv = get_flash_info_v0(
+				(struct ec_response_flash_info *)&r1);
+		if (rv < 0)
+			return rv;
+		if (!r1.erase_block_size)
+			return -1;
+		g->flash_size = r1.flash_size;
+		g->erased = (r1.flags & EC_FLASH_INFO_ERASE_TO_0) ? 0 : 0xff;
+		g->num_banks = 1;
+		g->banks[0].size = r1.flash_size;
+		g->banks[0].erase_size = r1.erase_block_size;
+		return 0;
+	}
+
+	p2.num_banks_desc = FLASH_MAX_BANKS;
+	r2 = (struct ec_response_flash_info_2 *)buf;
+	rv = ec_command(EC_CMD_FLASH_INFO, 2, &p2, sizeof(p2), buf,
+			sizeof(buf));
+	if (rv < 0)
+		return rv;
+	if (r2->num_banks_desc < r2->num_banks_total) {
+		fprintf(stderr, "Too many flash banks (%d)\n",
+			r2->num_banks_total);
+		return -1;
 	}
 
+	g->flash_size = r2->flash_size;
+	g->erased = (r2->flags & EC_FLASH_INFO_ERASE_TO_0) ? 0 : 0xff;
+	g->num_banks = r2->num_banks_desc;
+	for (i = 0; i < g->num_banks; i++) {
+		g->banks[i].start = start;
+		g->banks[i].size = r2->banks[i].count
+				   << r2->banks[i].size_exp;
+		g->banks[i].erase_size = 1 << r2->banks[i].erase_size_exp;
+		start += g->banks[i].size;
+	}
 	return 0;
 }
 
+/*
+ * Return the start of the erase block containing 'offset' and store its
+ * size, or return -1 if 'offset' is outside the flash.
+ */
+static int flash_erase_block(const struct flash_geometry *g, int offset,
+			     int *size)
+{
+	int i;
+
+	for (i = 0; i < g->num_banks; i++) {
+		if (offset < g->banks[i].start ||
+		    offset >= g->banks[i].start + g->banks[i].size)
+			continue;
+		*size = g->banks[i].erase_size;
+		return offset - (offset - g->banks[i].start) % *size;
+	}
+	return -1;
+}
+
+static int is_erased(const uint8_t *buf, int size, uint8_t erased)
+{
+	int i;
+
+	for (i = 0; i < size; i++) {
+		if (buf[i] != erased)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Find the first run of erase blocks at or after 'from' whose contents
+ * change, counting the blocks looked at.  Returns the end of the run and
+ * stores its start; they are equal if nothing else changes.
+ */
+static int find_changed_run(const struct flash_geometry *g,
+			    const uint8_t *cur, const uint8_t *want,
+			    int start, int end, int from, int *run_start,
+			    int *changed, int *blocks)
+{
+	int run_end, bsize;
+
+	*run_start = run_end = from;
+	while (run_end < end) {
+		flash_erase_block(g, run_end, &bsize);
+		if (!memcmp(cur + run_end - start, want + run_end - start,
+			    bsize)) {
+			if (*run_start != run_end)
+				break;
+			*run_start += bsize;
+		} else {
+			(*changed)++;
+		}
+		run_end += bsize;
+		(*blocks)++;
+	}
+	return run_end;
+}
+
+int ec_flash_write_diff(const uint8_t *buf, int offset, int size)
+{
+	struct flash_geometry g;
+	uint8_t *cur = NULL, *want = NULL;
+	int start, end, len, bsize;
+	int run_start, run_end, next_start, next_end, i, n;
+	int changed = 0, blocks = 0, written = 0;
+	int step = 0;
+	bool async;
+	int rv;
+
+	rv = get_flash_geometry(&g);
+	if (rv < 0) {
+		fprintf(stderr, "Unable to get flash geometry\n");
+		return rv;
+	}
+
+	/* Work on whole erase blocks */
+	start = flash_erase_block(&g, offset, &bsize);
+	end = flash_erase_block(&g, offset + size - 1, &bsize);
+	if (size <= 0 || start < 0 || end < 0) {
+		fprintf(stderr, "Range outside flash\n");
+		return -1;
+	}
+	end += bsize;
+	len = end - start;
+
+	cur = (uint8_t *)malloc(len);
+	want = (uint8_t *)malloc(len);
+	if (!cur || !want) {
+		fprintf(stderr, "Unable to allocate buffer.\n");
+		rv = -1;
+		goto out;
+	}
+
+	/*
+	 * What the blocks should hold afterwards: the image, plus whatever
+	 * they already hold around it.
+	 */
+	rv = ec_flash_read(cur, start, len);
+	if (rv < 0)
+		goto out;
+	memcpy(want, cur, len);
+	memcpy(want + offset - start, buf, size);
+
+	async = ec_cmd_version_supported(EC_CMD_FLASH_ERASE, 1);
+	run_end = find_changed_run(&g, cur, want, start, end, start,
+				   &run_start, &changed, &blocks);
+	while (run_start < run_end) {
+		/*
+		 * Look for the next run while this one is erased; it has to
+		 * be found before the erase is waited for.
+		 */
+		if (async) {
+			rv = ec_flash_erase_async_start(run_start,
+							run_end - run_start);
+			if (rv >= 0) {
+				next_end = find_changed_run(
+					&g, cur, want, start, end, run_end,
+					&next_start, &changed, &blocks);
+				rv = ec_flash_erase_async_wait();
+			}
+		} else {
+			rv = ec_flash_erase(run_start, run_end - run_start);
+			next_end = find_changed_run(&g, cur, want, start, end,
+						    run_end, &next_start,
+						    &changed, &blocks);
+		}
+		if (rv < 0) {
+			fprintf(stderr, "Erase error at offset %d\n",
+				run_start - offset);
+			goto out;
+		}
+
+		if (!step) {
+			step = get_flash_write_step();
+			if (step < 0) {
+				rv = step;
+				goto out;
+			}
+		}
+
+		/* Only program the parts which do not stay erased */
+		for (i = run_start; i < run_end; i += n) {
+			for (n = 0; i + n < run_end; n += step) {
+				if (is_erased(want + i + n - start,
+					      MIN(step, run_end - i - n),
+					      g.erased))
+					break;
+			}
+			if (n) {
+				rv = ec_flash_write_step(want + i - start, i,
+							 MIN(n, run_end - i),
+							 step);
+				if (rv < 0)
+					goto out;
+				written += MIN(n, run_end - i);
+			} else {
+				n = MIN(step, run_end - i);
+			}
+		}
+
+		run_start = next_start;
+		run_end = next_end;
+	}
+
+	printf("%d of %d erase blocks changed, %d bytes written\n", changed,
+	       blocks, written);
+	rv = 0;
+out:
+	free(cur);
+	free(want);
+	return rv;
+}
+
 int ec_flash_erase(int offset, int size)
 {
 	struct ec_params_flash_erase p;
@@ -203,24 +1004,139 @@ int ec_flash_erase(int offset, int size)
 	return ec_command(EC_CMD_FLASH_ERASE, 0, &p, sizeof(p), NULL, 0);
 }
 
-int ec_flash_erase_async(int offset, int size)
+/*
+ * Asynchronous erases.  How long an erase takes is predicted from its size
+ * and the chip's erase rate, learned from earlier erases.  The first check
+ * for completion is made shortly before the erase should be done, then the
+ * checks back off exponentially.  Erases predicted to take longer than
+ * ERASE_PIECE_US are issued as several smaller ones, so each can be timed
+ * and none runs into an EC-side watchdog.
+ */
+#define ERASE_DEFAULT_US_PER_KIB 5000 /* until the chip's rate is learned */
+#define ERASE_POLL_MIN_US 1000
+#define ERASE_POLL_MAX_US 100000
+#define ERASE_PIECE_US 2000000
+
+static struct {
+	/* Range still to be issued once the current piece is done */
+	int offset;
+	int size;
+	/* Current piece */
+	int piece_size;
+	std::chrono::steady_clock::time_point piece_start;
+	bool pending;
+} erase_op;
+
+static int erase_predict_us(int size)
+{
+	int rate = flash_state_get("erase_us_per_kib",
+				   ERASE_DEFAULT_US_PER_KIB);
+
+	return (int)MIN((int64_t)rate * (size + 1023) / 1024,
+			(int64_t)INT32_MAX);
+}
+
+/*
+ * Fold the measured time of an erase into the chip's rate.  The erase was
+ * seen still running 'busy_us' after it started and done at 'done_us', so
+ * it finished somewhere in between.
+ */
+static void erase_learn(int size, int busy_us, int done_us)
+{
+	int rate = flash_state_get("erase_us_per_kib", 0);
+	int kib = (size + 1023) / 1024;
+	int sample = (busy_us + done_us) / 2 / kib;
+
+	if (!sample)
+		sample = 1;
+	if (rate)
+		sample = (rate * 3 + sample) / 4;
+	/* Don't rewrite the file for small changes */
+	if (!rate || abs(sample - rate) > rate / 16)
+		flash_state_set("erase_us_per_kib", sample);
+}
+
+/*
+ * Sleep while an erase runs.  ECs with MKBP can raise a host event when
+ * they finish work, so if the transport can wait for events an event ends
+ * the sleep early.
+ */
+static void erase_sleep(int us)
+{
+	uint8_t event[sizeof(struct ec_response_get_next_event_v1)];
+
+	if (ec_pollevent && us >= 1000) {
+		if (ec_pollevent(1 << EC_MKBP_EVENT_HOST_EVENT, event,
+				 sizeof(event), us / 1000) >= 0)
+			return;
+	}
+	std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+/* Issue the next piece of erase_op */
+static int erase_issue_piece(void)
 {
 	struct ec_params_flash_erase_v1 p = { 0 };
-	auto timeout = std::chrono::milliseconds(0);
-	int rv = FLASH_ERASE_BUSY_RV;
+	struct flash_geometry g;
+	int limit = ERASE_PIECE_US, end = 0;
+	int block, bsize;
+
+	/*
+	 * Split on erase block boundaries, if the range is made of whole
+	 * blocks.  Otherwise leave it for the EC to take or reject.
+	 */
+	erase_op.piece_size = erase_op.size;
+	if (erase_predict_us(erase_op.size) > limit &&
+	    !get_flash_geometry(&g) &&
+	    flash_erase_block(&g, erase_op.offset, &bsize) ==
+		    erase_op.offset) {
+		for (end = erase_op.offset;
+		     end < erase_op.offset + erase_op.size; end += bsize) {
+			block = flash_erase_block(&g, end, &bsize);
+			if (block != end)
+				break;
+			if (end > erase_op.offset &&
+			    erase_predict_us(end + bsize - erase_op.offset) >
+				    limit)
+				break;
+		}
+		if (end > erase_op.offset &&
+		    end < erase_op.offset + erase_op.size)
+			erase_op.piece_size = end - erase_op.offset;
+	}
 
 	p.cmd = FLASH_ERASE_SECTOR_ASYNC;
-	p.params.offset = offset;
-	p.params.size = size;
+	p.params.offset = erase_op.offset;
+	p.params.size = erase_op.piece_size;
+	erase_op.piece_start = std::chrono::steady_clock::now();
+	erase_op.offset += erase_op.piece_size;
+	erase_op.size -= erase_op.piece_size;
 
-	rv = ec_command(EC_CMD_FLASH_ERASE, 1, &p, sizeof(p), NULL, 0);
+	return ec_command(EC_CMD_FLASH_ERASE, 1, &p, sizeof(p), NULL, 0);
+}
 
-	if (rv < 0)
-		return rv;
+/* Wait for the current piece of erase_op to complete */
+static int erase_wait_piece(void)
+{
+	struct ec_params_flash_erase_v1 p = { 0 };
+	int predicted = erase_predict_us(erase_op.piece_size);
+	std::chrono::microseconds timeout = ERASE_ASYNC_TIMEOUT;
+	int delay = MIN(MAX(predicted / 16, ERASE_POLL_MIN_US),
+			ERASE_POLL_MAX_US);
+	int elapsed, busy = 0;
+	int rv;
+
+	/* Allow for erases slower than predicted */
+	if (timeout.count() < (int64_t)predicted * 4)
+		timeout = std::chrono::microseconds((int64_t)predicted * 4);
 
-	rv = FLASH_ERASE_BUSY_RV;
+	/* Nothing to see until shortly before it should be done */
+	std::this_thread::sleep_until(
+		erase_op.piece_start +
+		std::chrono::microseconds(predicted / 4 * 3));
 
-	while (rv < 0 && timeout < ERASE_ASYNC_TIMEOUT) {
+	p.cmd = FLASH_ERASE_GET_RESULT;
+	for (;;) {
 		/*
 		 * The erase is not complete until FLASH_ERASE_GET_RESULT
 		 * returns success. It's important that we retry even when the
@@ -229,10 +1145,269 @@ int ec_flash_erase_async(int offset, int size)
 		 *
 		 * See https://crrev.com/c/511805 for details.
 		 */
-		std::this_thread::sleep_for(ERASE_ASYNC_WAIT_MS);
-		timeout += ERASE_ASYNC_WAIT_MS;
-		p.cmd = FLASH_ERASE_GET_RESULT;
 		rv = ec_command(EC_CMD_FLASH_ERASE, 1, &p, sizeof(p), NULL, 0);
+		elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+				  std::chrono::steady_clock::now() -
+				  erase_op.piece_start)
+				  .count();
+		if (rv >= 0)
+			break;
+		if (std::chrono::microseconds(elapsed) >= timeout)
+			return rv;
+		if (rv == FLASH_ERASE_BUSY_RV)
+			busy = elapsed;
+		erase_sleep(delay);
+		delay = MIN(delay * 2, ERASE_POLL_MAX_US);
+	}
+
+	/* Only a busy reply bounds when it finished */
+	if (busy)
+		erase_learn(erase_op.piece_size, busy, elapsed);
+	else if (elapsed < predicted)
+		erase_learn(erase_op.piece_size, 0, elapsed);
+	return rv;
+}
+
+int ec_flash_erase_async_start(int offset, int size)
+{
+	int rv;
+
+	if (erase_op.pending)
+		return -1;
+
+	erase_op.offset = offset;
+	erase_op.size = size;
+	rv = erase_issue_piece();
+	if (rv >= 0)
+		erase_op.pending = true;
+	return rv;
+}
+
+int ec_flash_erase_async_wait(void)
+{
+	int rv;
+
+	if (!erase_op.pending)
+		return -1;
+
+	for (;;) {
+		rv = erase_wait_piece();
+		if (rv < 0 || !erase_op.size)
+			break;
+		rv = erase_issue_piece();
+		if (rv < 0)
+			break;
+	}
+	erase_op.pending = false;
+	return rv;
+}
+
+int ec_flash_erase_async(int offset, int size)
+{
+	int rv = ec_flash_erase_async_start(offset, size);
+
+	if (rv < 0)
+		return rv;
+	return ec_flash_erase_async_wait();
+}
+
+/* Throughput in KiB/s of moving 'size' bytes since 'start' */
+static double bench_rate(int size, std::chrono::steady_clock::time_point start)
+{
+	std::chrono::duration<double> t =
+		std::chrono::steady_clock::now() - start;
+
+	return t.count() > 0 ? size / 1024.0 / t.count() : 0;
+}
+
+/*
+ * Refuse to benchmark over the RO image or the active RW image, which the
+ * EC may be running from.  If the EC can't say where they are, refuse too.
+ */
+static int flash_bench_check_range(int offset, int size)
+{
+	static const int regions[] = { EC_FLASH_REGION_RO,
+				       EC_FLASH_REGION_ACTIVE };
+	static const char *const region_names[] = { "RO", "active RW" };
+	struct ec_params_flash_region_info p;
+	struct ec_response_flash_region_info r;
+	int rv, i;
+
+	for (i = 0; i < (int)ARRAY_SIZE(regions); i++) {
+		p.region = regions[i];
+		rv = ec_command(EC_CMD_FLASH_REGION_INFO,
+				EC_VER_FLASH_REGION_INFO, &p, sizeof(p), &r,
+				sizeof(r));
+		if (rv < 0) {
+			fprintf(stderr, "Unable to get the %s region\n",
+				region_names[i]);
+			return rv;
+		}
+		if (r.size && offset < (int)(r.offset + r.size) &&
+		    (int)r.offset < offset + size) {
+			fprintf(stderr,
+				"Range overlaps the %s image at %d, size %d\n",
+				region_names[i], r.offset, r.size);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int ec_flash_bench(int offset, int size, bool save)
+{
+	std::chrono::steady_clock::time_point start;
+	struct flash_geometry g;
+	uint8_t *saved = NULL, *data = NULL, *readback = NULL;
+	uint32_t versions;
+	int chunk, max, write_size, bsize;
+	int best_read = 0, best_write = 0;
+	double rate, best = 0;
+	char key[32];
+	int rv, i, ver;
+
+	rv = get_flash_geometry(&g);
+	if (rv < 0) {
+		fprintf(stderr, "Unable to get flash geometry\n");
+		return rv;
+	}
+	if (size <= 0 || flash_erase_block(&g, offset, &bsize) != offset ||
+	    (offset + size != g.flash_size &&
+	     flash_erase_block(&g, offset + size, &bsize) != offset + size)) {
+		fprintf(stderr, "Range must be whole erase blocks of flash\n");
+		return -1;
+	}
+	rv = flash_bench_check_range(offset, size);
+	if (rv < 0)
+		return rv;
+
+	max = get_flash_write_step_max(&write_size);
+	if (max < 0)
+		return max;
+
+	saved = (uint8_t *)malloc(size);
+	data = (uint8_t *)malloc(size);
+	readback = (uint8_t *)malloc(size);
+	if (!saved || !data || !readback) {
+		fprintf(stderr, "Unable to allocate buffer.\n");
+		rv = -1;
+		goto out;
+	}
+	for (i = 0; i < size; i++)
+		data[i] = rand();
+
+	/* Put the region back afterwards */
+	rv = ec_flash_read_chunk(saved, offset, size, ec_max_insize);
+	if (rv < 0)
+		goto out;
+
+	printf("%-6s %-4s %6s %10s\n", "op", "ver", "chunk", "KiB/s");
+
+	/*
+	 * Reads, from small chunks up to the most the transport allows.
+	 * EC_CMD_FLASH_READ only has version 0.
+	 */
+	for (chunk = 16;; chunk = MIN(chunk * 2, ec_max_insize)) {
+		start = std::chrono::steady_clock::now();
+		rv = ec_flash_read_chunk(readback, offset, size, chunk);
+		if (rv < 0)
+			goto restore;
+		rate = bench_rate(size, start);
+		printf("%-6s %-4d %6d %10.1f\n", "read", 0, chunk, rate);
+		if (rate >= best) {
+			best = rate;
+			best_read = chunk;
+		}
+		if (chunk == ec_max_insize)
+			break;
+	}
+
+	/* Erases, synchronous and, if the EC can, asynchronous */
+	start = std::chrono::steady_clock::now();
+	rv = ec_flash_erase(offset, size);
+	if (rv < 0)
+		goto restore;
+	printf("%-6s %-4d %6s %10.1f\n", "erase", 0, "-",
+	       bench_rate(size, start));
+	if (ec_cmd_version_supported(EC_CMD_FLASH_ERASE, 1)) {
+		start = std::chrono::steady_clock::now();
+		rv = ec_flash_erase_async(offset, size);
+		if (rv < 0)
+			goto restore;
+		printf("%-6s %-4d %6s %10.1f\n", "erase", 1, "-",
+		       bench_rate(size, start));
+	}
+
+	/*
+	 * Writes of random data, in multiples of the write size, with each
+	 * version of EC_CMD_FLASH_WRITE the EC has.  Only version 0 is used
+	 * by ec_flash_write(), so only it picks the chunk size.
+	 */
+	if (ec_get_cmd_versions(EC_CMD_FLASH_WRITE, &versions) < 0 ||
+	    !versions)
+		versions = EC_VER_MASK(0);
+	best = 0;
+	for (ver = 0; ver <= EC_VER_FLASH_WRITE; ver++) {
+		if (!(versions & EC_VER_MASK(ver)))
+			continue;
+		flash_write_version = ver;
+		for (chunk = write_size;; chunk = MIN(chunk * 2, max)) {
+			rv = ec_flash_erase(offset, size);
+			if (rv < 0)
+				goto restore;
+			start = std::chrono::steady_clock::now();
+			rv = ec_flash_write_step(data, offset, size, chunk);
+			if (rv < 0)
+				goto restore;
+			rate = bench_rate(size, start);
+			printf("%-6s %-4d %6d %10.1f\n", "write", ver, chunk,
+			       rate);
+			if (!ver && rate >= best) {
+				best = rate;
+				best_write = chunk;
+			}
+			if (chunk == max)
+				break;
+		}
+	}
+	flash_write_version = 0;
+
+	/* Check the last write landed */
+	rv = ec_flash_read_chunk(readback, offset, size, ec_max_insize);
+	if (rv < 0)
+		goto restore;
+	if (memcmp(readback, data, size)) {
+		fprintf(stderr, "Written data did not read back\n");
+		rv = -1;
+		goto restore;
+	}
+
+	printf("Best read chunk %d, write chunk %d\n", best_read, best_write);
+	if (save) {
+		flash_chunk_key(key, sizeof(key), "read");
+		flash_state_set(key, best_read);
+		flash_chunk_key(key, sizeof(key), "write");
+		flash_state_set(key, best_write);
+		if (flash_state_chip[0])
+			printf("Saved for %s over %s\n", flash_state_chip,
+			       ec_transport_name ? ec_transport_name : "none");
+		else
+			fprintf(stderr, "EC has no chip info, not saved\n");
+	}
+
+restore:
+	flash_write_version = 0;
+	if (ec_flash_erase(offset, size) < 0 ||
+	    ec_flash_write_step(saved, offset, size,
+				best_write ? best_write : max) < 0 ||
+	    ec_flash_verify(saved, offset, size) < 0) {
+		fprintf(stderr, "Unable to restore flash at offset %d\n",
+			offset);
+		rv = -1;
 	}
+out:
+	free(saved);
+	free(data);
+	free(readback);
 	return rv;
 }
@@ -6,9 +6,22 @@
 #ifndef __UTIL_EC_FLASH_H
 #define __UTIL_EC_FLASH_H
 
+struct progress;
+
+/**
+ * Report how far ec_flash_read() and ec_flash_write() calls have got on a
+ * progress line, in bytes of the size passed to them.
+ *
+ * @param p		Progress line, or NULL to stop reporting
+ */
+void ec_flash_set_progress(struct progress *p);
+
 /**
  * Read EC flash memory
  *
+ * Reads are made in the largest chunks the transport allows, unless
+ * ec_flash_bench() saved a better size for this chip and transport.
+ *
  * @param buf		Destination buffer
  * @param offset	Offset in EC flash to read
  * @param size		Number of bytes to read
@@ -20,6 +33,11 @@ int ec_flash_read(uint8_t *buf, int offset, int size);
 /**
  * Verify EC flash memory
  *
+ * If the EC supports EC_CMD_VBOOT_HASH, it hashes the range with SHA-256
+ * while the host hashes the buffer, and nothing is read back if the digests
+ * match.  Otherwise the range is read back block by block, stopping at the
+ * first block which differs.
+ *
  * @param buf		Source buffer to verify against EC flash
  * @param offset	Offset in EC flash to check
  * @param size		Number of bytes to check
@@ -28,16 +46,48 @@ int ec_flash_read(uint8_t *buf, int offset, int size);
  */
 int ec_flash_verify(const uint8_t *buf, int offset, int size);
 
+/* Flags for ec_flash_write() */
+#define EC_FLASH_WRITE_JOURNAL (1 << 0) /* Keep a journal of progress */
+#define EC_FLASH_WRITE_RESUME (1 << 1) /* Resume from the journal */
+
 /**
  * Write EC flash memory
  *
+ * Writes are made in the largest multiple of the write size the transport
+ * allows, unless ec_flash_bench() saved a better size for this chip and
+ * transport.
+ *
+ * With EC_FLASH_WRITE_JOURNAL or EC_FLASH_WRITE_RESUME, progress is kept in
+ * a journal file for the transport and device, which is removed once the
+ * write completes.  If a write of the same image to the same offset is
+ * resumed, the blocks the journal records are checked against flash and
+ * skipped, so the range must not be erased again in between.
+ *
  * @param buf		Source buffer
  * @param offset	Offset in EC flash to write
  * @param size		Number of bytes to write
+ * @param flags		EC_FLASH_WRITE_* flags
  *
  * @return 0 if success, negative if error.
  */
-int ec_flash_write(const uint8_t *buf, int offset, int size);
+int ec_flash_write(const uint8_t *buf, int offset, int size, int flags);
+
+/**
+ * Write EC flash memory, erasing and rewriting only the erase blocks whose
+ * contents change
+ *
+ * The erase blocks covering the range are read back and compared with the
+ * new data.  Blocks which differ are erased and written, preserving any
+ * part of them outside the range; the others are left alone.  The caller
+ * must not erase the range first.
+ *
+ * @param buf		Source buffer
+ * @param offset	Offset in EC flash to write
+ * @param size		Number of bytes to write
+ *
+ * @return 0 if success, negative if error.
+ */
+int ec_flash_write_diff(const uint8_t *buf, int offset, int size);
 
 /**
  * Erase EC flash memory
@@ -52,6 +102,10 @@ int ec_flash_erase(int offset, int size);
 /**
  * Erase EC flash memory asynchronously
  *
+ * Completion is polled for around when the erase should be done, going by
+ * the erase rate learned for the chip, and large erases are issued in
+ * pieces.
+ *
  * @param offset	Offset in EC flash to erase
  * @param size		Number of bytes to erase
  *
@@ -59,4 +113,42 @@ int ec_flash_erase(int offset, int size);
  */
 int ec_flash_erase_async(int offset, int size);
 
+/**
+ * Start erasing EC flash memory asynchronously, so the caller can get on
+ * with other work before calling ec_flash_erase_async_wait().  Only one
+ * erase can be in progress, and no other flash commands may be sent until
+ * it is waited for.
+ *
+ * @param offset	Offset in EC flash to erase
+ * @param size		Number of bytes to erase
+ *
+ * @return 0 if success, negative if error.
+ */
+int ec_flash_erase_async_start(int offset, int size);
+
+/**
+ * Wait for an erase started by ec_flash_erase_async_start() to complete
+ *
+ * @return 0 if success, negative if error.
+ */
+int ec_flash_erase_async_wait(void);
+
+/**
+ * Measure EC flash throughput
+ *
+ * Times reads and writes of the range over a series of chunk sizes, with
+ * each version of EC_CMD_FLASH_WRITE and EC_CMD_FLASH_ERASE the EC has,
+ * printing a table.  The range must be whole erase blocks outside the RO
+ * and active RW images; its contents are put back afterwards.
+ *
+ * @param offset	Offset in EC flash of the scratch range
+ * @param size		Number of bytes in the scratch range
+ * @param save		Remember the fastest chunk sizes for this chip and
+ *			transport, for ec_flash_read() and ec_flash_write()
+ *			to use from then on
+ *
+ * @return 0 if success, negative if error.
+ */
+int ec_flash_bench(int offset, int size, bool save);
+
 #endif
@@ -0,0 +1,89 @@
+/* Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <chrono>
+
+#include "comm-host.h"
+#include "ec_memmap.h"
+
+/*
+ * The transports (and the kernel driver) refuse reads which reach the last
+ * byte of the map, so the snapshot stops short of it.  Reads of that byte go
+ * to the transport.
+ */
+#define MEMMAP_SNAPSHOT_SIZE (EC_MEMMAP_SIZE - 1)
+
+static int (*memmap_readmem_proto)(int offset, int bytes, void *dest);
+static uint8_t memmap_snapshot[MEMMAP_SNAPSHOT_SIZE];
+static bool memmap_valid;
+/* Set if the transport can't read the whole map in one go */
+static bool memmap_bulk_unsupported;
+static std::chrono::steady_clock::time_point memmap_time;
+static std::chrono::milliseconds memmap_max_age;
+
+int ec_memmap_refresh(void)
+{
+	int rv;
+
+	if (!memmap_readmem_proto)
+		return -1;
+
+	rv = memmap_readmem_proto(0, MEMMAP_SNAPSHOT_SIZE, memmap_snapshot);
+	if (rv != MEMMAP_SNAPSHOT_SIZE) {
+		memmap_valid = false;
+		return rv < 0 ? rv : -1;
+	}
+
+	memmap_valid = true;
+	memmap_time = std::chrono::steady_clock::now();
+	return 0;
+}
+
+void ec_memmap_invalidate(void)
+{
+	memmap_valid = false;
+}
+
+static int ec_readmem_snapshot(int offset, int bytes, void *dest)
+{
+	int rv;
+
+	if (bytes <= 0 || offset < 0 || offset + bytes > MEMMAP_SNAPSHOT_SIZE ||
+	    memmap_bulk_unsupported)
+		return memmap_readmem_proto(offset, bytes, dest);
+
+	if (!memmap_valid || std::chrono::steady_clock::now() - memmap_time >
+				     memmap_max_age) {
+		if (ec_memmap_refresh()) {
+			/*
+			 * If a single field can still be read, it is the bulk
+			 * read the transport can't do; stop trying it.
+			 */
+			rv = memmap_readmem_proto(offset, bytes, dest);
+			if (rv == bytes)
+				memmap_bulk_unsupported = true;
+			return rv;
+		}
+	}
+
+	memcpy(dest, memmap_snapshot + offset, bytes);
+	return bytes;
+}
+
+void ec_memmap_snapshot_enable(int max_age_ms)
+{
+	if (max_age_ms <= 0 || !ec_readmem ||
+	    ec_readmem == ec_readmem_snapshot)
+		return;
+
+	memmap_readmem_proto = ec_readmem;
+	memmap_max_age = std::chrono::milliseconds(max_age_ms);
+	memmap_valid = false;
+	memmap_bulk_unsupported = false;
+	ec_readmem = ec_readmem_snapshot;
+}
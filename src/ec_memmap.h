@@ -0,0 +1,42 @@
+/* Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Snapshot cache of the EC memory map.
+ */
+
+#ifndef __UTIL_EC_MEMMAP_H
+#define __UTIL_EC_MEMMAP_H
+
+/* Default maximum age of a memory map snapshot, in milliseconds */
+#define EC_MEMMAP_DEFAULT_AGE_MS 50
+
+/**
+ * Serve ec_readmem() from a snapshot of the whole memory map.
+ *
+ * The snapshot is read in one transport operation on the first fixed-length
+ * read, and re-read once it is older than 'max_age_ms'.  String reads go to
+ * the transport.  If the transport can't read the whole map at once, reads
+ * fall back to the transport.  Must be called after the transport is
+ * initialized.
+ *
+ * @param max_age_ms	Maximum age of the snapshot in milliseconds; 0
+ *			leaves ec_readmem() uncached.
+ */
+void ec_memmap_snapshot_enable(int max_age_ms);
+
+/**
+ * Re-read the snapshot now.
+ *
+ * @return 0 if success, negative otherwise.
+ */
+int ec_memmap_refresh(void);
+
+/**
+ * Discard the snapshot, so that the next read fetches a new one.  Called by
+ * ec_command() for every command other than a memory map read, since any of
+ * them may change the map.
+ */
+void ec_memmap_invalidate(void);
+
+#endif /* __UTIL_EC_MEMMAP_H */
@@ -0,0 +1,250 @@
+/* Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+/*
+ * Per host command statistics.
+ *
+ * Each command/version pair gets a slot in a fixed open-addressed table,
+ * claimed with a compare-and-swap the first time the pair is seen. Latencies
+ * go into a log-linear ("HDR") histogram: values are bucketed by their power
+ * of two and then by the next STATS_SUB_BITS bits, so every bucket is within
+ * 1/2^STATS_SUB_BITS of its true value from 1 ns up to 2^STATS_MAX_EXP ns.
+ * All counters are relaxed atomics, so recording never blocks.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+
+#include "comm-host.h"
+#include "ec_stats.h"
+
+#define STATS_SLOTS 128
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_MAX_EXP 40 /* 2^40 ns, about 18 minutes */
+#define STATS_BUCKETS ((STATS_MAX_EXP - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+
+/* Slot for results which are transport errors rather than EC results */
+#define STATS_RESULT_TRANSPORT 31
+
+struct stats_slot {
+	/* (command << 8 | version) + 1, or 0 if the slot is free */
+	std::atomic<uint32_t> key;
+	std::atomic<uint64_t> calls;
+	std::atomic<uint64_t> errors;
+	std::atomic<uint64_t> bytes_out;
+	std::atomic<uint64_t> bytes_in;
+	std::atomic<uint64_t> total_ns;
+	std::atomic<uint64_t> max_ns;
+	std::atomic<uint32_t> results[32];
+	std::atomic<uint32_t> hist[STATS_BUCKETS];
+};
+
+int ec_stats_enabled;
+
+static struct stats_slot slots[STATS_SLOTS];
+static std::atomic<uint64_t> dropped;
+static FILE *stats_file;
+
+static int stats_bucket(uint64_t v)
+{
+	int exp = STATS_SUB_BITS;
+
+	if (v < STATS_SUB_BUCKETS)
+		return v;
+
+	while (exp < STATS_MAX_EXP && (v >> (exp + 1)))
+		exp++;
+	if (exp >= STATS_MAX_EXP)
+		return STATS_BUCKETS - 1;
+
+	return (exp - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS +
+	       ((v >> (exp - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1));
+}
+
+/* Highest value which falls into bucket 'b' */
+static uint64_t stats_bucket_value(int b)
+{
+	int group = b / STATS_SUB_BUCKETS;
+	int exp = group + STATS_SUB_BITS - 1;
+	uint64_t sub = b % STATS_SUB_BUCKETS;
+
+	if (!group)
+		return b;
+
+	return ((STATS_SUB_BUCKETS + sub + 1) << (exp - STATS_SUB_BITS)) - 1;
+}
+
+static struct stats_slot *stats_find_slot(uint32_t key)
+{
+	uint32_t i = (key * 2654435761u) % STATS_SLOTS;
+	uint32_t n, expected;
+
+	for (n = 0; n < STATS_SLOTS; n++, i = (i + 1) % STATS_SLOTS) {
+		expected = slots[i].key.load(std::memory_order_relaxed);
+		if (expected == key)
+			return &slots[i];
+		if (expected)
+			continue;
+		if (slots[i].key.compare_exchange_strong(expected, key) ||
+		    expected == key)
+			return &slots[i];
+	}
+	return NULL;
+}
+
+static void stats_max(std::atomic<uint64_t> *max, uint64_t v)
+{
+	uint64_t cur = max->load(std::memory_order_relaxed);
+
+	while (cur < v && !max->compare_exchange_weak(
+				  cur, v, std::memory_order_relaxed))
+		;
+}
+
+void ec_stats_record(int command, int version, int outsize, int rv,
+		     uint64_t nsec)
+{
+	const auto relaxed = std::memory_order_relaxed;
+	struct stats_slot *s;
+	int result;
+
+	s = stats_find_slot(((command & 0xffff) << 8 | (version & 0xff)) + 1);
+	if (!s) {
+		dropped.fetch_add(1, relaxed);
+		return;
+	}
+
+	if (rv >= 0)
+		result = EC_RES_SUCCESS;
+	else if (rv <= -EECRESULT && rv > -EECRESULT - STATS_RESULT_TRANSPORT)
+		result = -EECRESULT - rv;
+	else
+		result = STATS_RESULT_TRANSPORT;
+
+	s->calls.fetch_add(1, relaxed);
+	if (result != EC_RES_SUCCESS)
+		s->errors.fetch_add(1, relaxed);
+	s->results[result].fetch_add(1, relaxed);
+	s->bytes_out.fetch_add(outsize, relaxed);
+	if (rv > 0)
+		s->bytes_in.fetch_add(rv, relaxed);
+	s->total_ns.fetch_add(nsec, relaxed);
+	stats_max(&s->max_ns, nsec);
+	s->hist[stats_bucket(nsec)].fetch_add(1, relaxed);
+}
+
+static double stats_percentile(const struct stats_slot *s, uint64_t calls,
+			       int percent)
+{
+	uint64_t target = (calls * percent + 99) / 100;
+	uint64_t seen = 0;
+	uint64_t max = s->max_ns.load();
+	uint64_t v;
+	int b;
+
+	for (b = 0; b < STATS_BUCKETS; b++) {
+		seen += s->hist[b].load();
+		if (seen >= target) {
+			v = stats_bucket_value(b);
+			return (v < max ? v : max) / 1000.0;
+		}
+	}
+	return max / 1000.0;
+}
+
+static int stats_compare(const void *a, const void *b)
+{
+	uint32_t ka = (*(const struct stats_slot **)a)->key.load();
+	uint32_t kb = (*(const struct stats_slot **)b)->key.load();
+
+	return ka < kb ? -1 : ka > kb;
+}
+
+void ec_stats_print(void)
+{
+	struct stats_slot *sorted[STATS_SLOTS];
+	FILE *f = stats_file ? stats_file : stderr;
+	int n = 0;
+	int i, r;
+
+	for (i = 0; i < STATS_SLOTS; i++) {
+		if (slots[i].key.load())
+			sorted[n++] = &slots[i];
+	}
+	qsort(sorted, n, sizeof(sorted[0]), stats_compare);
+
+	fprintf(f, "Host command statistics (transport %s):\n",
+		ec_transport_name ? ec_transport_name : "none");
+	fprintf(f,
+		"cmd    ver    calls errors   bytes out    bytes in"
+		"   p50 us   p90 us   p99 us   max us      bytes/s\n");
+
+	for (i = 0; i < n; i++) {
+		struct stats_slot *s = sorted[i];
+		uint32_t key = s->key.load() - 1;
+		uint64_t calls = s->calls.load();
+		uint64_t bytes = s->bytes_out.load() + s->bytes_in.load();
+		uint64_t total_ns = s->total_ns.load();
+
+		if (!calls)
+			continue;
+
+		fprintf(f,
+			"0x%04x %3u %8llu %6llu %11llu %11llu "
+			"%8.1f %8.1f %8.1f %8.1f %12.0f\n",
+			key >> 8, key & 0xff, (unsigned long long)calls,
+			(unsigned long long)s->errors.load(),
+			(unsigned long long)s->bytes_out.load(),
+			(unsigned long long)s->bytes_in.load(),
+			stats_percentile(s, calls, 50),
+			stats_percentile(s, calls, 90),
+			stats_percentile(s, calls, 99),
+			s->max_ns.load() / 1000.0,
+			total_ns ? bytes * 1e9 / total_ns : 0.0);
+
+		for (r = 1; r < 32; r++) {
+			uint32_t count = s->results[r].load();
+
+			if (!count)
+				continue;
+			if (r == STATS_RESULT_TRANSPORT)
+				fprintf(f, "         transport error x%u\n",
+					count);
+			else
+				fprintf(f, "         EC result %d x%u\n", r,
+					count);
+		}
+	}
+
+	if (dropped.load())
+		fprintf(f, "%llu commands not recorded (table full)\n",
+			(unsigned long long)dropped.load());
+}
+
+static void stats_atexit(void)
+{
+	ec_stats_print();
+	if (stats_file)
+		fclose(stats_file);
+}
+
+void ec_stats_enable(const char *filename)
+{
+	if (ec_stats_enabled)
+		return;
+
+	if (filename) {
+		stats_file = fopen(filename, "w");
+		if (!stats_file)
+			perror("Error opening stats file");
+	}
+
+	ec_stats_enabled = 1;
+	atexit(stats_atexit);
+}
@@ -0,0 +1,45 @@
+/* Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Per host command latency and throughput statistics.
+ */
+
+#ifndef __UTIL_EC_STATS_H
+#define __UTIL_EC_STATS_H
+
+#include <stdint.h>
+
+/* Non-zero once ec_stats_enable() has been called */
+extern int ec_stats_enabled;
+
+/**
+ * Start collecting host command statistics, and print them at exit.
+ *
+ * @param filename	File to print the statistics to, or NULL for stderr.
+ */
+void ec_stats_enable(const char *filename);
+
+/**
+ * Record one host command.  Safe to call from several threads; no locks are
+ * taken.
+ *
+ * @param command	Command code, including any sub-device offset
+ * @param version	Command version
+ * @param outsize	Size of the request data in bytes
+ * @param rv		Return value of the transport (see ec_command())
+ * @param nsec		Wall time spent in the transport, in nanoseconds
+ */
+void ec_stats_record(int command, int version, int outsize, int rv,
+		     uint64_t nsec);
+
+/**
+ * Print the statistics collected so far.
+ *
+ * One line per command and version, with call and error counts, bytes
+ * transferred, latency percentiles (p50/p90/p99/max) in microseconds and
+ * throughput in bytes per second of time spent in the transport.
+ */
+void ec_stats_print(void);
+
+#endif /* __UTIL_EC_STATS_H */
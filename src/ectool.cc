@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,12 +20,17 @@
 
 #include "battery.h"
 #include "comm-host.h"
+#include "comm-daemon.h"
+#include "comm-servo-spi.h"
+#include "comm-sim.h"
 #include "comm-usb.h"
 #include "chipset.h"
 #include "compile_time_macros.h"
 #include "crc.h"
 #include "ec_panicinfo.h"
 #include "ec_flash.h"
+#include "ec_memmap.h"
+#include "ec_stats.h"
 #include "ec_version.h"
 #include "ectool.h"
 #include "i2c.h"
@@ -32,6 +38,7 @@
 #include "lock/gec_lock.h"
 #include "misc_util.h"
 #include "panic.h"
+#include "sha256.h"
 #include "usb_pd.h"
 
 #include "framework_oem_ec_commands.h"
@@ -59,6 +66,12 @@ enum {
 	OPT_ASCII,
 	OPT_I2C_BUS,
 	OPT_DEVICE,
+	OPT_STATS,
+	OPT_CACHE,
+	OPT_MEMMAP_AGE,
+	OPT_USB_QUEUE,
+	OPT_SPI_CLOCK,
+	OPT_LPC_FAST,
 };
 
 static struct option long_opts[] = { { "dev", 1, 0, OPT_DEV },
@@ -67,6 +80,12 @@ static struct option long_opts[] = { { "dev", 1, 0, OPT_DEV },
 				     { "ascii", 0, 0, OPT_ASCII },
 				     { "i2c_bus", 1, 0, OPT_I2C_BUS },
 				     { "device", 1, 0, OPT_DEVICE },
+				     { "stats", 2, 0, OPT_STATS },
+				     { "cache", 1, 0, OPT_CACHE },
+				     { "memmap_age", 1, 0, OPT_MEMMAP_AGE },
+				     { "usb_queue", 1, 0, OPT_USB_QUEUE },
+				     { "spi_clock", 1, 0, OPT_SPI_CLOCK },
+				     { "lpc_fast", 0, 0, OPT_LPC_FAST },
 				     { NULL, 0, 0, 0 } };
 
 #define GEC_LOCK_TIMEOUT_SECS 30 /* 30 secs */
@@ -85,6 +104,9 @@ const char help_str[] =
 	"      Enable/disable LCD backlight\n"
 	"  basestate [attach | detach | reset]\n"
 	"      Manually force base state to attached, detached or reset.\n"
+	"  batch [failfast] <file|->\n"
+	"      Run commands read from a file (or stdin), one per line, over\n"
+	"      a single EC session.\n"
 	"  battery\n"
 	"      Prints battery info\n"
 	"  batterycutoff [at-shutdown]\n"
@@ -115,6 +137,9 @@ const char help_str[] =
 	"      Prints the last output to the EC debug console\n"
 	"  cec\n"
 	"      Read or write CEC messages and settings\n"
+	"  daemon [socket]\n"
+	"      Serve host commands to other ectool instances (see\n"
+	"      --interface=daemon) over a Unix domain socket\n"
 	"  echash [CMDS]\n"
 	"      Various EC hash commands\n"
 	"  eventclear <mask>\n"
@@ -141,6 +166,10 @@ const char help_str[] =
 	"      Set the maximum external power limit\n"
 	"  fanduty <percent>\n"
 	"      Forces the fan PWM to a constant duty cycle\n"
+	"  flashbench [save] <offset> <size>\n"
+	"      Measures EC flash throughput over a scratch range outside the\n"
+	"      RO and active RW images, which is restored afterwards. With\n"
+	"      save, the fastest chunk sizes are used from then on\n"
 	"  flasherase <offset> <size>\n"
 	"      Erases EC flash\n"
 	"  flasheraseasync <offset> <size>\n"
@@ -149,22 +178,34 @@ const char help_str[] =
 	"      Prints information on the EC flash\n"
 	"  flashspiinfo\n"
 	"      Prints information on EC SPI flash, if present\n"
-	"  flashpd <dev_id> <port> <filename>\n"
-	"      Flash commands over PD\n"
+	"  flashpd <dev_id> <port> <filename> [max]\n"
+	"      Flash commands over PD. With max, each write is as big as the\n"
+	"      host protocol allows rather than 96 bytes\n"
 	"  flashprotect [now] [enable | disable]\n"
 	"      Prints or sets EC flash protection state\n"
 	"  flashread <offset> <size> <outfile>\n"
 	"      Reads from EC flash to a file\n"
-	"  flashwrite <offset> <infile>\n"
-	"      Writes to EC flash from a file\n"
+	"  flashverify <offset> <infile>\n"
+	"      Checks EC flash against a file, using an EC-computed hash\n"
+	"      where possible\n"
+	"  flashwrite [diff | journal | resume] <offset> <infile>\n"
+	"      Writes to EC flash from a file. With diff, only erase blocks\n"
+	"      whose contents change are erased and rewritten. With journal,\n"
+	"      progress is recorded so an interrupted write can be resumed.\n"
+	"      With resume, an interrupted write of the same file carries\n"
+	"      on where it stopped\n"
 	"  forcelidopen <enable>\n"
 	"      Forces the lid switch to open position\n"
 	"  fpcontext\n"
 	"      Sets the fingerprint sensor context\n"
 	"  fpencstatus\n"
 	"      Prints status of Fingerprint sensor encryption engine\n"
-	"  fpframe\n"
+	"  fpframe [raw]\n"
 	"      Retrieve the finger image as a PGM image\n"
+	"  fpframe burst <count> <dir> [capture_type]\n"
+	"      Capture frames back to back into <dir>/frames.bin, indexed in\n"
+	"      <dir>/index.txt\n"
+	"      capture_type: simple|vendor|pattern0|pattern1|qual|test_reset\n"
 	"  fpinfo\n"
 	"      Prints information about the Fingerprint sensor\n"
 	"  fpmode [mode... [capture_type]]\n"
@@ -178,6 +219,8 @@ const char help_str[] =
 	"      Prints timing statisitcs relating to capture and matching\n"
 	"  fptemplate [<infile>|<index 0..2>]\n"
 	"      Add a template if <infile> is provided, else dump it\n"
+	"  fptemplate backup|restore <dir>\n"
+	"      Save all enrolled templates to <dir>, or enroll those saved\n"
 	"  gpioget <GPIO name>\n"
 	"      Get the value of GPIO signal\n"
 	"  gpioset <GPIO name>\n"
@@ -220,6 +263,9 @@ const char help_str[] =
 	"      Set the color of an LED or query brightness range\n"
 	"  lightbar [CMDS]\n"
 	"      Various lightbar control commands\n"
+	"  lpclatency [count]\n"
+	"      Compare host command latency of the byte-wide and 32-bit LPC\n"
+	"      engines (x86, --interface=lpc)\n"
 	"  locatechip <type> <index>\n"
 	"      Get the addresses and ports of i2c connected and embedded chips\n"
 	"  mkbpget <buttons|switches>\n"
@@ -332,8 +378,9 @@ const char help_str[] =
 	"      Set the threshold temperature values for the thermal engine.\n"
 	"  tpselftest\n"
 	"      Run touchpad self test.\n"
-	"  tpframeget\n"
-	"      Get touchpad frame data.\n"
+	"  tpframeget [stream <file> [<count> [<rate>]]]\n"
+	"      Get touchpad frame data, or record <count> snapshots (0 until\n"
+	"      interrupted), <rate> per second, to <file>.\n"
 	"  tmp006cal <tmp006_index> [params...]\n"
 	"      Get/set TMP006 calibration\n"
 	"  tmp006raw <tmp006_index>\n"
@@ -457,16 +504,41 @@ static int find_enum_from_text(const char *str,
 void print_help(const char *prog, int print_cmds)
 {
 	printf("Usage: %s [--dev=n] "
-	       "[--interface=dev|i2c|lpc] [--i2c_bus=n] [--device=vid:pid] ",
+	       "[--interface=dev|i2c|lpc|servo|sim|daemon] [--i2c_bus=n] "
+	       "[--device=vid:pid] [--usb_queue=n] [--spi_clock=hz] ",
 	       prog);
+	printf("[--lpc_fast] ");
 	printf("[--name=cros_ec|cros_fp|cros_pd|cros_scp|cros_ish] [--ascii] ");
+	printf("[--stats[=file]] [--cache=file] [--memmap_age=ms] ");
 	printf("<command> [params]\n\n");
 	printf("  --i2c_bus=n  Specifies the number of an I2C bus to use. For\n"
 	       "               example, to use /dev/i2c-7, pass --i2c_bus=7.\n"
 	       "               Implies --interface=i2c.\n\n");
-	printf("  --interface Specifies the interface.\n\n");
+	printf("  --interface Specifies the interface. 'sim' talks to an\n"
+	       "              in-process simulated EC, configured by the file\n"
+	       "              given with --name. 'daemon' sends commands\n"
+	       "              through 'ectool daemon', listening on the\n"
+	       "              socket given with --name (default\n"
+	       "              " EC_DAEMON_SOCKET ").\n\n");
 	printf("  --device    Specifies USB endpoint by vendor ID and product\n"
 	       "              ID (e.g. 18d1:5022).\n\n");
+	printf("  --usb_queue Number of host commands kept in flight over USB\n"
+	       "              by bulk operations, for devices which can queue\n"
+	       "              them (1-8, default 1).\n\n");
+	printf("  --spi_clock SPI clock in Hz for --interface=servo\n"
+	       "              (default 1000000).\n\n");
+	printf("  --lpc_fast  Move host command packets over LPC with 32-bit\n"
+	       "              port I/O (see 'lpclatency').\n\n");
+	printf("  --stats     Print per host command latency and throughput\n"
+	       "              statistics at exit, to stderr or to the given\n"
+	       "              file.\n\n");
+	printf("  --cache     Keep the versions of host commands supported by\n"
+	       "              the EC in the given file, so later runs against\n"
+	       "              the same firmware do not need to ask again.\n\n");
+	printf("  --memmap_age Read the EC memory map in one go and serve\n"
+	       "              reads from that copy for up to this many ms\n"
+	       "              (default %d, 0 to read each field directly).\n\n",
+	       EC_MEMMAP_DEFAULT_AGE_MS);
 	if (print_cmds)
 		puts(help_str);
 	else
@@ -1349,7 +1421,12 @@ int cmd_reboot_ec(int argc, char *argv[])
 	}
 
 	rv = ec_command(EC_CMD_REBOOT_EC, 0, &p, sizeof(p), NULL, 0);
-	return (rv < 0 ? rv : 0);
+	if (rv < 0)
+		return rv;
+
+	/* The image we end up in may support other command versions */
+	ec_cmd_versions_cache_reset();
+	return 0;
 }
 
 int cmd_reboot_ap_on_g3(int argc, char *argv[])
@@ -1698,6 +1775,7 @@ int cmd_flash_spi_info(int argc, char *argv[])
 
 int cmd_flash_read(int argc, char *argv[])
 {
+	struct progress progress;
 	int offset, size;
 	int rv;
 	char *e;
@@ -1720,23 +1798,25 @@ int cmd_flash_read(int argc, char *argv[])
 	}
 	printf("Reading %d bytes at offset %d...\n", size, offset);
 
-	buf = (uint8_t *)malloc(size);
-	if (!buf) {
-		fprintf(stderr, "Unable to allocate buffer.\n");
+	/* Chunks land straight in the output file */
+	buf = map_output_file(argv[3], size, 0);
+	if (!buf)
 		return -1;
-	}
 
 	/* Read data in chunks */
+	progress_start(&progress, "Reading", size);
+	ec_flash_set_progress(&progress);
 	rv = ec_flash_read(buf, offset, size);
+	ec_flash_set_progress(NULL);
+	progress_end(&progress);
+
 	if (rv < 0) {
-		free(buf);
+		/* Don't leave a partial image behind */
+		discard_output_file(argv[3], buf, size);
 		return rv;
 	}
-
-	rv = write_file(argv[3], (const char *)(buf), size);
-	free(buf);
-	if (rv)
-		return rv;
+	if (unmap_output_file(argv[3], buf, size))
+		return -1;
 
 	printf("done.\n");
 	return 0;
@@ -1744,13 +1824,33 @@ int cmd_flash_read(int argc, char *argv[])
 
 int cmd_flash_write(int argc, char *argv[])
 {
+	struct progress progress;
 	int offset, size;
 	int rv;
 	char *e;
-	char *buf;
+	const uint8_t *buf;
+	bool diff = false;
+	int flags = 0;
+
+	if (argc > 1 && !strcmp(argv[1], "diff")) {
+		diff = true;
+		argc--;
+		argv++;
+	} else if (argc > 1 && !strcmp(argv[1], "journal")) {
+		flags = EC_FLASH_WRITE_JOURNAL;
+		argc--;
+		argv++;
+	} else if (argc > 1 && !strcmp(argv[1], "resume")) {
+		flags = EC_FLASH_WRITE_RESUME;
+		argc--;
+		argv++;
+	}
 
 	if (argc < 3) {
-		fprintf(stderr, "Usage: %s <offset> <filename>\n", argv[0]);
+		fprintf(stderr,
+			"Usage: %s [diff | journal | resume] <offset> "
+			"<filename>\n",
+			argv[0]);
 		return -1;
 	}
 
@@ -1760,18 +1860,58 @@ int cmd_flash_write(int argc, char *argv[])
 		return -1;
 	}
 
-	/* Read the input file */
-	buf = read_file(argv[2], &size);
+	/* Map the input file */
+	buf = map_file(argv[2], &size);
 	if (!buf)
 		return -1;
 
 	printf("Writing to offset %d...\n", offset);
 
 	/* Write data in chunks */
-	rv = ec_flash_write((const uint8_t *)(buf), offset, size);
+	if (diff) {
+		rv = ec_flash_write_diff(buf, offset, size);
+	} else {
+		progress_start(&progress, "Writing", size);
+		ec_flash_set_progress(&progress);
+		rv = ec_flash_write(buf, offset, size, flags);
+		ec_flash_set_progress(NULL);
+		progress_end(&progress);
+	}
 
-	free(buf);
+	unmap_file(buf, size);
+
+	if (rv < 0)
+		return rv;
+
+	printf("done.\n");
+	return 0;
+}
+
+int cmd_flash_verify(int argc, char *argv[])
+{
+	int offset, size;
+	int rv;
+	char *e;
+	const uint8_t *buf;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <offset> <filename>\n", argv[0]);
+		return -1;
+	}
+
+	offset = strtol(argv[1], &e, 0);
+	if ((e && *e) || offset < 0 || offset > MAX_FLASH_SIZE) {
+		fprintf(stderr, "Bad offset.\n");
+		return -1;
+	}
 
+	buf = map_file(argv[2], &size);
+	if (!buf)
+		return -1;
+
+	printf("Verifying %d bytes at offset %d...\n", size, offset);
+	rv = ec_flash_verify(buf, offset, size);
+	unmap_file(buf, size);
 	if (rv < 0)
 		return rv;
 
@@ -1779,6 +1919,40 @@ int cmd_flash_write(int argc, char *argv[])
 	return 0;
 }
 
+int cmd_flash_bench(int argc, char *argv[])
+{
+	int offset, size;
+	char *e;
+	bool save = false;
+
+	if (argc > 1 && !strcmp(argv[1], "save")) {
+		save = true;
+		argc--;
+		argv++;
+	}
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s [save] <offset> <size>\n",
+			argv[0]);
+		return -1;
+	}
+
+	offset = strtol(argv[1], &e, 0);
+	if ((e && *e) || offset < 0 || offset > MAX_FLASH_SIZE) {
+		fprintf(stderr, "Bad offset.\n");
+		return -1;
+	}
+
+	size = strtol(argv[2], &e, 0);
+	if ((e && *e) || size <= 0 || size > MAX_FLASH_SIZE) {
+		fprintf(stderr, "Bad size.\n");
+		return -1;
+	}
+
+	printf("Benchmarking %d bytes at offset %d...\n", size, offset);
+	return ec_flash_bench(offset, size, save);
+}
+
 int cmd_flash_erase(int argc, char *argv[])
 {
 	int offset, size;
@@ -2229,6 +2403,118 @@ int cmd_apreset(int argc, char *argv[])
 
 #define FP_FRAME_INDEX_SIMPLE_IMAGE -1
 
+/* Time taken by each EC_CMD_FP_FRAME, in seconds */
+struct fp_chunk_stats {
+	int count;
+	double sum;
+	double min;
+	double max;
+};
+
+static void fp_chunk_stats_add(struct fp_chunk_stats *stats, double t,
+			       int count)
+{
+	if (!stats || !count)
+		return;
+	if (!stats->count || t < stats->min)
+		stats->min = t;
+	if (t > stats->max)
+		stats->max = t;
+	stats->sum += t * count;
+	stats->count += count;
+}
+
+/*
+ * Download 'size' bytes of a frame buffer from 'offset', which holds the
+ * buffer index and the offset in it, in ec_max_insize chunks.
+ *
+ * @returns 0 if success, negative if error.
+ */
+static int fp_download(uint32_t offset, uint8_t *ptr, size_t size,
+		       struct fp_chunk_stats *stats)
+{
+	struct ec_params_fp_frame p;
+	const int max_attempts = 3;
+	int num_attempts;
+	size_t stride;
+	double start;
+	int rv = 0;
+
+	p.offset = offset;
+
+	/*
+	 * Fetch as much as possible in one batch, so transports which can
+	 * keep several commands in flight do; carry on one chunk at a time,
+	 * with retries, from the first chunk that fails.
+	 */
+	if (ec_command_batch_proto) {
+		size_t chunks = (size + ec_max_insize - 1) / ec_max_insize;
+		struct ec_command_batch_entry *cmds =
+			(struct ec_command_batch_entry *)calloc(
+				chunks, sizeof(*cmds));
+		struct ec_params_fp_frame *params =
+			(struct ec_params_fp_frame *)calloc(chunks,
+							    sizeof(*params));
+		size_t i, done = 0;
+
+		if (cmds && params) {
+			for (i = 0; i < chunks; i++) {
+				stride = MIN(ec_max_insize,
+					     size - i * ec_max_insize);
+				params[i].offset = p.offset + i * ec_max_insize;
+				params[i].size = stride;
+				cmds[i].command = EC_CMD_FP_FRAME;
+				cmds[i].outdata = &params[i];
+				cmds[i].outsize = sizeof(params[i]);
+				cmds[i].indata = ptr + i * ec_max_insize;
+				cmds[i].insize = stride;
+			}
+			start = time_now();
+			done = ec_command_batch(cmds, chunks);
+			/* Chunks in flight together share the time */
+			if (done)
+				fp_chunk_stats_add(stats,
+						   (time_now() - start) / done,
+						   done);
+		}
+		free(cmds);
+		free(params);
+
+		if (done == chunks) {
+			size = 0;
+		} else {
+			p.offset += done * ec_max_insize;
+			size -= done * ec_max_insize;
+			ptr += done * ec_max_insize;
+		}
+	}
+
+	while (size) {
+		stride = MIN(ec_max_insize, size);
+		p.size = stride;
+		num_attempts = 0;
+		start = time_now();
+		while (num_attempts < max_attempts) {
+			num_attempts++;
+			rv = ec_command(EC_CMD_FP_FRAME, 0, &p, sizeof(p), ptr,
+					stride);
+			if (rv >= 0)
+				break;
+			if (rv == -EECRESULT - EC_RES_ACCESS_DENIED)
+				break;
+			usleep(100000);
+		}
+		if (rv < 0)
+			return rv;
+		fp_chunk_stats_add(stats, time_now() - start, 1);
+		p.offset += stride;
+		size -= stride;
+		ptr += stride;
+	}
+
+	return 0;
+}
+
 /*
  * Download a frame buffer from the FPMCU.
  *
@@ -2247,16 +2533,12 @@ int cmd_apreset(int argc, char *argv[])
  */
 static void *fp_download_frame(struct ec_response_fp_info *info, int index)
 {
-	struct ec_params_fp_frame p;
 	int rv = 0;
-	size_t stride, size;
+	size_t size;
 	void *buffer;
-	uint8_t *ptr;
 	int cmdver = ec_cmd_version_supported(EC_CMD_FP_INFO, 1) ? 1 : 0;
 	int rsize = cmdver == 1 ? sizeof(*info) :
 				  sizeof(struct ec_response_fp_info_v0);
-	const int max_attempts = 3;
-	int num_attempts;
 
 	/* templates not supported in command v0 */
 	if (index > 0 && cmdver == 0)
@@ -2281,29 +2563,10 @@ static void *fp_download_frame(struct ec_response_fp_info *info, int index)
 		return NULL;
 	}
 
-	ptr = (uint8_t *)(buffer);
-	p.offset = index << FP_FRAME_INDEX_SHIFT;
-	while (size) {
-		stride = MIN(ec_max_insize, size);
-		p.size = stride;
-		num_attempts = 0;
-		while (num_attempts < max_attempts) {
-			num_attempts++;
-			rv = ec_command(EC_CMD_FP_FRAME, 0, &p, sizeof(p), ptr,
-					stride);
-			if (rv >= 0)
-				break;
-			if (rv == -EECRESULT - EC_RES_ACCESS_DENIED)
-				break;
-			usleep(100000);
-		}
-		if (rv < 0) {
-			free(buffer);
-			return NULL;
-		}
-		p.offset += stride;
-		size -= stride;
-		ptr += stride;
+	if (fp_download((uint32_t)index << FP_FRAME_INDEX_SHIFT,
+			(uint8_t *)buffer, size, NULL) < 0) {
+		free(buffer);
+		return NULL;
 	}
 
 	return buffer;
@@ -2548,16 +2811,205 @@ int cmd_fp_enc_status(int argc, char *argv[])
 	return rv;
 }
 
+/* Longest a capture may take, e.g. waiting for a finger */
+#define FP_CAPTURE_TIMEOUT 10.0
+/* Between checks of whether a capture is done, without MKBP events */
+#define FP_CAPTURE_POLL_US 5000
+/* Longest wait for an image-ready event before checking anyway */
+#define FP_CAPTURE_EVENT_MS 100
+
+static int fp_capture_start(int capture_type)
+{
+	struct ec_params_fp_mode p;
+	struct ec_response_fp_mode r;
+
+	p.mode = FP_MODE_CAPTURE | capture_type << FP_MODE_CAPTURE_TYPE_SHIFT;
+	return ec_command(EC_CMD_FP_MODE, 0, &p, sizeof(p), &r, sizeof(r));
+}
+
+/*
+ * Wait for a capture to finish.  The sensor leaves capture mode once the
+ * frame is ready; if the transport has MKBP events, the image-ready event
+ * says when to look.
+ */
+static int fp_capture_wait(void)
+{
+	struct ec_response_get_next_event_v1 event;
+	struct ec_params_fp_mode p;
+	struct ec_response_fp_mode r;
+	double deadline = time_now() + FP_CAPTURE_TIMEOUT;
+	int rv;
+
+	p.mode = FP_MODE_DONT_CHANGE;
+	for (;;) {
+		rv = ec_command(EC_CMD_FP_MODE, 0, &p, sizeof(p), &r,
+				sizeof(r));
+		if (rv < 0)
+			return rv;
+		if (!(r.mode & FP_MODE_CAPTURE))
+			return 0;
+		if (time_now() > deadline) {
+			fprintf(stderr, "Timeout waiting for capture\n");
+			return -ETIMEDOUT;
+		}
+		if (!ec_pollevent ||
+		    ec_pollevent(1 << EC_MKBP_EVENT_FINGERPRINT, &event,
+				 sizeof(event), FP_CAPTURE_EVENT_MS) < 0)
+			usleep(FP_CAPTURE_POLL_US);
+	}
+}
+
+static const char *const fp_capture_type_names[] = {
+	[FP_CAPTURE_VENDOR_FORMAT] = "vendor",
+	[FP_CAPTURE_SIMPLE_IMAGE] = "simple",
+	[FP_CAPTURE_PATTERN0] = "pattern0",
+	[FP_CAPTURE_PATTERN1] = "pattern1",
+	[FP_CAPTURE_QUALITY_TEST] = "qual",
+	[FP_CAPTURE_RESET_TEST] = "test_reset",
+};
+
+/*
+ * Capture frames back to back.  Each frame is downloaded straight into
+ * its place in a preallocated, mapped frames.bin, and the next capture is
+ * started before the frame is indexed, so the sensor is kept busy while
+ * the host writes the frame out.
+ */
+static int fp_frame_burst(int argc, char *argv[])
+{
+	struct ec_response_fp_info info;
+	struct fp_chunk_stats stats = { 0 };
+	struct progress progress;
+	char frames_path[256], index_path[256];
+	int cmdver = ec_cmd_version_supported(EC_CMD_FP_INFO, 1) ? 1 : 0;
+	int capture_type = FP_CAPTURE_SIMPLE_IMAGE;
+	double start, captured, downloaded, elapsed;
+	double capture_start, frame_time, capture_time = 0;
+	int count, size, i, rv;
+	uint8_t *frames;
+	FILE *index;
+	char *e;
+
+	if (argc < 3) {
+		fprintf(stderr,
+			"Usage: fpframe burst <count> <dir> [capture_type]\n");
+		return -1;
+	}
+
+	count = strtol(argv[1], &e, 0);
+	if ((e && *e) || count <= 0) {
+		fprintf(stderr, "Bad count.\n");
+		return -1;
+	}
+
+	if (argc > 3) {
+		for (capture_type = 0;
+		     capture_type < ARRAY_SIZE(fp_capture_type_names);
+		     capture_type++) {
+			if (!strcmp(argv[3],
+				    fp_capture_type_names[capture_type]))
+				break;
+		}
+		if (capture_type == ARRAY_SIZE(fp_capture_type_names)) {
+			fprintf(stderr, "Bad capture type.\n");
+			return -1;
+		}
+	}
+
+	rv = ec_command(EC_CMD_FP_INFO, cmdver, NULL, 0, &info,
+			cmdver ? sizeof(info) :
+				 sizeof(struct ec_response_fp_info_v0));
+	if (rv < 0)
+		return rv;
+	if (capture_type == FP_CAPTURE_VENDOR_FORMAT)
+		size = info.frame_size;
+	else
+		size = info.width * info.bpp / 8 * info.height;
+	if (size <= 0 || count > INT32_MAX / size) {
+		fprintf(stderr, "Frames too large.\n");
+		return -1;
+	}
+
+	snprintf(frames_path, sizeof(frames_path), "%s/frames.bin", argv[2]);
+	snprintf(index_path, sizeof(index_path), "%s/index.txt", argv[2]);
+	frames = map_output_file(frames_path, count * size, 0);
+	if (!frames)
+		return -1;
+	index = fopen(index_path, "w");
+	if (!index) {
+		perror("Error opening index");
+		discard_output_file(frames_path, frames, count * size);
+		return -1;
+	}
+	fprintf(index, "# frame offset size capture_ms download_ms\n");
+
+	printf("Capturing %d %s frames of %d bytes...\n", count,
+	       fp_capture_type_names[capture_type], size);
+	progress_start(&progress, "Capturing", count * size);
+	start = capture_start = time_now();
+	rv = fp_capture_start(capture_type);
+	for (i = 0; rv >= 0 && i < count; i++) {
+		rv = fp_capture_wait();
+		if (rv < 0)
+			break;
+		captured = time_now();
+		frame_time = captured - capture_start;
+		capture_time += frame_time;
+
+		rv = fp_download(FP_FRAME_INDEX_RAW_IMAGE
+					 << FP_FRAME_INDEX_SHIFT,
+				 frames + i * size, size, &stats);
+		if (rv < 0) {
+			fprintf(stderr, "Failed to download frame %d\n", i);
+			break;
+		}
+		downloaded = time_now();
+
+		/* Get the sensor going on the next frame first */
+		if (i + 1 < count) {
+			capture_start = downloaded;
+			rv = fp_capture_start(capture_type);
+		}
+
+		fprintf(index, "%d %d %d %.3f %.3f\n", i, i * size, size,
+			frame_time * 1000,
+			(downloaded - captured) * 1000);
+		progress_update(&progress, (i + 1) * size);
+	}
+	elapsed = time_now() - start;
+	progress_end(&progress);
+
+	if (fclose(index) && rv >= 0)
+		rv = -1;
+	if (unmap_output_file(frames_path, frames, count * size) && rv >= 0)
+		rv = -1;
+
+	if (i) {
+		printf("Captured %d frames in %.2f s, %.2f frames/s, "
+		       "%.1f ms per capture\n",
+		       i, elapsed, i / elapsed, capture_time * 1000 / i);
+		printf("Chunk latency min %.2f ms, avg %.2f ms, max %.2f ms "
+		       "over %d chunks\n",
+		       stats.min * 1000, stats.sum * 1000 / stats.count,
+		       stats.max * 1000, stats.count);
+	}
+	return rv < 0 ? rv : 0;
+}
+
 int cmd_fp_frame(int argc, char *argv[])
 {
 	struct ec_response_fp_info r;
 	int idx = (argc == 2 && !strcasecmp(argv[1], "raw")) ?
 			  FP_FRAME_INDEX_RAW_IMAGE :
 			  FP_FRAME_INDEX_SIMPLE_IMAGE;
-	uint8_t *buffer = (uint8_t *)(fp_download_frame(&r, idx));
-	uint8_t *ptr = buffer;
+	uint8_t *buffer;
+	uint8_t *ptr;
 	int x, y;
 
+	if (argc > 1 && !strcmp(argv[1], "burst"))
+		return fp_frame_burst(argc - 1, argv + 1);
+
+	buffer = (uint8_t *)(fp_download_frame(&r, idx));
+	ptr = buffer;
 	if (!buffer) {
 		fprintf(stderr, "Failed to get FP sensor frame\n");
 		return -1;
@@ -2582,26 +3034,264 @@ frame_done:
 	return 0;
 }
 
-int cmd_fp_template(int argc, char *argv[])
+/*
+ * Upload a template in ec_max_outsize chunks, each built in place in the
+ * command buffer, and commit it with the last one.
+ */
+static int fp_upload_template(const uint8_t *buf, int size)
 {
-	struct ec_response_fp_info r;
-	struct ec_params_fp_template *p =
-		(struct ec_params_fp_template *)(ec_outbuf);
 	/* TODO(b/78544921): removing 32 bits is a workaround for the MCU bug */
 	int max_chunk = ec_max_outsize -
 			offsetof(struct ec_params_fp_template, data) - 4;
+	struct ec_params_fp_template *p =
+		(struct ec_params_fp_template *)ec_command_buffer(
+			ec_max_outsize);
+	uint32_t offset = 0;
+	int rv = 0;
+
+	if (!p)
+		return -1;
+
+	while (size) {
+		uint32_t tlen = MIN(max_chunk, size);
+
+		p->offset = offset;
+		p->size = tlen;
+		size -= tlen;
+		if (!size)
+			p->size |= FP_TEMPLATE_COMMIT;
+		memcpy(p->data, buf + offset, tlen);
+		rv = ec_command(EC_CMD_FP_TEMPLATE, 0, p,
+				tlen + offsetof(struct ec_params_fp_template,
+						data),
+				NULL, 0);
+		if (rv < 0)
+			return rv;
+		offset += tlen;
+	}
+
+	return 0;
+}
+
+/*
+ * A template backup is a directory holding templateN.bin for each enrolled
+ * finger and a manifest: a header line with the template version, size and
+ * count, then the index and CRC-32 of each template.  The CRCs let restore
+ * check the files before anything is sent.
+ */
+#define FP_TEMPLATE_MANIFEST "manifest.txt"
+#define FP_TEMPLATE_MAGIC "ectool-fp-templates"
+
+static int fp_template_info(struct ec_response_fp_info *info)
+{
+	int rv;
+
+	/* templates not supported in command v0 */
+	if (!ec_cmd_version_supported(EC_CMD_FP_INFO, 1)) {
+		fprintf(stderr, "FPMCU does not support templates\n");
+		return -1;
+	}
+
+	rv = ec_command(EC_CMD_FP_INFO, 1, NULL, 0, info, sizeof(*info));
+	return rv < 0 ? rv : 0;
+}
+
+static uint32_t fp_template_crc(const uint8_t *buf, int size)
+{
+	uint32_t crc;
+
+	crc32_ctx_init(&crc);
+	crc32_ctx_hash(&crc, buf, size);
+	return crc32_ctx_result(&crc);
+}
+
+static int fp_template_backup(const char *dir)
+{
+	struct ec_response_fp_info info;
+	struct fp_chunk_stats stats = { 0 };
+	char path[256];
+	double start;
+	uint8_t *buf;
+	FILE *manifest;
+	int i, rv;
+
+	rv = fp_template_info(&info);
+	if (rv < 0)
+		return rv;
+
+	snprintf(path, sizeof(path), "%s/" FP_TEMPLATE_MANIFEST, dir);
+	manifest = fopen(path, "w");
+	if (!manifest) {
+		perror("Error opening manifest");
+		return -1;
+	}
+	fprintf(manifest, FP_TEMPLATE_MAGIC " %u %u %u\n",
+		info.template_version, info.template_size, info.template_valid);
+
+	start = time_now();
+	for (i = 0; i < info.template_valid; i++) {
+		snprintf(path, sizeof(path), "%s/template%d.bin", dir, i);
+		buf = map_output_file(path, info.template_size, 0);
+		if (!buf) {
+			rv = -1;
+			break;
+		}
+		rv = fp_download((uint32_t)(i + FP_FRAME_INDEX_TEMPLATE)
+					 << FP_FRAME_INDEX_SHIFT,
+				 buf, info.template_size, &stats);
+		if (rv >= 0)
+			fprintf(manifest, "%d %08x\n", i,
+				fp_template_crc(buf, info.template_size));
+		if (rv < 0)
+			discard_output_file(path, buf, info.template_size);
+		else if (unmap_output_file(path, buf, info.template_size))
+			rv = -1;
+		if (rv < 0) {
+			fprintf(stderr, "Failed to back up FP template %d\n",
+				i);
+			break;
+		}
+	}
+
+	if (fclose(manifest) && rv >= 0)
+		rv = -1;
+	if (rv < 0)
+		return rv;
+
+	printf("Backed up %d templates of %u bytes in %.2f s", i,
+	       info.template_size, time_now() - start);
+	if (stats.count)
+		printf(", %d chunks, avg %.2f ms", stats.count,
+		       stats.sum * 1000 / stats.count);
+	printf("\n");
+	return 0;
+}
+
+static int fp_template_restore(const char *dir)
+{
+	struct ec_response_fp_info info;
+	unsigned int version, size, count;
+	char path[256], magic[32];
+	const uint8_t **images;
+	FILE *manifest;
+	uint32_t crc;
+	double start;
+	int i, n, valid, file_size;
+	int rv;
+
+	rv = fp_template_info(&info);
+	if (rv < 0)
+		return rv;
+
+	snprintf(path, sizeof(path), "%s/" FP_TEMPLATE_MANIFEST, dir);
+	manifest = fopen(path, "r");
+	if (!manifest) {
+		perror("Error opening manifest");
+		return -1;
+	}
+	if (fscanf(manifest, "%31s %u %u %u", magic, &version, &size,
+		   &count) != 4 ||
+	    strcmp(magic, FP_TEMPLATE_MAGIC)) {
+		fprintf(stderr, "%s is not a template manifest\n", path);
+		fclose(manifest);
+		return -1;
+	}
+	if (version != info.template_version || size != info.template_size) {
+		fprintf(stderr,
+			"Backup has version %u templates of %u bytes, "
+			"FPMCU wants version %u, %u bytes\n",
+			version, size, info.template_version,
+			info.template_size);
+		fclose(manifest);
+		return -1;
+	}
+	if (info.template_valid + count > info.template_max) {
+		fprintf(stderr, "No room for %u templates (%d of %d used)\n",
+			count, info.template_valid, info.template_max);
+		fclose(manifest);
+		return -1;
+	}
+
+	/* Check every file before sending any */
+	images = (const uint8_t **)calloc(count, sizeof(*images));
+	if (!images) {
+		fclose(manifest);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (fscanf(manifest, "%d %x", &n, &crc) != 2) {
+			fprintf(stderr, "Manifest is truncated\n");
+			rv = -1;
+			break;
+		}
+		snprintf(path, sizeof(path), "%s/template%d.bin", dir, n);
+		images[i] = map_file(path, &file_size);
+		if (!images[i]) {
+			rv = -1;
+			break;
+		}
+		if (file_size != size ||
+		    fp_template_crc(images[i], file_size) != crc) {
+			fprintf(stderr, "%s is corrupt\n", path);
+			unmap_file(images[i], file_size);
+			images[i] = NULL;
+			rv = -1;
+			break;
+		}
+	}
+	fclose(manifest);
+
+	valid = info.template_valid;
+	start = time_now();
+	for (i = 0; rv >= 0 && i < count; i++) {
+		rv = fp_upload_template(images[i], size);
+		if (rv < 0)
+			fprintf(stderr, "Failed to restore FP template %d\n", i);
+	}
+	for (i = 0; i < count && images[i]; i++)
+		unmap_file(images[i], size);
+	free(images);
+	if (rv < 0)
+		return rv;
+
+	/* Each commit should have taken up a slot */
+	rv = fp_template_info(&info);
+	if (rv < 0)
+		return rv;
+	if (info.template_valid != valid + count) {
+		fprintf(stderr, "FPMCU has %d templates, expected %d\n",
+			info.template_valid, valid + count);
+		return -1;
+	}
+
+	printf("Restored %u templates of %u bytes in %.2f s\n", count, size,
+	       time_now() - start);
+	return 0;
+}
+
+int cmd_fp_template(int argc, char *argv[])
+{
+	struct ec_response_fp_info r;
 	int idx = -1;
 	char *e;
 	int size;
 	char *buffer = NULL;
-	uint32_t offset = 0;
+	const uint8_t *image;
 	int rv = 0;
 
 	if (argc < 2) {
-		fprintf(stderr, "Usage: %s [<infile>|<index>]\n", argv[0]);
+		fprintf(stderr,
+			"Usage: %s [<infile>|<index>|backup <dir>|"
+			"restore <dir>]\n",
+			argv[0]);
 		return -1;
 	}
 
+	if (argc > 2 && !strcmp(argv[1], "backup"))
+		return fp_template_backup(argv[2]);
+	if (argc > 2 && !strcmp(argv[1], "restore"))
+		return fp_template_restore(argv[2]);
+
 	idx = strtol(argv[1], &e, 0);
 	if (!(e && *e)) {
 		buffer = (char *)(fp_download_frame(&r, idx + 1));
@@ -2614,34 +3304,16 @@ int cmd_fp_template(int argc, char *argv[])
 		return 0;
 	}
 	/* not an index, is it a filename ? */
-	buffer = read_file(argv[1], &size);
-	if (!buffer) {
+	image = map_file(argv[1], &size);
+	if (!image) {
 		fprintf(stderr, "Invalid parameter: %s\n", argv[1]);
 		return -1;
 	}
 	printf("sending template from: %s (%d bytes)\n", argv[1], size);
-	while (size) {
-		uint32_t tlen = MIN(max_chunk, size);
-
-		p->offset = offset;
-		p->size = tlen;
-		size -= tlen;
-		if (!size)
-			p->size |= FP_TEMPLATE_COMMIT;
-		memcpy(p->data, buffer + offset, tlen);
-		rv = ec_command(EC_CMD_FP_TEMPLATE, 0, p,
-				tlen + offsetof(struct ec_params_fp_template,
-						data),
-				NULL, 0);
-		if (rv < 0)
-			break;
-		offset += tlen;
-	}
+	rv = fp_upload_template(image, size);
 	if (rv < 0)
 		fprintf(stderr, "Failed with %d\n", rv);
-	else
-		rv = 0;
-	free(buffer);
+	unmap_file(image, size);
 	return rv;
 }
 
@@ -2785,21 +3457,80 @@ int cmd_pd_device_info(int argc, char *argv[])
 	return rv;
 }
 
+/*
+ * Most data per EC_CMD_USB_PD_FW_UPDATE write by default.  Bigger writes
+ * keep the EC busier between throttles (crosbug.com/p/33905), so filling
+ * writes to what the protocol allows is only done when asked for.
+ */
+#define PD_FW_WRITE_MAX 96
+/* Signature at the end of a PD device's RW image, left out of its hash */
+#define PD_RW_SIG_SIZE 256
+/* How long a PD device may take to report its hash after rebooting */
+#define PD_RW_HASH_TIMEOUT_MS 10000
+#define PD_RW_HASH_POLL_MS 250
+
+/*
+ * Once a PD device has rebooted into a new RW image, wait for it to report
+ * the hash of its RW section and check it against the image.  Until the
+ * device is rediscovered the EC may still report the old hash, so keep
+ * asking until it matches or the time is up.
+ */
+static int pd_verify_rw_hash(int port, const uint8_t *image, int size)
+{
+	struct ec_params_usb_pd_info_request p;
+	struct ec_params_usb_pd_rw_hash_entry r;
+	uint8_t want[2][SHA256_DIGEST_SIZE];
+	struct sha256_ctx ctx;
+	int waited, rv, i;
+
+	/* The hash is over the section less its signature, if it has one */
+	SHA256_init(&ctx);
+	SHA256_update(&ctx, image, MAX(size - PD_RW_SIG_SIZE, 0));
+	memcpy(want[0], SHA256_final(&ctx), sizeof(want[0]));
+	SHA256_init(&ctx);
+	SHA256_update(&ctx, image, size);
+	memcpy(want[1], SHA256_final(&ctx), sizeof(want[1]));
+
+	memset(&r, 0, sizeof(r));
+	p.port = port;
+	for (waited = 0; waited < PD_RW_HASH_TIMEOUT_MS;
+	     waited += PD_RW_HASH_POLL_MS) {
+		usleep(PD_RW_HASH_POLL_MS * 1000);
+		rv = ec_command(EC_CMD_USB_PD_DEV_INFO, 0, &p, sizeof(p), &r,
+				sizeof(r));
+		if (rv < 0 || !r.dev_id || r.current_image != EC_IMAGE_RW)
+			continue;
+		if (!memcmp(r.dev_rw_hash, want[0], PD_RW_HASH_SIZE) ||
+		    !memcmp(r.dev_rw_hash, want[1], PD_RW_HASH_SIZE))
+			return 0;
+	}
+
+	fprintf(stderr, "Warning: RW hash mismatch, device reports");
+	for (i = 0; i < PD_RW_HASH_SIZE; i++)
+		fprintf(stderr, "%s%02x", i % 4 ? "" : " ", r.dev_rw_hash[i]);
+	fprintf(stderr, "\n");
+	return -1;
+}
+
 int cmd_flash_pd(int argc, char *argv[])
 {
 	struct ec_params_usb_pd_fw_update *p =
 		(struct ec_params_usb_pd_fw_update *)ec_outbuf;
+	struct progress progress;
 	int i, dev_id, port;
-	int rv, fsize, step = 96;
+	int rv, fsize, step;
 	char *e;
-	char *buf;
+	const uint8_t *buf;
 	char *data = (char *)p + sizeof(*p);
+	bool fill;
 
-	if (argc < 4) {
-		fprintf(stderr, "Usage: %s <dev_id> <port> <filename>\n",
+	if (argc < 4 || (argc > 4 && strcmp(argv[4], "max"))) {
+		fprintf(stderr,
+			"Usage: %s <dev_id> <port> <filename> [max]\n",
 			argv[0]);
 		return -1;
 	}
+	fill = argc > 4;
 
 	dev_id = strtol(argv[1], &e, 0);
 	if (e && *e) {
@@ -2818,8 +3549,21 @@ int cmd_flash_pd(int argc, char *argv[])
 		return -1;
 	}
 
-	/* Read the input file */
-	buf = read_file(argv[3], &fsize);
+	/*
+	 * Writes are whole words, which the EC splits into VDMs for the
+	 * device: PD_FW_WRITE_MAX bytes unless asked to fill each to what
+	 * the protocol allows.
+	 */
+	step = (ec_max_outsize - (int)sizeof(*p)) & ~3;
+	if (!fill)
+		step = MIN(step, PD_FW_WRITE_MAX);
+	if (step <= 0) {
+		fprintf(stderr, "No room for data in a write\n");
+		return -1;
+	}
+
+	/* Map the input file */
+	buf = map_file(argv[3], &fsize);
 	if (!buf)
 		return -1;
 
@@ -2871,19 +3615,23 @@ int cmd_flash_pd(int argc, char *argv[])
 		goto pd_flash_error;
 
 	/* Write RW flash */
-	fprintf(stderr, "Writing RW flash\n");
+	fprintf(stderr, "Writing RW flash, %d bytes per write\n", step);
 	p->dev_id = dev_id;
 	p->port = port;
 	p->cmd = USB_PD_FW_FLASH_WRITE;
 	p->size = step;
 
+	progress_start(&progress, "Writing", fsize);
 	for (i = 0; i < fsize; i += step) {
 		p->size = MIN(fsize - i, step);
 		memcpy(data, buf + i, p->size);
 		rv = ec_command(EC_CMD_USB_PD_FW_UPDATE, 0, p,
 				p->size + sizeof(*p), NULL, 0);
-		if (rv < 0)
+		if (rv < 0) {
+			progress_end(&progress);
 			goto pd_flash_error;
+		}
+		progress_update(&progress, i + p->size);
 
 		/*
 		 * TODO(crosbug.com/p/33905) throttle so EC doesn't watchdog on
@@ -2891,6 +3639,7 @@ int cmd_flash_pd(int argc, char *argv[])
 		 */
 		usleep(10000);
 	}
+	progress_end(&progress);
 
 	/* 100msec to guarantee writes finish */
 	usleep(100000);
@@ -2905,12 +3654,19 @@ int cmd_flash_pd(int argc, char *argv[])
 	if (rv < 0)
 		goto pd_flash_error;
 
-	free(buf);
-	fprintf(stderr, "Complete\n");
+	/*
+	 * Check the device is running what was written.  The write itself
+	 * succeeded, so a mismatch is only a warning.
+	 */
+	fprintf(stderr, "Verifying RW hash\n");
+	rv = pd_verify_rw_hash(port, buf, fsize);
+
+	unmap_file(buf, fsize);
+	fprintf(stderr, rv ? "Complete, RW not verified\n" : "Complete\n");
 	return 0;
 
 pd_flash_error:
-	free(buf);
+	unmap_file(buf, fsize);
 	fprintf(stderr, "PD flash error\n");
 	return -1;
 }
@@ -2995,6 +3751,8 @@ int cmd_pd_get_amode(int argc, char *argv[])
 #if (defined(__i386__) || defined(__x86_64__)) && !defined(_WIN32)
 #include <sys/io.h>
 
+#include "comm-lpc.h"
+
 int cmd_serial_test(int argc, char *argv[])
 {
 	const char *c = "COM2 sample serial output from host!\r\n";
@@ -3022,6 +3780,97 @@ int cmd_port_80_flood(int argc, char *argv[])
 		outb(i, 0x80);
 	return 0;
 }
+
+static int lpc_latency_compare(const void *a, const void *b)
+{
+	int64_t da = *(const int64_t *)a;
+	int64_t db = *(const int64_t *)b;
+
+	return da < db ? -1 : da > db;
+}
+
+/* Time 'count' runs of a command and print min/p50/p99/max/mean in us */
+static int lpc_latency_run(const char *engine, const char *name, int count,
+			   int command, const void *outdata, int outsize,
+			   int insize, int64_t *t)
+{
+	struct timespec start, end;
+	int64_t total = 0;
+	int i, rv;
+
+	for (i = 0; i < count; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		rv = ec_command(command, 0, outdata, outsize, ec_inbuf, insize);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (rv < 0)
+			return rv;
+		t[i] = (end.tv_sec - start.tv_sec) * 1000000000LL +
+		       (end.tv_nsec - start.tv_nsec);
+		total += t[i];
+	}
+
+	qsort(t, count, sizeof(*t), lpc_latency_compare);
+	printf("%-6s %-16s %8.1f %8.1f %8.1f %8.1f %8.1f\n", engine, name,
+	       t[0] / 1000.0, t[count / 2] / 1000.0,
+	       t[(int64_t)count * 99 / 100] / 1000.0, t[count - 1] / 1000.0,
+	       total / 1000.0 / count);
+	return 0;
+}
+
+int cmd_lpc_latency(int argc, char *argv[])
+{
+	struct ec_params_hello hello = { .in_data = 0xa0b0c0d0 };
+	struct ec_params_flash_read fr;
+	int count = 1000;
+	int64_t *t;
+	char *e;
+	int fast, prev, rv = 0;
+
+	if (argc > 1) {
+		count = strtol(argv[1], &e, 0);
+		if ((e && *e) || count <= 0) {
+			fprintf(stderr, "Usage: %s [count]\n", argv[0]);
+			return -1;
+		}
+	}
+
+	prev = comm_lpc_get_engine();
+	if (comm_lpc_set_engine(0)) {
+		fprintf(stderr, "Needs the LPC transport, protocol v3 "
+				"(use --interface=lpc)\n");
+		return -1;
+	}
+
+	t = (int64_t *)malloc(count * sizeof(*t));
+	if (!t)
+		return -1;
+
+	fr.offset = 0;
+	fr.size = ec_max_insize;
+
+	printf("Latency of %d commands, in us\n", count);
+	printf("engine command               min      p50      p99      max"
+	       "     mean\n");
+	for (fast = 0; fast <= 1 && !rv; fast++) {
+		const char *engine = fast ? "fast" : "byte";
+
+		comm_lpc_set_engine(fast);
+		rv = lpc_latency_run(engine, "hello", count, EC_CMD_HELLO,
+				     &hello, sizeof(hello),
+				     sizeof(struct ec_response_hello), t);
+		if (!rv)
+			rv = lpc_latency_run(engine, "flashread (max)", count,
+					     EC_CMD_FLASH_READ, &fr,
+					     sizeof(fr), fr.size, t);
+	}
+
+	comm_lpc_set_engine(prev);
+	free(t);
+
+	if (rv < 0)
+		fprintf(stderr, "Command failed: %d\n", rv);
+	return rv;
+}
 #else
 int cmd_serial_test(int argc, char *argv[])
 {
@@ -3034,6 +3883,12 @@ int cmd_port_80_flood(int argc, char *argv[])
 	printf("x86 specific command\n");
 	return -1;
 }
+
+int cmd_lpc_latency(int argc, char *argv[])
+{
+	printf("x86 specific command\n");
+	return -1;
+}
 #endif
 
 static void cmd_smart_discharge_usage(const char *command)
@@ -3113,7 +3968,7 @@ int cmd_smart_discharge(int argc, char *argv[])
  * This boolean variable and handler are used for
  * catching signals that translate into a quit/shutdown
  * of a runtime loop.
- * This is used in cmd_stress_test.
+ * This is used in cmd_stress_test and tpframeget stream.
  */
 static bool sig_quit;
 static void sig_quit_handler(int sig)
@@ -5367,54 +6222,628 @@ static const struct {
 };
 BUILD_ASSERT(ARRAY_SIZE(ms_command_sizes) == MOTIONSENSE_NUM_CMDS);
 
-#undef ST_CMD_SIZE
-#undef ST_PRM_SIZE
-#undef ST_RSP_SIZE
-#undef ST_BOTH_SIZES
+#undef ST_CMD_SIZE
+#undef ST_PRM_SIZE
+#undef ST_RSP_SIZE
+#undef ST_BOTH_SIZES
+
+static int ms_help(const char *cmd)
+{
+	printf("Usage:\n");
+	printf("  %s                              - dump all motion data\n",
+	       cmd);
+	printf("  %s active                       - print active flag\n", cmd);
+	printf("  %s info NUM                     - print sensor info\n", cmd);
+	printf("  %s ec_rate NUM [RATE_MS]        - set/get sample rate\n",
+	       cmd);
+	printf("  %s odr NUM [ODR [ROUNDUP]]      - set/get sensor ODR\n", cmd);
+	printf("  %s range NUM [RANGE [ROUNDUP]]  - set/get sensor range\n",
+	       cmd);
+	printf("  %s offset NUM [-- X Y Z [TEMP]] - set/get sensor offset\n",
+	       cmd);
+	printf("  %s kb_wake NUM                  - set/get KB wake ang\n",
+	       cmd);
+	printf("  %s fifo_info                    - print fifo info\n", cmd);
+	printf("  %s fifo_int_enable [0/1]        - enable/disable/get fifo "
+	       "interrupt status\n",
+	       cmd);
+	printf("  %s fifo_read MAX_DATA           - read fifo data\n", cmd);
+	printf("  %s fifo_flush NUM               - trigger fifo interrupt\n",
+	       cmd);
+	printf("  %s list_activities              - list supported "
+	       "activities\n",
+	       cmd);
+	printf("  %s set_activity ACT EN          - enable/disable activity\n",
+	       cmd);
+	printf("  %s get_activity ACT             - get activity status\n",
+	       cmd);
+	printf("  %s lid_angle                    - print lid angle\n", cmd);
+	printf("  %s spoof -- NUM [0/1] [X Y Z]   - enable/disable spoofing\n",
+	       cmd);
+	printf("  %s spoof -- NUM activity ACT [0/1] [STATE] - enable/disable "
+	       "activity spoofing\n",
+	       cmd);
+	printf("  %s tablet_mode_angle ANG HYS    - set/get tablet mode "
+	       "angle\n",
+	       cmd);
+	printf("  %s calibrate NUM                - run sensor calibration\n",
+	       cmd);
+	printf("  %s stream DIR [SECS [SAMPLES]]  - record the fifo to a ring "
+	       "file per sensor\n",
+	       cmd);
+	printf("  %s bench NUM [SECS [ODR,... [RATE_MS,...]]] - measure fifo "
+	       "latency\n",
+	       cmd);
+
+	return 0;
+}
+
+/*
+ * motionsense stream keeps the last SAMPLES samples of each sensor in
+ * DIR/sensorN.ring, in host byte order: a struct ms_ring_header, then
+ * 'capacity' struct ms_ring_record.  The file is mapped shared, so it can
+ * be read while the stream runs.
+ */
+#define MS_RING_MAGIC 0x4752534d /* "MSRG" */
+#define MS_RING_VERSION 1
+#define MS_RING_DEFAULT_SAMPLES 4096
+
+struct ms_ring_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sensor_num;
+	uint32_t record_size;
+	uint32_t capacity;
+	uint32_t reserved;
+	/* Samples written; the next goes in record head % capacity */
+	uint64_t head;
+	/* Samples the EC lost, per MOTIONSENSE_CMD_FIFO_INFO */
+	uint64_t lost;
+};
+
+struct ms_ring_record {
+	/* When the sample reached the host, from the start of the stream */
+	uint64_t host_us;
+	/* When the EC took it, from its timestamp entry */
+	uint32_t ec_timestamp;
+	uint16_t flags;
+	int16_t data[3];
+	uint32_t reserved;
+};
+
+/* How long to wait for a FIFO event before checking anyway */
+#define MS_STREAM_EVENT_MS 1000
+/* Between FIFO reads on transports without MKBP events */
+#define MS_STREAM_POLL_US 10000
+
+/*
+ * Read, and so reset, the lost sample counters of the first sensor_count
+ * sensors.  Also returns the EC time, if 'timestamp' isn't NULL.
+ */
+static int ms_fifo_info(uint16_t *lost, int sensor_count, uint32_t *timestamp)
+{
+	struct ec_params_motion_sense param;
+	uint8_t resp_buffer[ms_command_sizes[MOTIONSENSE_CMD_FIFO_INFO].insize];
+	struct ec_response_motion_sense *resp =
+		(struct ec_response_motion_sense *)resp_buffer;
+	int rv;
+
+	param.cmd = MOTIONSENSE_CMD_FIFO_INFO;
+	rv = ec_command(EC_CMD_MOTION_SENSE_CMD, 2, &param,
+			ms_command_sizes[param.cmd].outsize, resp,
+			ms_command_sizes[param.cmd].insize);
+	if (rv < 0)
+		return rv;
+	memcpy(lost, resp->fifo_info.lost, sensor_count * sizeof(*lost));
+	if (timestamp)
+		*timestamp = resp->fifo_info.timestamp;
+	return 0;
+}
+
+static int ms_fifo_int_enable(int enable)
+{
+	struct ec_params_motion_sense param;
+	struct ec_response_motion_sense resp;
+	int rv;
+
+	param.cmd = MOTIONSENSE_CMD_FIFO_INT_ENABLE;
+	param.fifo_int_enable.enable = enable;
+	rv = ec_command(EC_CMD_MOTION_SENSE_CMD, 2, &param,
+			ms_command_sizes[param.cmd].outsize, &resp,
+			ms_command_sizes[param.cmd].insize);
+	return rv < 0 ? rv : resp.fifo_int_enable.ret;
+}
+
+/*
+ * Drain the FIFO in reads as large as the transport allows.  Calls
+ * 'sample' for each data entry with the timestamp of the entry before it,
+ * and the host time the read returned.  Adds the number of reads to
+ * 'reads', if not NULL.
+ *
+ * @return the number of entries read, or negative if error.
+ */
+static int ms_fifo_drain(struct ec_response_motion_sense_fifo_data *fifo,
+			 uint32_t *timestamps, int sensor_count,
+			 void (*sample)(void *ctx, double host,
+					uint32_t timestamp,
+					const struct ec_response_motion_sensor_data
+						*v),
+			 void *ctx, int *reads)
+{
+	struct ec_params_motion_sense param;
+	struct ec_response_motion_sensor_data *v;
+	int max = (ec_max_insize - sizeof(*fifo)) / sizeof(fifo->data[0]);
+	int i, rv, total = 0;
+	double now;
+
+	param.cmd = MOTIONSENSE_CMD_FIFO_READ;
+	param.fifo_read.max_data_vector = max;
+	do {
+		rv = ec_command(EC_CMD_MOTION_SENSE_CMD, 2, &param,
+				ms_command_sizes[param.cmd].outsize, fifo,
+				ec_max_insize);
+		if (rv < 0)
+			return rv;
+		now = time_now();
+		if (reads)
+			(*reads)++;
+		for (i = 0; i < fifo->number_data; i++) {
+			v = &fifo->data[i];
+			if (v->sensor_num >= sensor_count)
+				continue;
+			if (v->flags & MOTIONSENSE_SENSOR_FLAG_TIMESTAMP)
+				timestamps[v->sensor_num] = v->timestamp;
+			else
+				sample(ctx, now, timestamps[v->sensor_num], v);
+		}
+		total += fifo->number_data;
+	} while (fifo->number_data == max);
+
+	return total;
+}
+
+struct ms_stream {
+	double start;
+	struct ms_ring_header *rings[ECTOOL_MAX_SENSOR];
+	uint64_t samples[ECTOOL_MAX_SENSOR];
+};
+
+static void ms_stream_sample(void *ctx, double host, uint32_t timestamp,
+			     const struct ec_response_motion_sensor_data *v)
+{
+	struct ms_stream *stream = (struct ms_stream *)ctx;
+	struct ms_ring_header *ring = stream->rings[v->sensor_num];
+	struct ms_ring_record *r =
+		(struct ms_ring_record *)(ring + 1) +
+		ring->head % ring->capacity;
+
+	r->host_us = (host - stream->start) * 1000000;
+	r->ec_timestamp = timestamp;
+	r->flags = v->flags;
+	memcpy(r->data, v->data, sizeof(r->data));
+	r->reserved = 0;
+	ring->head++;
+	stream->samples[v->sensor_num]++;
+}
+
+static int ms_stream(int argc, char **argv)
+{
+	struct ec_params_motion_sense param;
+	struct ec_response_motion_sense dump;
+	struct ec_response_get_next_event_v1 event;
+	struct ec_response_motion_sense_fifo_data *fifo = NULL;
+	struct ms_stream stream = {};
+	uint32_t timestamps[ECTOOL_MAX_SENSOR] = {};
+	uint16_t lost[ECTOOL_MAX_SENSOR];
+	char path[256];
+	double seconds = 0, elapsed;
+	int capacity = MS_RING_DEFAULT_SAMPLES;
+	int ring_size, sensor_count, int_enable = -1;
+	uint64_t total = 0;
+	int wakeups = 0;
+	char *e;
+	int i, rv;
+
+	seconds = argc > 1 ? strtod(argv[1], &e) : 0;
+	if (argc > 1 && ((e && *e) || seconds < 0)) {
+		fprintf(stderr, "Bad %s arg.\n", argv[1]);
+		return -1;
+	}
+	if (argc > 2) {
+		capacity = strtol(argv[2], &e, 0);
+		if ((e && *e) || capacity <= 0 ||
+		    capacity > (INT32_MAX - sizeof(struct ms_ring_header)) /
+				       sizeof(struct ms_ring_record)) {
+			fprintf(stderr, "Bad %s arg.\n", argv[2]);
+			return -1;
+		}
+	}
+	ring_size = sizeof(struct ms_ring_header) +
+		    capacity * sizeof(struct ms_ring_record);
+
+	param.cmd = MOTIONSENSE_CMD_DUMP;
+	param.dump.max_sensor_count = 0;
+	rv = ec_command(EC_CMD_MOTION_SENSE_CMD, 1, &param,
+			ms_command_sizes[param.cmd].outsize, &dump,
+			sizeof(dump));
+	if (rv < 0)
+		return rv;
+	sensor_count = MIN(dump.dump.sensor_count, ECTOOL_MAX_SENSOR);
+
+	fifo = (struct ec_response_motion_sense_fifo_data *)malloc(
+		ec_max_insize);
+	if (!fifo) {
+		fprintf(stderr, "Couldn't allocate memory.\n");
+		return -1;
+	}
+
+	for (i = 0; i < sensor_count; i++) {
+		snprintf(path, sizeof(path), "%s/sensor%d.ring", argv[0], i);
+		stream.rings[i] =
+			(struct ms_ring_header *)map_output_file(
+				path, ring_size, MAP_OUTPUT_LIVE);
+		if (!stream.rings[i]) {
+			rv = -1;
+			goto out;
+		}
+		stream.rings[i]->magic = MS_RING_MAGIC;
+		stream.rings[i]->version = MS_RING_VERSION;
+		stream.rings[i]->sensor_num = i;
+		stream.rings[i]->record_size = sizeof(struct ms_ring_record);
+		stream.rings[i]->capacity = capacity;
+	}
+
+	/* Start from an empty FIFO and lost counters */
+	int_enable = ms_fifo_int_enable(EC_MOTION_SENSE_NO_VALUE);
+	rv = int_enable;
+	if (rv >= 0)
+		rv = ms_fifo_int_enable(1);
+	if (rv >= 0)
+		rv = ms_fifo_drain(fifo, timestamps, 0, ms_stream_sample,
+				   &stream, NULL);
+	if (rv >= 0)
+		rv = ms_fifo_info(lost, sensor_count, NULL);
+	if (rv < 0) {
+		fprintf(stderr, "Failed to set up the sensor fifo.\n");
+		goto out;
+	}
+
+	printf("Streaming %d sensors to %s, Ctrl-C to stop...\n",
+	       sensor_count, argv[0]);
+	sig_quit = false;
+	signal(SIGINT, sig_quit_handler);
+	stream.start = time_now();
+	while (!sig_quit &&
+	       (!seconds || time_now() - stream.start < seconds)) {
+		if (!ec_pollevent ||
+		    ec_pollevent(1 << EC_MKBP_EVENT_SENSOR_FIFO, &event,
+				 sizeof(event), MS_STREAM_EVENT_MS) < 0)
+			usleep(MS_STREAM_POLL_US);
+		wakeups++;
+
+		rv = ms_fifo_drain(fifo, timestamps, sensor_count,
+				   ms_stream_sample, &stream, NULL);
+		if (rv < 0) {
+			fprintf(stderr, "Failed to read the sensor fifo.\n");
+			break;
+		}
+		rv = ms_fifo_info(lost, sensor_count, NULL);
+		if (rv < 0)
+			break;
+		for (i = 0; i < sensor_count; i++)
+			stream.rings[i]->lost += lost[i];
+	}
+	signal(SIGINT, SIG_DFL);
+	elapsed = time_now() - stream.start;
+
+	for (i = 0; i < sensor_count; i++) {
+		printf("Sensor %d: %" PRIu64 " samples, %.1f/s, %" PRIu64
+		       " lost\n",
+		       i, stream.samples[i], stream.samples[i] / elapsed,
+		       stream.rings[i]->lost);
+		total += stream.samples[i];
+	}
+	printf("%d wakeups in %.2f s, %.1f samples per wakeup\n", wakeups,
+	       elapsed, wakeups ? (double)total / wakeups : 0);
+
+out:
+	if (int_enable >= 0)
+		ms_fifo_int_enable(int_enable);
+	for (i = 0; i < sensor_count; i++) {
+		if (!stream.rings[i])
+			break;
+		snprintf(path, sizeof(path), "%s/sensor%d.ring", argv[0], i);
+		if (unmap_output_file(path, (uint8_t *)stream.rings[i],
+				      ring_size) &&
+		    rv >= 0)
+			rv = -1;
+	}
+	free(fifo);
+	return rv < 0 ? rv : 0;
+}
+
+/* Default motionsense bench sweep */
+static const int ms_bench_odrs[] = { 12500, 25000, 50000, 100000, 200000 };
+static const int ms_bench_rates[] = { 10, 20, 50, 100 };
+#define MS_BENCH_DEFAULT_SECS 2
+#define MS_BENCH_MAX_STEPS 16
+/* FIFO_INFO round trips to line up the EC and host clocks */
+#define MS_BENCH_SYNC_ROUNDS 8
+
+/*
+ * Set MOTIONSENSE_CMD_SENSOR_ODR or MOTIONSENSE_CMD_EC_RATE, or read it
+ * with EC_MOTION_SENSE_NO_VALUE.
+ *
+ * @return the value the EC settled on, or negative if error.
+ */
+static int ms_set_rate(int cmd, int sensor, int value)
+{
+	struct ec_params_motion_sense param;
+	struct ec_response_motion_sense resp;
+	int rv;
+
+	param.cmd = cmd;
+	param.sensor_odr.sensor_num = sensor;
+	param.sensor_odr.roundup = 1;
+	param.sensor_odr.data = value;
+	rv = ec_command(EC_CMD_MOTION_SENSE_CMD, 1, &param,
+			ms_command_sizes[param.cmd].outsize, &resp,
+			ms_command_sizes[param.cmd].insize);
+	return rv < 0 ? rv : resp.sensor_odr.ret;
+}
+
+static int ms_parse_list(const char *arg, int *list)
+{
+	char *e;
+	int n = 0;
+
+	do {
+		if (n == MS_BENCH_MAX_STEPS)
+			return -1;
+		list[n] = strtol(arg, &e, 0);
+		if (e == arg || list[n] < 0 || (*e && *e != ','))
+			return -1;
+		n++;
+		arg = e + 1;
+	} while (*e);
+
+	return n;
+}
+
+struct ms_bench {
+	int sensor;
+	/* A host time and the EC time at that moment */
+	double sync_host;
+	uint32_t sync_ec;
+	int samples;
+	double sum, sum_sq, max;
+};
+
+/*
+ * Find the EC time matching a host time, from the FIFO_INFO round trip
+ * which took least time, taking the EC to have answered halfway through.
+ */
+static int ms_bench_sync(struct ms_bench *bench, int sensor_count,
+			 uint16_t *lost)
+{
+	double start, end, best = -1;
+	uint32_t timestamp;
+	int i, rv;
+
+	for (i = 0; i < MS_BENCH_SYNC_ROUNDS; i++) {
+		start = time_now();
+		rv = ms_fifo_info(lost, sensor_count, &timestamp);
+		end = time_now();
+		if (rv < 0)
+			return rv;
+		if (best < 0 || end - start < best) {
+			best = end - start;
+			bench->sync_host = (start + end) / 2;
+			bench->sync_ec = timestamp;
+		}
+	}
+
+	return 0;
+}
+
+static void ms_bench_sample(void *ctx, double host, uint32_t timestamp,
+			    const struct ec_response_motion_sensor_data *v)
+{
+	struct ms_bench *bench = (struct ms_bench *)ctx;
+	double latency;
+
+	if (v->sensor_num != bench->sensor)
+		return;
+
+	/* The EC clock wraps every 71 minutes; samples are recent */
+	latency = host - bench->sync_host -
+		  (int32_t)(timestamp - bench->sync_ec) / 1000000.0;
+	bench->samples++;
+	bench->sum += latency;
+	bench->sum_sq += latency * latency;
+	if (bench->samples == 1 || latency > bench->max)
+		bench->max = latency;
+}
+
+/*
+ * Sweep the ODR and EC rate of one sensor, and for each setting measure
+ * how long samples take from the EC taking them to the host having them,
+ * how much that varies, and what reading them costs in host commands.
+ */
+static int ms_bench(int argc, char **argv)
+{
+	struct ec_params_motion_sense param;
+	struct ec_response_motion_sense dump;
+	struct ec_response_get_next_event_v1 event;
+	struct ec_response_motion_sense_fifo_data *fifo = NULL;
+	uint32_t timestamps[ECTOOL_MAX_SENSOR] = {};
+	uint16_t lost[ECTOOL_MAX_SENSOR];
+	int odrs[MS_BENCH_MAX_STEPS], rates[MS_BENCH_MAX_STEPS];
+	int num_odrs = ARRAY_SIZE(ms_bench_odrs);
+	int num_rates = ARRAY_SIZE(ms_bench_rates);
+	int sensor, sensor_count, old_odr, old_rate, int_enable = -1;
+	int odr, rate, cmds, total_lost, o, r;
+	double seconds = MS_BENCH_DEFAULT_SECS, start, cmd_time, t, mean, var;
+	struct ms_bench bench;
+	char *e;
+	int rv;
+
+	memcpy(odrs, ms_bench_odrs, sizeof(ms_bench_odrs));
+	memcpy(rates, ms_bench_rates, sizeof(ms_bench_rates));
+
+	sensor = strtol(argv[0], &e, 0);
+	if ((e && *e) || sensor < 0 || sensor >= ECTOOL_MAX_SENSOR) {
+		fprintf(stderr, "Bad %s arg.\n", argv[0]);
+		return -1;
+	}
+	if (argc > 1) {
+		seconds = strtod(argv[1], &e);
+		if ((e && *e) || seconds <= 0) {
+			fprintf(stderr, "Bad %s arg.\n", argv[1]);
+			return -1;
+		}
+	}
+	if (argc > 2 && (num_odrs = ms_parse_list(argv[2], odrs)) < 0) {
+		fprintf(stderr, "Bad %s arg.\n", argv[2]);
+		return -1;
+	}
+	if (argc > 3 && (num_rates = ms_parse_list(argv[3], rates)) < 0) {
+		fprintf(stderr, "Bad %s arg.\n", argv[3]);
+		return -1;
+	}
+
+	param.cmd = MOTIONSENSE_CMD_DUMP;
+	param.dump.max_sensor_count = 0;
+	rv = ec_command(EC_CMD_MOTION_SENSE_CMD, 1, &param,
+			ms_command_sizes[param.cmd].outsize, &dump,
+			sizeof(dump));
+	if (rv < 0)
+		return rv;
+	sensor_count = MIN(dump.dump.sensor_count, ECTOOL_MAX_SENSOR);
+	if (sensor >= sensor_count) {
+		fprintf(stderr, "No sensor %d.\n", sensor);
+		return -1;
+	}
+
+	old_odr = ms_set_rate(MOTIONSENSE_CMD_SENSOR_ODR, sensor,
+			      EC_MOTION_SENSE_NO_VALUE);
+	old_rate = ms_set_rate(MOTIONSENSE_CMD_EC_RATE, sensor,
+			       EC_MOTION_SENSE_NO_VALUE);
+	if (old_odr < 0 || old_rate < 0) {
+		fprintf(stderr, "Failed to read sensor %d rates.\n", sensor);
+		return -1;
+	}
 
-static int ms_help(const char *cmd)
-{
-	printf("Usage:\n");
-	printf("  %s                              - dump all motion data\n",
-	       cmd);
-	printf("  %s active                       - print active flag\n", cmd);
-	printf("  %s info NUM                     - print sensor info\n", cmd);
-	printf("  %s ec_rate NUM [RATE_MS]        - set/get sample rate\n",
-	       cmd);
-	printf("  %s odr NUM [ODR [ROUNDUP]]      - set/get sensor ODR\n", cmd);
-	printf("  %s range NUM [RANGE [ROUNDUP]]  - set/get sensor range\n",
-	       cmd);
-	printf("  %s offset NUM [-- X Y Z [TEMP]] - set/get sensor offset\n",
-	       cmd);
-	printf("  %s kb_wake NUM                  - set/get KB wake ang\n",
-	       cmd);
-	printf("  %s fifo_info                    - print fifo info\n", cmd);
-	printf("  %s fifo_int_enable [0/1]        - enable/disable/get fifo "
-	       "interrupt status\n",
-	       cmd);
-	printf("  %s fifo_read MAX_DATA           - read fifo data\n", cmd);
-	printf("  %s fifo_flush NUM               - trigger fifo interrupt\n",
-	       cmd);
-	printf("  %s list_activities              - list supported "
-	       "activities\n",
-	       cmd);
-	printf("  %s set_activity ACT EN          - enable/disable activity\n",
-	       cmd);
-	printf("  %s get_activity ACT             - get activity status\n",
-	       cmd);
-	printf("  %s lid_angle                    - print lid angle\n", cmd);
-	printf("  %s spoof -- NUM [0/1] [X Y Z]   - enable/disable spoofing\n",
-	       cmd);
-	printf("  %s spoof -- NUM activity ACT [0/1] [STATE] - enable/disable "
-	       "activity spoofing\n",
-	       cmd);
-	printf("  %s tablet_mode_angle ANG HYS    - set/get tablet mode "
-	       "angle\n",
-	       cmd);
-	printf("  %s calibrate NUM                - run sensor calibration\n",
-	       cmd);
+	fifo = (struct ec_response_motion_sense_fifo_data *)malloc(
+		ec_max_insize);
+	if (!fifo) {
+		fprintf(stderr, "Couldn't allocate memory.\n");
+		return -1;
+	}
+	int_enable = ms_fifo_int_enable(EC_MOTION_SENSE_NO_VALUE);
+	rv = int_enable;
+	if (rv >= 0)
+		rv = ms_fifo_int_enable(1);
+	if (rv < 0) {
+		fprintf(stderr, "Failed to enable the fifo interrupt.\n");
+		goto out;
+	}
 
-	return 0;
+	printf("Sensor %d, %.1f s per setting\n", sensor, seconds);
+	printf("%9s %8s %8s %8s %9s %9s %9s %9s %9s %6s\n", "ODR(Hz)",
+	       "rate(ms)", "samples", "rate(Hz)", "lat(ms)", "max(ms)",
+	       "jitter", "cmds/smp", "us/smp", "lost");
+
+	sig_quit = false;
+	signal(SIGINT, sig_quit_handler);
+	for (o = 0; o < num_odrs && !sig_quit; o++) {
+		for (r = 0; r < num_rates && !sig_quit; r++) {
+			odr = ms_set_rate(MOTIONSENSE_CMD_SENSOR_ODR, sensor,
+					  odrs[o]);
+			rate = ms_set_rate(MOTIONSENSE_CMD_EC_RATE, sensor,
+					   rates[r]);
+			if (odr < 0 || rate < 0) {
+				fprintf(stderr,
+					"Failed to set ODR %d, rate %d.\n",
+					odrs[o], rates[r]);
+				rv = -1;
+				goto done;
+			}
+
+			/*
+			 * Leave out samples taken at the last setting, and
+			 * the event already due at it.
+			 */
+			memset(&bench, 0, sizeof(bench));
+			bench.sensor = sensor;
+			if (ec_pollevent)
+				ec_pollevent(1 << EC_MKBP_EVENT_SENSOR_FIFO,
+					     &event, sizeof(event),
+					     MS_STREAM_EVENT_MS);
+			rv = ms_fifo_drain(fifo, timestamps, 0,
+					   ms_bench_sample, &bench, NULL);
+			if (rv >= 0)
+				rv = ms_bench_sync(&bench, sensor_count, lost);
+			if (rv < 0)
+				goto done;
+
+			cmds = 0;
+			total_lost = 0;
+			cmd_time = 0;
+			start = time_now();
+			while (!sig_quit && time_now() - start < seconds) {
+				if (!ec_pollevent ||
+				    ec_pollevent(1 << EC_MKBP_EVENT_SENSOR_FIFO,
+						 &event, sizeof(event),
+						 MS_STREAM_EVENT_MS) < 0)
+					usleep(MS_STREAM_POLL_US);
+
+				t = time_now();
+				rv = ms_fifo_drain(fifo, timestamps,
+						   sensor_count,
+						   ms_bench_sample, &bench,
+						   &cmds);
+				if (rv >= 0)
+					rv = ms_fifo_info(lost, sensor_count,
+							  NULL);
+				if (rv < 0)
+					goto done;
+				cmd_time += time_now() - t;
+				/* and the FIFO_INFO */
+				cmds++;
+				total_lost += lost[sensor];
+			}
+			t = time_now() - start;
+
+			printf("%9.3f %8d %8d %8.1f", odr / 1000.0, rate,
+			       bench.samples, bench.samples / t);
+			if (bench.samples) {
+				mean = bench.sum / bench.samples;
+				var = bench.sum_sq / bench.samples -
+				      mean * mean;
+				printf(" %9.2f %9.2f %9.2f %9.2f %9.1f",
+				       mean * 1000, bench.max * 1000,
+				       (var > 0 ? sqrt(var) : 0) * 1000,
+				       (double)cmds / bench.samples,
+				       cmd_time * 1000000 / bench.samples);
+			} else {
+				printf(" %9s %9s %9s %9s %9s", "-", "-", "-",
+				       "-", "-");
+			}
+			printf(" %6d\n", total_lost);
+		}
+	}
+	rv = 0;
+
+done:
+	signal(SIGINT, SIG_DFL);
+	ms_set_rate(MOTIONSENSE_CMD_SENSOR_ODR, sensor, old_odr);
+	ms_set_rate(MOTIONSENSE_CMD_EC_RATE, sensor, old_rate);
+out:
+	if (int_enable >= 0)
+		ms_fifo_int_enable(int_enable);
+	free(fifo);
+	return rv < 0 ? rv : 0;
 }
 
 static void motionsense_display_activities(uint32_t activities)
@@ -5453,6 +6882,12 @@ static int cmd_motionsense(int argc, char **argv)
 	if (argc > 7)
 		return ms_help(argv[0]);
 
+	if (argc >= 3 && !strcasecmp(argv[1], "stream"))
+		return ms_stream(argc - 2, argv + 2);
+
+	if (argc >= 3 && !strcasecmp(argv[1], "bench"))
+		return ms_bench(argc - 2, argv + 2);
+
 	if ((argc == 1) || (argc == 2 && !strcasecmp(argv[1], "active"))) {
 		param.cmd = MOTIONSENSE_CMD_DUMP;
 		param.dump.max_sensor_count = ECTOOL_MAX_SENSOR;
@@ -8835,6 +10270,21 @@ int cmd_rtc_get_alarm(int argc, char *argv[])
 	return 0;
 }
 
+int cmd_daemon(int argc, char *argv[])
+{
+	if (argc > 2) {
+		fprintf(stderr, "Usage: %s [socket]\n", argv[0]);
+		return -1;
+	}
+
+#ifdef _WIN32
+	fprintf(stderr, "Not supported on Windows\n");
+	return -1;
+#else
+	return ec_daemon_run(argc > 1 ? argv[1] : NULL);
+#endif
+}
+
 int cmd_console(int argc, char *argv[])
 {
 	char *out = (char *)ec_inbuf;
@@ -9735,66 +11185,109 @@ static int cmd_pchg_update_open(int port, uint32_t version,
 	return 0;
 }
 
+/*
+ * Write the image while the previous block is being written: block N + 1 is
+ * copied out of the mapped file and added to the CRC while the EC writes
+ * block N, and only then is WRITE_COMPLETE for block N waited for.
+ */
 static int cmd_pchg_update_write(int port, uint32_t address,
 				 const char *filename, uint32_t block_size,
 				 uint32_t *crc)
 {
-	struct ec_params_pchg_update *p =
-		(struct ec_params_pchg_update *)(ec_outbuf);
-	FILE *fp;
-	size_t len, total;
+	struct ec_params_pchg_update *p[2];
+	const uint8_t *image;
+	int total, pos = 0, len, next;
 	int progress = 0;
-	int rv;
+	int blocks = 0, cur = 0;
+	double start, sent, elapsed, latency;
+	double min_latency = 0, max_latency = 0, sum_latency = 0;
+	int rv = 0;
+	int i;
 
-	fp = fopen(filename, "rb");
-	if (!fp) {
-		fprintf(stderr, "\nCan't open %s: %s\n", filename,
-			strerror(errno));
+	image = map_file(filename, &total);
+	if (!image)
 		return -1;
-	}
 
-	fseek(fp, 0L, SEEK_END);
-	total = ftell(fp);
-	rewind(fp);
-	printf("Writing %s (%zu bytes).\n", filename, total);
+	printf("Writing %s (%d bytes).\n", filename, total);
+
+	/* Two packets, one being written while the other is filled */
+	p[0] = (struct ec_params_pchg_update *)malloc(sizeof(*p[0]) +
+						       block_size);
+	p[1] = (struct ec_params_pchg_update *)malloc(sizeof(*p[1]) +
+						       block_size);
+	if (!p[0] || !p[1]) {
+		fprintf(stderr, "\nUnable to allocate buffer.\n");
+		rv = -1;
+		goto out;
+	}
 
-	p->cmd = EC_PCHG_UPDATE_CMD_WRITE;
-	p->addr = address;
+	len = MIN(total, (int)block_size);
+	p[0]->cmd = EC_PCHG_UPDATE_CMD_WRITE;
+	p[0]->addr = address;
+	p[0]->size = len;
+	memcpy(p[0]->data, image, len);
+	crc32_ctx_hash(crc, p[0]->data, len);
 
-	/* Write firmware in blocks. */
-	len = fread(p->data, 1, block_size, fp);
+	start = time_now();
 	while (len > 0) {
 		int previous_progress = progress;
-		int i;
 
-		crc32_ctx_hash(crc, p->data, len);
-		p->size = len;
-		rv = ec_command(EC_CMD_PCHG_UPDATE, 0, p, sizeof(*p) + len,
-				NULL, 0);
+		sent = time_now();
+		rv = ec_command(EC_CMD_PCHG_UPDATE, 0, p[cur],
+				sizeof(*p[cur]) + len, NULL, 0);
 		if (rv < 0) {
 			fprintf(stderr, "\nFailed to write FW: %d\n", rv);
-			fclose(fp);
-			return rv;
+			goto out;
+		}
+
+		/* Prepare the next block while the EC writes this one */
+		pos += len;
+		next = MIN(total - pos, (int)block_size);
+		if (next > 0) {
+			p[!cur]->cmd = EC_PCHG_UPDATE_CMD_WRITE;
+			p[!cur]->addr = address + pos;
+			p[!cur]->size = next;
+			memcpy(p[!cur]->data, image + pos, next);
+			crc32_ctx_hash(crc, p[!cur]->data, next);
 		}
 
 		rv = cmd_pchg_wait_event(port, EC_MKBP_PCHG_WRITE_COMPLETE);
 		if (rv)
-			return rv;
+			goto out;
 
-		p->addr += len;
-		progress = (p->addr - address) * 100 / total;
+		latency = time_now() - sent;
+		if (!blocks || latency < min_latency)
+			min_latency = latency;
+		if (latency > max_latency)
+			max_latency = latency;
+		sum_latency += latency;
+		blocks++;
+
+		progress = (int)((int64_t)pos * 100 / total);
 		for (i = 0; i < progress - previous_progress; i++) {
 			printf("*");
 			fflush(stdout);
 		}
 
-		len = fread(p->data, 1, block_size, fp);
+		len = next;
+		cur = !cur;
 	}
 
 	printf("\n");
-	fclose(fp);
+	if (blocks) {
+		elapsed = time_now() - start;
+		printf("Wrote %d blocks in %.2f s, %.1f KiB/s\n", blocks,
+		       elapsed, total / 1024.0 / elapsed);
+		printf("Block latency min %.1f ms, avg %.1f ms, max %.1f ms\n",
+		       min_latency * 1000, sum_latency * 1000 / blocks,
+		       max_latency * 1000);
+	}
 
-	return 0;
+out:
+	free(p[0]);
+	free(p[1]);
+	unmap_file(image, total);
+	return rv;
 }
 
 static int cmd_pchg_update_close(int port, uint32_t *crc)
@@ -10579,6 +12072,202 @@ int cmd_tp_self_test(int argc, char *argv[])
 	return rv;
 }
 
+/*
+ * tpframeget stream container, in host byte order: a struct
+ * tp_stream_header and the n_frames frame sizes, then one record per
+ * snapshot: a struct tp_stream_record followed by each frame in turn.
+ */
+#define TP_STREAM_MAGIC 0x53465054 /* "TPFS" */
+#define TP_STREAM_VERSION 1
+
+struct tp_stream_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_frames;
+	/* Bytes in each record, including the struct tp_stream_record */
+	uint32_t record_size;
+};
+
+struct tp_stream_record {
+	/* Since the first snapshot */
+	uint64_t timestamp_us;
+	/* Snapshot slot; gaps are dropped snapshots */
+	uint32_t sequence;
+	uint32_t reserved;
+};
+
+/* Snapshots starting this far into the next slot are late */
+#define TP_STREAM_LATE_FRACTION 0.1
+
+static int tp_frame_stream(struct ec_response_tp_frame_info *info,
+			   int argc, char *argv[])
+{
+	struct tp_stream_header header;
+	struct tp_stream_record *record;
+	struct ec_command_batch_entry *cmds = NULL;
+	struct ec_params_tp_frame_get *params = NULL;
+	uint32_t record_size = sizeof(*record);
+	uint32_t offset, remaining;
+	int chunks = 0, count = 0, late = 0, dropped = 0;
+	double rate = 0, period = 0, start, now, slot, max_late = 0;
+	uint32_t sequence = 0, snapshots = 0;
+	uint8_t *buf = NULL;
+	FILE *f;
+	char *e;
+	int i, n, rv = 0;
+
+	if (argc < 1) {
+		fprintf(stderr,
+			"Usage: tpframeget stream <file> [<count> [<rate>]]\n");
+		return -1;
+	}
+	if (argc > 1) {
+		count = strtol(argv[1], &e, 0);
+		if ((e && *e) || count < 0) {
+			fprintf(stderr, "Bad count.\n");
+			return -1;
+		}
+	}
+	if (argc > 2) {
+		rate = strtod(argv[2], &e);
+		if ((e && *e) || rate <= 0) {
+			fprintf(stderr, "Bad rate.\n");
+			return -1;
+		}
+		period = 1 / rate;
+	}
+
+	/*
+	 * Every snapshot fetches the same chunks into the same record
+	 * buffer, so build the batch once.
+	 */
+	for (i = 0; i < info->n_frames; i++) {
+		record_size += info->frame_sizes[i];
+		chunks += (info->frame_sizes[i] + ec_max_insize - 1) /
+			  ec_max_insize;
+	}
+	buf = (uint8_t *)malloc(record_size);
+	cmds = (struct ec_command_batch_entry *)calloc(chunks, sizeof(*cmds));
+	params = (struct ec_params_tp_frame_get *)calloc(chunks,
+							 sizeof(*params));
+	if (!buf || !cmds || !params) {
+		fprintf(stderr, "Couldn't allocate memory.\n");
+		rv = -1;
+		goto out;
+	}
+	record = (struct tp_stream_record *)buf;
+	record->reserved = 0;
+	n = 0;
+	offset = sizeof(*record);
+	for (i = 0; i < info->n_frames; i++) {
+		for (remaining = info->frame_sizes[i]; remaining;
+		     remaining -= params[n++].size) {
+			params[n].frame_index = i;
+			params[n].offset = info->frame_sizes[i] - remaining;
+			params[n].size = MIN(remaining, ec_max_insize);
+			cmds[n].command = EC_CMD_TP_FRAME_GET;
+			cmds[n].outdata = &params[n];
+			cmds[n].outsize = sizeof(params[n]);
+			cmds[n].indata = buf + offset;
+			cmds[n].insize = params[n].size;
+			offset += params[n].size;
+		}
+	}
+
+	f = fopen(argv[0], "wb");
+	if (!f) {
+		perror("Error opening output");
+		rv = -1;
+		goto out;
+	}
+	header.magic = TP_STREAM_MAGIC;
+	header.version = TP_STREAM_VERSION;
+	header.n_frames = info->n_frames;
+	header.record_size = record_size;
+	if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+	    fwrite(info->frame_sizes, sizeof(info->frame_sizes[0]),
+		   info->n_frames, f) != info->n_frames) {
+		perror("Error writing output");
+		fclose(f);
+		rv = -1;
+		goto out;
+	}
+
+	printf("Recording %u byte snapshots to %s", record_size, argv[0]);
+	if (rate)
+		printf(" at %.1f/s", rate);
+	printf(", Ctrl-C to stop...\n");
+
+	sig_quit = false;
+	signal(SIGINT, sig_quit_handler);
+	start = time_now();
+	while (!sig_quit && (!count || snapshots < count)) {
+		now = time_now();
+		if (period) {
+			slot = start + sequence * period;
+			if (now < slot) {
+				usleep((slot - now) * 1000000);
+				now = time_now();
+			}
+			if (now - slot > max_late)
+				max_late = now - slot;
+			if (now - slot >= period) {
+				/* Skip the slots which have gone by */
+				n = (now - slot) / period;
+				dropped += n;
+				sequence += n;
+				slot += n * period;
+			}
+			if (now - slot > period * TP_STREAM_LATE_FRACTION)
+				late++;
+		}
+
+		rv = ec_command(EC_CMD_TP_FRAME_SNAPSHOT, 0, NULL, 0, NULL, 0);
+		if (rv < 0) {
+			fprintf(stderr, "Failed to snapshot frame.\n");
+			break;
+		}
+		record->timestamp_us = (time_now() - start) * 1000000;
+		record->sequence = sequence++;
+
+		n = ec_command_batch(cmds, chunks);
+		if (n < chunks) {
+			rv = cmds[n].result;
+			fprintf(stderr,
+				"Failed to get frame %u data at offset 0x%x\n",
+				params[n].frame_index, params[n].offset);
+			break;
+		}
+
+		if (fwrite(buf, record_size, 1, f) != 1) {
+			perror("Error writing output");
+			rv = -1;
+			break;
+		}
+		snapshots++;
+	}
+	signal(SIGINT, SIG_DFL);
+	now = time_now() - start;
+
+	if (fclose(f) && rv >= 0) {
+		perror("Error writing output");
+		rv = -1;
+	}
+
+	printf("Recorded %u snapshots in %.2f s, %.1f/s, %.1f KiB/s\n",
+	       snapshots, now, now ? snapshots / now : 0,
+	       now ? snapshots * record_size / now / 1024 : 0);
+	if (period)
+		printf("Late %d, dropped %d, worst %.2f ms behind\n", late,
+		       dropped, max_late * 1000);
+
+out:
+	free(params);
+	free(cmds);
+	free(buf);
+	return rv < 0 ? rv : 0;
+}
+
 int cmd_tp_frame_get(int argc, char *argv[])
 {
 	int i, j;
@@ -10604,6 +12293,11 @@ int cmd_tp_frame_get(int argc, char *argv[])
 		goto err;
 	}
 
+	if (argc > 1 && !strcmp(argv[1], "stream")) {
+		rv = tp_frame_stream(r, argc - 2, argv + 2);
+		goto err;
+	}
+
 	rv = ec_command(EC_CMD_TP_FRAME_SNAPSHOT, 0, NULL, 0, NULL, 0);
 	if (rv < 0) {
 		fprintf(stderr, "Failed to snapshot frame.\n");
@@ -11169,6 +12863,8 @@ int cmd_fw_pdversion(int argc, char *argv[])
 
 /* END Framework Laptop Specific */
 
+int cmd_batch(int argc, char *argv[]);
+
 /* NULL-terminated list of commands */
 const struct command commands[] = {
 	{ "adcread", cmd_adc_read },
@@ -11177,6 +12873,7 @@ const struct command commands[] = {
 	{ "autofanctrl", cmd_thermal_auto_fan_ctrl },
 	{ "backlight", cmd_lcd_backlight },
 	{ "basestate", cmd_basestate },
+	{ "batch", cmd_batch },
 	{ "battery", cmd_battery },
 	{ "batterycutoff", cmd_battery_cut_off },
 	{ "batteryparam", cmd_battery_vendor_param },
@@ -11192,6 +12889,7 @@ const struct command commands[] = {
 	{ "cmdversions", cmd_cmdversions },
 	{ "console", cmd_console },
 	{ "cec", cmd_cec },
+	{ "daemon", cmd_daemon },
 	{ "echash", cmd_ec_hash },
 	{ "eventclear", cmd_host_event_clear },
 	{ "eventclearb", cmd_host_event_clear_b },
@@ -11205,10 +12903,12 @@ const struct command commands[] = {
 	{ "eventsetwakemask", cmd_host_event_set_wake_mask },
 	{ "extpwrlimit", cmd_ext_power_limit },
 	{ "fanduty", cmd_fanduty },
+	{ "flashbench", cmd_flash_bench },
 	{ "flasherase", cmd_flash_erase },
 	{ "flasheraseasync", cmd_flash_erase },
 	{ "flashprotect", cmd_flash_protect },
 	{ "flashread", cmd_flash_read },
+	{ "flashverify", cmd_flash_verify },
 	{ "flashwrite", cmd_flash_write },
 	{ "flashinfo", cmd_flash_info },
 	{ "flashspiinfo", cmd_flash_spi_info },
@@ -11241,6 +12941,7 @@ const struct command commands[] = {
 	{ "inventory", cmd_inventory },
 	{ "led", cmd_led },
 	{ "lightbar", cmd_lightbar },
+	{ "lpclatency", cmd_lpc_latency },
 	{ "kbfactorytest", cmd_keyboard_factory_test },
 	{ "kbid", cmd_kbid },
 	{ "kbinfo", cmd_kbinfo },
@@ -11320,6 +13021,138 @@ const struct command commands[] = {
 	{ NULL, NULL }
 };
 
+#define BATCH_MAX_LINE 4096
+#define BATCH_MAX_ARGS 64
+
+/*
+ * Split a batch line into arguments, in place.  Arguments are separated by
+ * whitespace and may be quoted with ' or "; '#' starts a comment.  Returns
+ * the number of arguments, or -1 on error.
+ */
+static int batch_split_line(char *line, char *argv[], int max_args)
+{
+	char *s = line;
+	char *d;
+	char quote;
+	int argc = 0;
+
+	for (;;) {
+		while (isspace((unsigned char)*s))
+			s++;
+		if (!*s || *s == '#')
+			return argc;
+		if (argc == max_args)
+			return -1;
+
+		argv[argc++] = d = s;
+		quote = 0;
+		while (*s && (quote || !isspace((unsigned char)*s))) {
+			if (quote && *s == quote)
+				quote = 0;
+			else if (!quote && (*s == '"' || *s == '\''))
+				quote = *s;
+			else
+				*d++ = *s;
+			s++;
+		}
+		if (quote)
+			return -1;
+		if (*s)
+			s++;
+		*d = '\0';
+	}
+}
+
+int cmd_batch(int argc, char *argv[])
+{
+	static bool in_batch;
+	const struct command *cmd;
+	char line[BATCH_MAX_LINE];
+	char *args[BATCH_MAX_ARGS];
+	bool fail_fast = false;
+	int lineno = 0;
+	int failures = 0;
+	int nargs, rv;
+	FILE *f;
+
+	if (argc > 2 && !strcasecmp(argv[1], "failfast")) {
+		fail_fast = true;
+		argc--;
+		argv++;
+	}
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s [failfast] <file|->\n", argv[0]);
+		return -1;
+	}
+	if (in_batch) {
+		fprintf(stderr, "Batches cannot be nested\n");
+		return -1;
+	}
+
+	f = strcmp(argv[1], "-") ? fopen(argv[1], "r") : stdin;
+	if (!f) {
+		perror("Error opening batch file");
+		return -1;
+	}
+
+	in_batch = true;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (!strchr(line, '\n') && !feof(f)) {
+			fprintf(stderr, "Line %d is too long\n", lineno);
+			/* Skip the rest of it */
+			while (fgets(line, sizeof(line), f) &&
+			       !strchr(line, '\n'))
+				;
+			nargs = 0;
+			rv = -1;
+		} else {
+			nargs = batch_split_line(line, args, BATCH_MAX_ARGS);
+			if (nargs == 0)
+				continue;
+		}
+		if (!nargs) {
+			/* Line too long, already reported */
+		} else if (nargs < 0) {
+			fprintf(stderr, "Line %d: can't parse arguments\n",
+				lineno);
+			rv = -1;
+		} else {
+			for (cmd = commands; cmd->name; cmd++) {
+				if (!strcasecmp(args[0], cmd->name))
+					break;
+			}
+			if (cmd->name) {
+				/* Each line sees a fresh memory map */
+				ec_memmap_invalidate();
+				rv = cmd->handler(nargs, args);
+			} else {
+				fprintf(stderr, "Unknown command '%s'\n",
+					args[0]);
+				rv = -1;
+			}
+		}
+
+		/* Per-command status, after whatever the command printed */
+		fflush(stderr);
+		printf("batch: line %d: %s: %d\n", lineno,
+		       nargs > 0 ? args[0] : "?", rv);
+		fflush(stdout);
+
+		if (rv) {
+			failures++;
+			if (fail_fast)
+				break;
+		}
+	}
+	in_batch = false;
+
+	if (f != stdin)
+		fclose(f);
+
+	return failures ? -1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
 	const struct command *cmd;
@@ -11327,7 +13160,9 @@ int main(int argc, char *argv[])
 	int interfaces = COMM_ALL;
 	int i2c_bus = -1;
 	char device_name[41] = CROS_EC_DEV_NAME;
+	const char *cache_file = NULL;
 	uint16_t vid = USB_VID_GOOGLE, pid = USB_PID_HAMMER;
+	int memmap_age = EC_MEMMAP_DEFAULT_AGE_MS;
 	int rv = 1;
 	int parse_error = 0;
 	char *e;
@@ -11359,6 +13194,10 @@ int main(int argc, char *argv[])
 				interfaces = COMM_I2C;
 			} else if (!strcasecmp(optarg, "servo")) {
 				interfaces = COMM_SERVO;
+			} else if (!strcasecmp(optarg, "sim")) {
+				interfaces = COMM_SIM;
+			} else if (!strcasecmp(optarg, "daemon")) {
+				interfaces = COMM_DAEMON;
 			} else {
 				fprintf(stderr, "Invalid --interface\n");
 				parse_error = 1;
@@ -11390,6 +13229,45 @@ int main(int argc, char *argv[])
 		case OPT_ASCII:
 			ascii_mode = 1;
 			break;
+		case OPT_STATS:
+			ec_stats_enable(optarg);
+			break;
+		case OPT_CACHE:
+			cache_file = optarg;
+			break;
+		case OPT_USB_QUEUE:
+#ifndef _WIN32
+			if (!comm_usb_set_queue_depth(strtol(optarg, &e, 0)) &&
+			    *optarg && !(e && *e))
+				break;
+#endif
+			fprintf(stderr, "Invalid --usb_queue\n");
+			parse_error = 1;
+			break;
+		case OPT_LPC_FAST:
+#if (defined(__i386__) || defined(__x86_64__)) && !defined(_WIN32)
+			comm_lpc_set_engine(1);
+			break;
+#endif
+			fprintf(stderr, "--lpc_fast needs x86 LPC support\n");
+			parse_error = 1;
+			break;
+		case OPT_SPI_CLOCK:
+#ifndef _WIN32
+			if (!comm_servo_spi_set_clock(strtoul(optarg, &e, 0)) &&
+			    *optarg && !(e && *e))
+				break;
+#endif
+			fprintf(stderr, "Invalid --spi_clock\n");
+			parse_error = 1;
+			break;
+		case OPT_MEMMAP_AGE:
+			memmap_age = strtol(optarg, &e, 0);
+			if (!*optarg || (e && *e) || memmap_age < 0) {
+				fprintf(stderr, "Invalid --memmap_age\n");
+				parse_error = 1;
+			}
+			break;
 		}
 	}
 
@@ -11424,6 +13302,14 @@ int main(int argc, char *argv[])
 		parse_error = 1;
 	}
 
+	/* Sub-devices share the device node; tell them apart */
+	snprintf(ec_device_id, sizeof(ec_device_id), "%s/%d", device_name,
+		 dev);
+	if (cache_file && ec_cmd_versions_cache_open(cache_file, ec_device_id)) {
+		fprintf(stderr, "Invalid --cache\n");
+		parse_error = 1;
+	}
+
 	if (parse_error) {
 		print_help(argv[0], 0);
 		exit(1);
@@ -11433,8 +13319,11 @@ int main(int argc, char *argv[])
 	if (!(interfaces & COMM_DEV) || comm_init_dev(device_name)) {
 		/* If dev is excluded or isn't supported, find alternative */
 
-		/* Lock is not needed for COMM_USB */
-		if (!(interfaces & COMM_USB) &&
+		/*
+		 * Lock is not needed for COMM_USB or COMM_SIM, and for
+		 * COMM_DAEMON the daemon holds it.
+		 */
+		if (!(interfaces & (COMM_USB | COMM_SIM | COMM_DAEMON)) &&
 		    acquire_gec_lock(GEC_LOCK_TIMEOUT_SECS) < 0) {
 			fprintf(stderr, "Could not acquire GEC lock.\n");
 			exit(1);
@@ -11445,6 +13334,22 @@ int main(int argc, char *argv[])
 				fprintf(stderr, "Couldn't find EC on USB.\n");
 				goto out;
 			}
+#endif
+		} else if (interfaces == COMM_SIM) {
+			if (comm_init_sim(device_name)) {
+				fprintf(stderr, "Couldn't start simulated EC.\n");
+				goto out;
+			}
+		} else if (interfaces == COMM_DAEMON) {
+#ifndef _WIN32
+			if (comm_init_daemon(strcmp(device_name,
+						    CROS_EC_DEV_NAME) ?
+						     device_name :
+						     NULL)) {
+				fprintf(stderr,
+					"Couldn't connect to ectool daemon.\n");
+				goto out;
+			}
 #endif
 		} else if (comm_init_alt(interfaces, device_name, i2c_bus)) {
 			fprintf(stderr, "Couldn't find EC\n");
@@ -11457,6 +13362,8 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	ec_memmap_snapshot_enable(memmap_age);
+
 	/* Handle commands */
 	for (cmd = commands; cmd->name; cmd++) {
 		if (!strcasecmp(argv[optind], cmd->name)) {
@@ -4,18 +4,46 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <chrono>
+
 #ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/utsname.h>
+#include <unistd.h>
 #endif // _WIN32
 
 #include "comm-host.h"
 #include "misc_util.h"
 
+/* Maximum number of commands in the command version cache */
+#define CMD_VERSIONS_CACHE_SIZE 128
+
+/*
+ * Command version cache.  Results of EC_CMD_GET_CMD_VERSIONS, including
+ * "command not supported" answers, are kept for the lifetime of the process
+ * and optionally in a file keyed by the transport, the device and the
+ * firmware image the EC is running.
+ */
+static struct cmd_versions_entry {
+	uint16_t cmd;
+	int rv;
+	uint32_t mask;
+} cmd_versions_cache[CMD_VERSIONS_CACHE_SIZE];
+static int cmd_versions_cached;
+static int cmd_versions_loaded;
+static int cmd_versions_dirty;
+static const char *cmd_versions_file;
+static char cmd_versions_device[48];
+static char cmd_versions_key[160];
+
 int write_file(const char *filename, const char *buf, int size)
 {
 	FILE *f;
@@ -79,6 +107,339 @@ char *read_file(const char *filename, int *size)
 	return buf;
 }
 
+int state_file_update(const char *filename, const char *key,
+		      const char *lines)
+{
+	char line[256], word[128];
+	bool start = true, keep = true;
+	char *tmp;
+	FILE *in, *out;
+	int rv;
+
+	tmp = (char *)malloc(strlen(filename) + sizeof(".tmp"));
+	if (!tmp)
+		return -1;
+	sprintf(tmp, "%s.tmp", filename);
+	out = fopen(tmp, "w");
+	if (!out) {
+		free(tmp);
+		return -1;
+	}
+
+	/* Keep the other entries' lines, then add ours */
+	in = fopen(filename, "r");
+	while (in && fgets(line, sizeof(line), in)) {
+		/* Judge long lines by their first piece */
+		if (start)
+			keep = sscanf(line, "%127s", word) != 1 ||
+			       strcmp(word, key);
+		if (keep)
+			fputs(line, out);
+		start = strchr(line, '\n') != NULL;
+	}
+	if (in)
+		fclose(in);
+	fputs(lines, out);
+
+	rv = fclose(out);
+#ifdef _WIN32
+	/* rename() does not replace existing files on Windows */
+	remove(filename);
+#endif
+	if (rv || rename(tmp, filename)) {
+		remove(tmp);
+		rv = -1;
+	}
+	free(tmp);
+	return rv;
+}
+
+#ifndef _WIN32
+const uint8_t *map_file(const char *filename, int *size)
+{
+	struct stat st;
+	void *buf;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		perror("Error opening input file");
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0) {
+		perror("Error opening input file");
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size <= 0 || st.st_size > 0x7fffffff) {
+		fprintf(stderr, "File is empty or unreasonably large\n");
+		close(fd);
+		return NULL;
+	}
+	*size = st.st_size;
+
+	buf = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED) {
+		perror("Error mapping input file");
+		return NULL;
+	}
+	/* Read ahead, since it will be consumed front to back */
+	madvise(buf, *size, MADV_SEQUENTIAL);
+
+	printf("Reading %d bytes from %s...\n", *size, filename);
+	return (const uint8_t *)buf;
+}
+
+void unmap_file(const uint8_t *buf, int size)
+{
+	munmap((void *)buf, size);
+}
+
+/*
+ * Output files being written.  Unless mapped live, the data goes to a
+ * temporary file next to the target which is renamed over it once complete,
+ * or to a buffer if the target isn't a regular file.
+ */
+static struct output_map {
+	uint8_t *buf;
+	char *tmp; /* Temporary file, or NULL if buffered or live */
+	int buffered;
+	struct output_map *next;
+} *output_maps;
+
+static struct output_map *output_map_find(uint8_t *buf)
+{
+	struct output_map **m, *found;
+
+	for (m = &output_maps; *m; m = &(*m)->next) {
+		if ((*m)->buf == buf) {
+			found = *m;
+			*m = found->next;
+			return found;
+		}
+	}
+	return NULL;
+}
+
+uint8_t *map_output_file(const char *filename, int size, int flags)
+{
+	struct output_map *m;
+	struct stat st;
+	mode_t mask;
+	void *buf;
+	int fd, rv;
+
+	m = (struct output_map *)calloc(1, sizeof(*m));
+	if (!m) {
+		fprintf(stderr, "Unable to allocate buffer.\n");
+		return NULL;
+	}
+
+	/* Pipes, devices and the like can't be mapped; buffer the data */
+	if (!lstat(filename, &st) && !S_ISREG(st.st_mode)) {
+		m->buf = (uint8_t *)malloc(size);
+		if (!m->buf) {
+			fprintf(stderr, "Unable to allocate buffer.\n");
+			free(m);
+			return NULL;
+		}
+		m->buffered = 1;
+		goto done;
+	}
+
+	if (flags & MAP_OUTPUT_LIVE) {
+		fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	} else {
+		m->tmp = (char *)malloc(strlen(filename) + 8);
+		if (!m->tmp) {
+			fprintf(stderr, "Unable to allocate buffer.\n");
+			free(m);
+			return NULL;
+		}
+		sprintf(m->tmp, "%s.XXXXXX", filename);
+		fd = mkstemp(m->tmp);
+		if (fd >= 0) {
+			/* Permissions of the file replaced, or as open() */
+			if (!stat(filename, &st)) {
+				fchmod(fd, st.st_mode & 07777);
+			} else {
+				mask = umask(0);
+				umask(mask);
+				fchmod(fd, 0666 & ~mask);
+			}
+		}
+	}
+	if (fd < 0) {
+		perror("Error opening output file");
+		free(m->tmp);
+		free(m);
+		return NULL;
+	}
+	/*
+	 * Allocate the blocks now, so a full disk fails here rather than as
+	 * a SIGBUS halfway through.
+	 */
+	rv = posix_fallocate(fd, 0, size);
+	if (rv == EINVAL || rv == EOPNOTSUPP)
+		rv = ftruncate(fd, size) < 0 ? errno : 0;
+	if (rv) {
+		fprintf(stderr, "Error writing to file: %s\n", strerror(rv));
+		goto fail;
+	}
+
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (buf == MAP_FAILED) {
+		perror("Error mapping output file");
+		goto fail;
+	}
+	close(fd);
+	m->buf = (uint8_t *)buf;
+
+done:
+	m->next = output_maps;
+	output_maps = m;
+	return m->buf;
+
+fail:
+	close(fd);
+	if (m->tmp)
+		unlink(m->tmp);
+	free(m->tmp);
+	free(m);
+	return NULL;
+}
+
+int unmap_output_file(const char *filename, uint8_t *buf, int size)
+{
+	struct output_map *m = output_map_find(buf);
+	int rv;
+
+	if (!m)
+		return -1;
+
+	if (m->buffered) {
+		rv = write_file(filename, (const char *)buf, size);
+		free(buf);
+		free(m);
+		return rv;
+	}
+
+	rv = msync(buf, size, MS_SYNC);
+	if (rv)
+		perror("Error writing to file");
+	munmap(buf, size);
+
+	if (m->tmp) {
+		if (!rv && rename(m->tmp, filename)) {
+			perror("Error renaming output file");
+			rv = -1;
+		}
+		if (rv)
+			unlink(m->tmp);
+		free(m->tmp);
+	}
+	free(m);
+	return rv;
+}
+
+void discard_output_file(const char *filename, uint8_t *buf, int size)
+{
+	struct output_map *m = output_map_find(buf);
+
+	if (!m)
+		return;
+
+	if (m->buffered) {
+		free(buf);
+	} else {
+		munmap(buf, size);
+		/* A live file can't be taken back, so drop it */
+		unlink(m->tmp ? m->tmp : filename);
+		free(m->tmp);
+	}
+	free(m);
+}
+#else // _WIN32
+const uint8_t *map_file(const char *filename, int *size)
+{
+	return (const uint8_t *)read_file(filename, size);
+}
+
+void unmap_file(const uint8_t *buf, int size)
+{
+	free((void *)buf);
+}
+
+uint8_t *map_output_file(const char *filename, int size, int flags)
+{
+	uint8_t *buf = (uint8_t *)malloc(size);
+
+	if (!buf)
+		fprintf(stderr, "Unable to allocate buffer.\n");
+	return buf;
+}
+
+int unmap_output_file(const char *filename, uint8_t *buf, int size)
+{
+	int rv = write_file(filename, (const char *)buf, size);
+
+	free(buf);
+	return rv;
+}
+
+void discard_output_file(const char *filename, uint8_t *buf, int size)
+{
+	free(buf);
+}
+#endif // _WIN32
+
+double time_now(void)
+{
+	return std::chrono::duration<double>(
+		       std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+void progress_start(struct progress *p, const char *label, int total)
+{
+	p->label = label;
+	p->total = total;
+	p->start = time_now();
+	p->last = 0;
+#ifndef _WIN32
+	/* Only draw the line for a person watching */
+	p->enabled = isatty(fileno(stderr));
+#else
+	p->enabled = 1;
+#endif
+}
+
+void progress_update(struct progress *p, int done)
+{
+	double now = time_now();
+	double elapsed = now - p->start;
+	double rate;
+	int eta;
+
+	if (!p->enabled || (now - p->last < PROGRESS_INTERVAL && done < p->total))
+		return;
+	p->last = now;
+
+	rate = elapsed > 0 ? done / elapsed : 0;
+	eta = rate > 0 ? (int)((p->total - done) / rate) : 0;
+	fprintf(stderr, "\r%s %d/%d KiB (%d%%), %.1f KiB/s, ETA %d:%02d  ",
+		p->label, done / 1024, p->total / 1024,
+		p->total ? (int)(100LL * done / p->total) : 100, rate / 1024,
+		eta / 60, eta % 60);
+}
+
+void progress_end(struct progress *p)
+{
+	if (p->enabled && p->last)
+		fprintf(stderr, "\n");
+}
+
 int is_string_printable(const char *buf)
 {
 	while (*buf) {
@@ -90,6 +451,112 @@ int is_string_printable(const char *buf)
 	return 1;
 }
 
+/*
+ * Load the cache file, if any, the first time the cache is used.  Its
+ * content is only used if it was written for the firmware the EC is running.
+ */
+static void cmd_versions_cache_load(void)
+{
+	struct ec_response_get_version r;
+	struct cmd_versions_entry *e;
+	char line[sizeof(cmd_versions_key) + 16];
+	unsigned int cmd, mask;
+	int rv;
+	FILE *f;
+
+	cmd_versions_loaded = 1;
+	if (!cmd_versions_file)
+		return;
+
+	if (ec_command(EC_CMD_GET_VERSION, 0, NULL, 0, &r, sizeof(r)) < 0) {
+		/* Can't tell which firmware this is; don't trust the file. */
+		cmd_versions_file = NULL;
+		return;
+	}
+	r.version_string_ro[sizeof(r.version_string_ro) - 1] = '\0';
+	r.version_string_rw[sizeof(r.version_string_rw) - 1] = '\0';
+	snprintf(cmd_versions_key, sizeof(cmd_versions_key),
+		 "version %s %s %u %s %s\n", ec_transport_name,
+		 cmd_versions_device, r.current_image, r.version_string_ro,
+		 r.version_string_rw);
+
+	f = fopen(cmd_versions_file, "r");
+	if (!f || !fgets(line, sizeof(line), f) ||
+	    strcmp(line, cmd_versions_key)) {
+		/* Missing, or written for other firmware: start over. */
+		cmd_versions_dirty = 1;
+		if (f)
+			fclose(f);
+		return;
+	}
+
+	while (cmd_versions_cached < CMD_VERSIONS_CACHE_SIZE &&
+	       fscanf(f, "%x %x %d", &cmd, &mask, &rv) == 3) {
+		e = &cmd_versions_cache[cmd_versions_cached++];
+		e->cmd = cmd;
+		e->mask = mask;
+		e->rv = rv;
+	}
+	fclose(f);
+}
+
+static void cmd_versions_cache_save(void)
+{
+	char *tmp;
+	FILE *f;
+	int rv, i;
+
+	if (!cmd_versions_file || !cmd_versions_dirty)
+		return;
+
+	/* Write a new file and rename it, so readers never see half of it */
+	tmp = (char *)malloc(strlen(cmd_versions_file) + sizeof(".tmp"));
+	if (!tmp)
+		return;
+	sprintf(tmp, "%s.tmp", cmd_versions_file);
+	f = fopen(tmp, "w");
+	if (!f) {
+		perror("Error writing command version cache");
+		free(tmp);
+		return;
+	}
+	fputs(cmd_versions_key, f);
+	for (i = 0; i < cmd_versions_cached; i++)
+		fprintf(f, "0x%04x 0x%08x %d\n", cmd_versions_cache[i].cmd,
+			cmd_versions_cache[i].mask, cmd_versions_cache[i].rv);
+	rv = fclose(f);
+#ifdef _WIN32
+	/* rename() does not replace existing files on Windows */
+	remove(cmd_versions_file);
+#endif
+	if (rv || rename(tmp, cmd_versions_file)) {
+		perror("Error writing command version cache");
+		remove(tmp);
+	} else {
+		cmd_versions_dirty = 0;
+	}
+	free(tmp);
+}
+
+int ec_cmd_versions_cache_open(const char *filename, const char *device)
+{
+	static int registered;
+
+	cmd_versions_file = filename;
+	snprintf(cmd_versions_device, sizeof(cmd_versions_device), "%s",
+		 device);
+	if (!registered && atexit(cmd_versions_cache_save))
+		return -1;
+	registered = 1;
+	return 0;
+}
+
+void ec_cmd_versions_cache_reset(void)
+{
+	cmd_versions_cached = 0;
+	cmd_versions_loaded = 0;
+}
+
 /**
  * Get the versions of the command supported by the EC.
  *
@@ -103,10 +570,23 @@ int ec_get_cmd_versions(int cmd, uint32_t *pmask)
 	struct ec_params_get_cmd_versions_v1 pver_v1;
 	struct ec_params_get_cmd_versions pver;
 	struct ec_response_get_cmd_versions rver;
+	struct cmd_versions_entry *e;
 	int rv;
+	int i;
 
 	*pmask = 0;
 
+	if (!cmd_versions_loaded)
+		cmd_versions_cache_load();
+
+	for (i = 0; i < cmd_versions_cached; i++) {
+		e = &cmd_versions_cache[i];
+		if (e->cmd == cmd) {
+			*pmask = e->mask;
+			return e->rv;
+		}
+	}
+
 	pver_v1.cmd = cmd;
 	rv = ec_command(EC_CMD_GET_CMD_VERSIONS, 1, &pver_v1, sizeof(pver_v1),
 			&rver, sizeof(rver));
@@ -117,6 +597,19 @@ int ec_get_cmd_versions(int cmd, uint32_t *pmask)
 				&rver, sizeof(rver));
 	}
 
+	/*
+	 * Remember the answer, unless the command could not get through to
+	 * the EC at all.
+	 */
+	if ((rv >= 0 || rv <= -EECRESULT) &&
+	    cmd_versions_cached < CMD_VERSIONS_CACHE_SIZE) {
+		e = &cmd_versions_cache[cmd_versions_cached++];
+		e->cmd = cmd;
+		e->rv = rv < 0 ? rv : 0;
+		e->mask = rv < 0 ? 0 : rver.version_mask;
+		cmd_versions_dirty = 1;
+	}
+
 	if (rv < 0)
 		return rv;
 
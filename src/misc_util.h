@@ -36,6 +36,114 @@ int write_file(const char *filename, const char *buf, int size);
  */
 char *read_file(const char *filename, int *size);
 
+/**
+ * Replace one entry of a state file, keeping the others.
+ *
+ * The file holds entries of one or more lines, each starting with the key
+ * of its entry.  The lines of the entry with the given key are replaced by
+ * 'lines'.  The new file is written alongside and renamed over the old
+ * one, so readers never see half of it.
+ *
+ * @param filename	State file
+ * @param key		Key of the entry, the first word of its lines
+ * @param lines		New lines of the entry, each ending in a newline
+ * @return non-zero if error
+ */
+int state_file_update(const char *filename, const char *key,
+		      const char *lines);
+
+/**
+ * Map a file for reading, instead of copying it into a heap buffer.
+ *
+ * @param filename	Source filename
+ * @param size		Size of file in bytes (returned)
+ * @return a pointer to the contents, to be released with unmap_file(), or
+ *	NULL if error.
+ */
+const uint8_t *map_file(const char *filename, int *size);
+
+/**
+ * Release a file mapped with map_file().
+ */
+void unmap_file(const uint8_t *buf, int size);
+
+/* Flags for map_output_file() */
+#define MAP_OUTPUT_LIVE (1 << 0) /* Write the target in place */
+
+/**
+ * Create a file of the given size and map it for writing, so data can be
+ * stored in it as it arrives.
+ *
+ * The data goes to a temporary file which replaces the target only when
+ * unmap_output_file() succeeds, so a failed write leaves any existing file
+ * alone.  If the target exists and isn't a regular file (a pipe, a device,
+ * ...), the data is buffered and written out by unmap_output_file().  With
+ * MAP_OUTPUT_LIVE, a regular target is created and mapped directly, so it
+ * can be read while it is written.
+ *
+ * @param filename	Target filename
+ * @param size		Size of file in bytes
+ * @param flags		MAP_OUTPUT_* flags
+ * @return a pointer to the contents, to be released with
+ *	unmap_output_file() or discard_output_file(), or NULL if error.
+ */
+uint8_t *map_output_file(const char *filename, int size, int flags);
+
+/**
+ * Write out and release a file mapped with map_output_file().
+ *
+ * @return non-zero if error
+ */
+int unmap_output_file(const char *filename, uint8_t *buf, int size);
+
+/**
+ * Release a file mapped with map_output_file() without writing it out.  The
+ * target is left as it was, or removed if it was mapped live.
+ */
+void discard_output_file(const char *filename, uint8_t *buf, int size);
+
+/**
+ * Return the time in seconds from a monotonic clock, for timing intervals.
+ */
+double time_now(void);
+
+/* Seconds between redraws of a progress line */
+#define PROGRESS_INTERVAL 0.2
+
+/*
+ * Progress line for long transfers, showing throughput and the time left.
+ * It is drawn on stderr, and only if stderr is a terminal.
+ */
+struct progress {
+	const char *label;
+	int total;
+	double start;
+	double last;
+	int enabled;
+};
+
+/**
+ * Start a progress line.
+ *
+ * @param p		Progress line
+ * @param label		What is being done, e.g. "Reading"
+ * @param total		Total number of bytes
+ */
+void progress_start(struct progress *p, const char *label, int total);
+
+/**
+ * Update a progress line, at most every PROGRESS_INTERVAL.
+ *
+ * @param p		Progress line
+ * @param done		Number of bytes done so far
+ */
+void progress_update(struct progress *p, int done);
+
+/**
+ * Finish a progress line.
+ */
+void progress_end(struct progress *p);
+
 /**
  * Check if a string contains only printable characters.
  *
@@ -44,9 +152,32 @@ char *read_file(const char *filename, int *size);
  */
 int is_string_printable(const char *buf);
 
+/**
+ * Keep the command version cache in a file.
+ *
+ * ec_get_cmd_versions() remembers its answers for the lifetime of the
+ * process.  With a cache file, they are also loaded from and saved to that
+ * file, as long as they were recorded over the same transport, for the same
+ * device, and the EC still runs the same image (current image, RO and RW
+ * version strings).  The file is written at exit.
+ *
+ * @param filename	Cache file
+ * @param device	Name of the device, to tell ECs on one transport apart
+ * @return 0 if success, <0 if error
+ */
+int ec_cmd_versions_cache_open(const char *filename, const char *device);
+
+/**
+ * Forget cached command versions, e.g. because the EC jumped to another
+ * image.
+ */
+void ec_cmd_versions_cache_reset(void);
+
 /**
  * Get the versions of the command supported by the EC.
  *
+ * Answers are cached, see ec_cmd_versions_cache_open().
+ *
  * @param cmd		Command
  * @param pmask		Destination for version mask; will be set to 0 on
  *			error.
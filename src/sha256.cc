@@ -0,0 +1,150 @@
+/* Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+/* SHA-256 implementation (FIPS 180-4) */
+
+#include <string.h>
+
+#include "sha256.h"
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t ror(uint32_t x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_transform(struct sha256_ctx *ctx, const uint8_t *block)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t)block[i * 4] << 24 |
+		       (uint32_t)block[i * 4 + 1] << 16 |
+		       (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+	for (i = 16; i < 64; i++)
+		w[i] = w[i - 16] +
+		       (ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^
+			(w[i - 15] >> 3)) +
+		       w[i - 7] +
+		       (ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+	a = ctx->h[0];
+	b = ctx->h[1];
+	c = ctx->h[2];
+	d = ctx->h[3];
+	e = ctx->h[4];
+	f = ctx->h[5];
+	g = ctx->h[6];
+	h = ctx->h[7];
+
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) +
+		     ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) +
+		     ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	ctx->h[0] += a;
+	ctx->h[1] += b;
+	ctx->h[2] += c;
+	ctx->h[3] += d;
+	ctx->h[4] += e;
+	ctx->h[5] += f;
+	ctx->h[6] += g;
+	ctx->h[7] += h;
+}
+
+void SHA256_init(struct sha256_ctx *ctx)
+{
+	static const uint32_t h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->h, h0, sizeof(h0));
+	ctx->total_len = 0;
+	ctx->block_len = 0;
+}
+
+void SHA256_update(struct sha256_ctx *ctx, const uint8_t *data, uint32_t len)
+{
+	uint32_t n;
+
+	ctx->total_len += len;
+
+	/* Top up a partial block first */
+	if (ctx->block_len) {
+		n = SHA256_BLOCK_SIZE - ctx->block_len;
+		if (n > len)
+			n = len;
+		memcpy(ctx->block + ctx->block_len, data, n);
+		ctx->block_len += n;
+		data += n;
+		len -= n;
+		if (ctx->block_len < SHA256_BLOCK_SIZE)
+			return;
+		sha256_transform(ctx, ctx->block);
+		ctx->block_len = 0;
+	}
+
+	/* Then hash whole blocks straight from the input */
+	for (; len >= SHA256_BLOCK_SIZE; len -= SHA256_BLOCK_SIZE) {
+		sha256_transform(ctx, data);
+		data += SHA256_BLOCK_SIZE;
+	}
+
+	memcpy(ctx->block, data, len);
+	ctx->block_len = len;
+}
+
+uint8_t *SHA256_final(struct sha256_ctx *ctx)
+{
+	uint64_t bits = ctx->total_len * 8;
+	int i;
+
+	/* Pad with 0x80, zeroes and the message length in bits */
+	ctx->block[ctx->block_len++] = 0x80;
+	if (ctx->block_len > SHA256_BLOCK_SIZE - 8) {
+		memset(ctx->block + ctx->block_len, 0,
+		       SHA256_BLOCK_SIZE - ctx->block_len);
+		sha256_transform(ctx, ctx->block);
+		ctx->block_len = 0;
+	}
+	memset(ctx->block + ctx->block_len, 0,
+	       SHA256_BLOCK_SIZE - 8 - ctx->block_len);
+	for (i = 0; i < 8; i++)
+		ctx->block[SHA256_BLOCK_SIZE - 1 - i] = bits >> (i * 8);
+	sha256_transform(ctx, ctx->block);
+
+	for (i = 0; i < 8; i++) {
+		ctx->buf[i * 4] = ctx->h[i] >> 24;
+		ctx->buf[i * 4 + 1] = ctx->h[i] >> 16;
+		ctx->buf[i * 4 + 2] = ctx->h[i] >> 8;
+		ctx->buf[i * 4 + 3] = ctx->h[i];
+	}
+	return ctx->buf;
+}
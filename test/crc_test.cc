@@ -0,0 +1,171 @@
+/* Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Check crc32_ctx_hash() against a bit-at-a-time CRC-32 over many lengths,
+ * alignments and ways of splitting the data, so the slicing and carry-less
+ * multiply kernels are both covered.  With --bench, measure throughput
+ * instead.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+
+#include "common.h"
+#include "crc.h"
+
+/* Largest length checked; several times the fold kernels' minimum */
+#define MAX_LEN 1024
+#define MAX_ALIGN 16
+
+static uint8_t data[MAX_LEN + MAX_ALIGN];
+
+/* Reference CRC-32 (reflected polynomial 0xEDB88320), one bit at a time */
+static uint32_t crc32_ref(const uint8_t *p, int size)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	int i;
+
+	while (size--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+	return crc ^ 0xFFFFFFFF;
+}
+
+static uint32_t crc32_split(const uint8_t *p, int size, int split)
+{
+	uint32_t ctx;
+
+	crc32_ctx_init(&ctx);
+	crc32_ctx_hash(&ctx, p, split);
+	crc32_ctx_hash(&ctx, p + split, size - split);
+	return crc32_ctx_result(&ctx);
+}
+
+static int run_tests(void)
+{
+	static const int splits[] = { 1, 7, 8, 15, 16, 63, 64, 65, 200 };
+	int failures = 0;
+	int align, len, i;
+	uint32_t want, got;
+	const uint8_t *p;
+
+	/* The classic check value */
+	if (crc32_split((const uint8_t *)"123456789", 9, 0) != 0xCBF43926) {
+		fprintf(stderr, "FAIL: check value\n");
+		failures++;
+	}
+
+	for (align = 0; align < MAX_ALIGN; align++) {
+		p = data + align;
+		for (len = 0; len <= MAX_LEN; len++) {
+			want = crc32_ref(p, len);
+
+			got = crc32_split(p, len, 0);
+			if (got != want) {
+				fprintf(stderr,
+					"FAIL: len %d align %d: %08x != %08x\n",
+					len, align, got, want);
+				failures++;
+			}
+
+			for (i = 0; i < (int)ARRAY_SIZE(splits); i++) {
+				if (splits[i] >= len)
+					break;
+				got = crc32_split(p, len, splits[i]);
+				if (got != want) {
+					fprintf(stderr,
+						"FAIL: len %d align %d split "
+						"%d: %08x != %08x\n",
+						len, align, splits[i], got,
+						want);
+					failures++;
+				}
+			}
+		}
+	}
+
+	/* The fixed-size helpers hash their argument's bytes in order */
+	crc32_init();
+	crc32_hash32(0x04030201);
+	crc32_hash16(0x0605);
+	want = crc32_ref((const uint8_t *)"\x01\x02\x03\x04\x05\x06", 6);
+	got = crc32_result();
+	if (got != want) {
+		fprintf(stderr, "FAIL: hash32/hash16: %08x != %08x\n", got,
+			want);
+		failures++;
+	}
+
+	printf("%s: %d failures\n", failures ? "FAIL" : "PASS", failures);
+	return failures ? 1 : 0;
+}
+
+static double bench_rate(const uint8_t *p, int size, bool ref)
+{
+	std::chrono::steady_clock::time_point start;
+	double elapsed;
+	uint32_t ctx;
+	long bytes = 0;
+
+	start = std::chrono::steady_clock::now();
+	do {
+		if (ref) {
+			ctx = crc32_ref(p, size);
+		} else {
+			crc32_ctx_init(&ctx);
+			crc32_ctx_hash(&ctx, p, size);
+		}
+		/* Keep the result live */
+		if (ctx == 0x12345678)
+			putchar('.');
+		bytes += size;
+		elapsed = std::chrono::duration<double>(
+				  std::chrono::steady_clock::now() - start)
+				  .count();
+	} while (elapsed < 0.2);
+
+	return bytes / elapsed / (1024 * 1024);
+}
+
+static int run_bench(void)
+{
+	static const int sizes[] = { 16, 64, 256, 4096, 65536, 1 << 20 };
+	uint8_t *buf;
+	int i;
+
+	buf = (uint8_t *)malloc(sizes[ARRAY_SIZE(sizes) - 1]);
+	if (!buf)
+		return 1;
+	for (i = 0; i < sizes[ARRAY_SIZE(sizes) - 1]; i++)
+		buf[i] = rand();
+
+	printf("%10s %14s %14s\n", "bytes", "crc32 MiB/s", "bitwise MiB/s");
+	for (i = 0; i < (int)ARRAY_SIZE(sizes); i++)
+		printf("%10d %14.1f %14.1f\n", sizes[i],
+		       bench_rate(buf, sizes[i], false),
+		       bench_rate(buf, sizes[i], true));
+
+	free(buf);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+
+	for (i = 0; i < (int)sizeof(data); i++)
+		data[i] = i * 0x9d + 0x31 + (i >> 8);
+
+	if (argc > 1 && !strcmp(argv[1], "--bench"))
+		return run_bench();
+	return run_tests();
+}
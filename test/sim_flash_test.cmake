@@ -0,0 +1,43 @@
+# Runs ectool against the simulated EC: erases, writes and verifies a
+# scratch range of flash in one batch (the simulator's flash only lasts
+# as long as the process), then checks a readback of it matches.
+#
+# cmake -DECTOOL=<path to ectool> -P sim_flash_test.cmake
+
+if(NOT ECTOOL)
+	message(FATAL_ERROR "ECTOOL not set")
+endif()
+
+# Above the simulated RO and RW images
+set(offset 0x40000)
+set(size 4096)
+
+# A pattern with no zero bytes, which CMake strings can't hold
+set(data "")
+foreach(i RANGE 1 ${size})
+	math(EXPR c "(${i} * 37) % 255 + 1")
+	string(ASCII ${c} ch)
+	string(APPEND data "${ch}")
+endforeach()
+file(WRITE sim_flash.bin "${data}")
+file(REMOVE sim_flash.out)
+
+file(WRITE sim_flash.batch
+	"flasherase ${offset} ${size}\n"
+	"flashwrite ${offset} sim_flash.bin\n"
+	"flashverify ${offset} sim_flash.bin\n"
+	"flashread ${offset} ${size} sim_flash.out\n")
+
+execute_process(
+	COMMAND ${ECTOOL} --interface=sim batch failfast sim_flash.batch
+	RESULT_VARIABLE rv)
+if(NOT rv EQUAL 0)
+	message(FATAL_ERROR "ectool batch failed: ${rv}")
+endif()
+
+execute_process(
+	COMMAND ${CMAKE_COMMAND} -E compare_files sim_flash.bin sim_flash.out
+	RESULT_VARIABLE rv)
+if(NOT rv EQUAL 0)
+	message(FATAL_ERROR "Flash readback does not match what was written")
+endif()